@@ -48,21 +48,149 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <stdbool.h>
-#include <math.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
 
 #include <CHERI_BGAS_fuse_devfs.h>
-#include <H2F_LW.h>
-#include <H2F.h>
+#include <fmem.h>
+#include <axi_ports.h>
+#include <axi_engine.h>
+#include <axi_poller.h>
+#include <port_watch.h>
+#include <devmap.h>
+#include <F2H.h>
+#include <page_cache.h>
+#include <read_cache.h>
+#include <dev_poll.h>
+#include <uart_stream.h>
+#include <dev_registry.h>
+#include <devfs_stats.h>
 
 #define MAX_PATH_LEN 1024
 
+// format a path into a MAX_PATH_LEN buffer, reporting the paths which do not
+// fit in it
+static bool format_path (char* path, const char* fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+static bool format_path (char* path, const char* fmt, ...) {
+  va_list args;
+  va_start (args, fmt);
+  int len = vsnprintf (path, MAX_PATH_LEN, fmt, args);
+  va_end (args);
+  if (len >= 0 && len < MAX_PATH_LEN) return true;
+  fprintf (stderr, "path too long: \"%s...\"\n", path);
+  return false;
+}
+
 typedef struct {
-  char simports_path[MAX_PATH_LEN];
+  char simports_path[MAX_PATH_LEN]; // the simulator served at the root, or
+  int n_nodes;                      // the simulators served in node folders
+  char** node_paths;
+  char** node_names;
   char workdir_path[MAX_PATH_LEN];
+  char* log; // "-o log=" option
+  char* coherence; // "-o coherence=" option
+  int cache_pages; // "-o cache_pages=" option
+  cache_mode_t cache_mode;
+  char* devmap; // "-o devmap=" option
+  devmap_t* map;
+  char* f2h_mem; // "-o f2h_mem=" option
+  long f2h_size; // "-o f2h_size=" option
+  char f2h_mem_path[MAX_PATH_LEN];
+  int posted_writes; // "-o posted_writes" option
+  int pollers; // "-o pollers=" option
+  unsigned timeout_ms; // "-o timeout_ms=" option
+  int poll_ms; // "-o poll_ms=" option
 } setup_ctxt_t;
 
+#define DEVFS_OPT(t, p) { t, offsetof (setup_ctxt_t, p), 1 }
+static const struct fuse_opt devfs_opts[] = {
+  DEVFS_OPT ("log=%s", log)
+, DEVFS_OPT ("coherence=%s", coherence)
+, DEVFS_OPT ("cache_pages=%d", cache_pages)
+, DEVFS_OPT ("devmap=%s", devmap)
+, DEVFS_OPT ("f2h_mem=%s", f2h_mem)
+, DEVFS_OPT ("f2h_size=%li", f2h_size)
+, DEVFS_OPT ("posted_writes", posted_writes)
+, DEVFS_OPT ("pollers=%d", pollers)
+, DEVFS_OPT ("timeout_ms=%u", timeout_ms)
+, DEVFS_OPT ("poll_ms=%d", poll_ms)
+, FUSE_OPT_END
+};
+
+#define DEFAULT_CACHE_PAGES 1024
+#define DEFAULT_F2H_SIZE 0x10000000
+#define DEFAULT_POLL_MS 10
+
 #define EXPOSE_SIMPORTS() ((sim_ports_t*) fuse_get_context()->private_data)
 
+// What a file is, resolved once when it is opened and kept in its file
+// handle, so that the operations on it need not look its path up again
+typedef enum {
+  DEVFS_FH_DEV     // a device, together with the simulator port to reach it
+, DEVFS_FH_STREAM  // the stream view of a device
+, DEVFS_FH_STATS   // a statistics file
+, DEVFS_FH_RESET   // the statistics reset file
+} devfs_fh_kind_t;
+
+typedef struct {
+  devfs_fh_kind_t kind;
+  union {
+    dev_entry_t* entry;
+    uart_stream_t* stream;
+    stats_snapshot_t* snap; // rendered when opened, or NULL
+  };
+} devfs_fh_t;
+
+// resolve the file of a path, without opening it, or return false if there
+// is none
+static bool devfs_fh_resolve (const char* path, devfs_fh_t* fh) {
+  sim_ports_t* simports = EXPOSE_SIMPORTS();
+  uart_stream_t* stream;
+  dev_entry_t* entry;
+  if (strcmp (path, STATS_RESET) == 0)
+    *fh = (devfs_fh_t) { .kind = DEVFS_FH_RESET };
+  else if (stats_is_path (path))
+    *fh = (devfs_fh_t) { .kind = DEVFS_FH_STATS, .snap = NULL };
+  else if ((stream = uart_stream_find ( simports->streams, simports->n_streams
+                                      , path )))
+    *fh = (devfs_fh_t) { .kind = DEVFS_FH_STREAM, .stream = stream };
+  else if ((entry = dev_registry_find (simports->devs, path)))
+    *fh = (devfs_fh_t) { .kind = DEVFS_FH_DEV, .entry = entry };
+  else return false;
+  return true;
+}
+
+// the file of an open file handle or, for the operations called without
+// one, the file of the path resolved into *tmp, with the port of a device
+// connected on first use; NULL if there is none
+static const devfs_fh_t* devfs_fh_get ( const char* path
+                                      , struct fuse_file_info* fi
+                                      , devfs_fh_t* tmp ) {
+  if (fi && fi->fh) return (const devfs_fh_t*) (uintptr_t) fi->fh;
+  if (!devfs_fh_resolve (path, tmp)) return NULL;
+  if (tmp->kind == DEVFS_FH_DEV) axi_sim_port_connect (tmp->entry->simport);
+  return tmp;
+}
+
+// record the latency of a FUSE operation on a device, and pass its result on
+static int dev_reply ( dev_entry_t* entry
+                     , axi_txn_kind_t kind
+                     , uint64_t t_entry
+                     , int ret ) {
+  lat_hist_record (&entry->stats.lat[kind][LAT_FUSE], lat_now () - t_entry);
+  return ret;
+}
+
+// the cache to go through to access a device, or NULL
+static page_cache_t* dev_cache ( const mem_mapped_dev_t* dev
+                               , const axi_sim_port_t* simport ) {
+  return dev->is_memory ? simport->cache : NULL;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void* _init (struct fuse_conn_info* conn, struct fuse_config* cfg) {
@@ -71,16 +199,115 @@ static void* _init (struct fuse_conn_info* conn, struct fuse_config* cfg) {
   setup_ctxt_t* pctxt = (setup_ctxt_t*) fuse_get_context()->private_data;
   // prepare simulation ports
   sim_ports_t* simports = (sim_ports_t*) malloc (sizeof (sim_ports_t));
-  // H2F LW interface
-  char h2flw_log_path[MAX_PATH_LEN];
-  sprintf (h2flw_log_path, "%s/%s", pctxt->workdir_path, "h2flw.log");
-  simports->h2flw = h2f_lw_init (pctxt->simports_path, h2flw_log_path);
-  // H2F interface
-  char h2f_log_path[MAX_PATH_LEN];
-  sprintf (h2f_log_path, "%s/%s", pctxt->workdir_path, "h2f.log");
-  simports->h2f = h2f_init (pctxt->simports_path, h2f_log_path);
-  // F2H interface TODO
-  simports->f2h = NULL;
+  // binary trace of all the ports
+  bool text = devfs_log_level == DEVFS_LOG_TEXT;
+  if (devfs_log_level == DEVFS_LOG_TRACE) {
+    char trace_path[MAX_PATH_LEN];
+    if (   !format_path (trace_path, "%s/%s", pctxt->workdir_path, "devfs.trace")
+        || trace_open (trace_path) < 0 ) exit (EXIT_FAILURE);
+  }
+  // the simulated nodes, a single one served at the root or one per folder
+  bool multi = pctxt->n_nodes > 0;
+  simports->n_nodes = multi ? pctxt->n_nodes : 1;
+  simports->nodes = malloc (simports->n_nodes * sizeof (sim_node_t));
+  for (int k = 0; k < simports->n_nodes; k++)
+    simports->nodes[k] = (sim_node_t)
+      { .name = multi ? strdup (pctxt->node_names[k]) : NULL
+      , .path = strdup (multi ? pctxt->node_paths[k] : pctxt->simports_path)
+      , .f2h = NULL };
+  // the ports of the device map for each node, and the registry of all their
+  // devices
+  devmap_t* map = pctxt->map;
+  simports->map = map;
+  simports->n_ports = simports->n_nodes * map->n_ports;
+  simports->ports = malloc (simports->n_ports * sizeof (axi_sim_port_t*));
+  simports->devs = dev_registry_create ();
+  simports->posted_writes = pctxt->posted_writes;
+  atomic_init (&simports->stats_since, lat_now ());
+  for (int k = 0; k < simports->n_nodes; k++) {
+    const sim_node_t* node = &simports->nodes[k];
+    for (int i = 0; i < map->n_ports; i++) {
+      const devmap_port_t* port = &map->ports[i];
+      char log_path[MAX_PATH_LEN];
+      bool fits = node->name
+        ? format_path ( log_path, "%s/%s.%s.log"
+                      , pctxt->workdir_path, node->name, port->name )
+        : format_path (log_path, "%s/%s.log", pctxt->workdir_path, port->name);
+      if (!fits) exit (EXIT_FAILURE);
+      axi_sim_port_t* simport =
+        axi_sim_port_init ( port->name, node->name, port->fns
+                          , port->devs, port->n_devs
+                          , node->path, text ? log_path : NULL );
+      simports->ports[k * map->n_ports + i] = simport;
+      uint32_t timeout_ms = port->timeout_ms ? port->timeout_ms : pctxt->timeout_ms;
+      simport->timeout_ns = timeout_ms * 1000000ull;
+      dev_registry_add (simports->devs, port->devs, port->n_devs, simport, node->name);
+      // host side cache of the memory devices
+      if (   pctxt->cache_mode != CACHE_UNCACHED
+          && devs_have_memory (port->devs, port->n_devs) )
+        simport->cache = page_cache_create ( simport, pctxt->cache_mode
+                                           , pctxt->cache_pages );
+    }
+  }
+  dev_registry_build (simports->devs);
+  // host side copies of the read-mostly registers which their cache policy
+  // allows, for the devices which do not go through the page cache
+  for (int i = 0; i < simports->devs->n_entries; i++) {
+    dev_entry_t* e = &simports->devs->entries[i];
+    if (   e->dev->cache_policy != DEV_CACHE_NONE
+        && !dev_cache (e->dev, e->simport) )
+      e->rcache = read_cache_create (e->simport, e->dev, &e->stats);
+  }
+  for (int i = 0; i < simports->n_ports; i++)
+    simports->ports[i]->devs = simports->devs;
+  // the pollers receive the responses of the ports they can watch once
+  // connected, the nodes being spread across them (one per node and CPU by
+  // default)
+  int n_pollers = pctxt->pollers;
+  if (n_pollers <= 0) n_pollers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (n_pollers > simports->n_nodes) n_pollers = simports->n_nodes;
+  if (n_pollers < 1) n_pollers = 1;
+  simports->n_pollers = n_pollers;
+  simports->pollers = malloc (n_pollers * sizeof (axi_poller_t*));
+  for (int j = 0; j < n_pollers; j++)
+    simports->pollers[j] = axi_poller_create (simports->n_ports);
+  for (int i = 0; i < simports->n_ports; i++) {
+    int j = (i / map->n_ports) % n_pollers;
+    simports->ports[i]->poller = simports->pollers[j];
+  }
+  for (int j = 0; j < n_pollers; j++) axi_poller_start (simports->pollers[j]);
+  // the polls of the devices with a status register wait for it to be set,
+  // the F2H writes of the simulated systems having it checked early
+  simports->events = dev_poller_create (simports->devs, pctxt->poll_ms);
+  // the stream views of the UART-like devices, polled as often when idle
+  simports->streams =
+    uart_streams_create (simports->devs, pctxt->poll_ms, &simports->n_streams);
+  // let the kernel gather writes to mapped pages in write-back mode
+  if (   pctxt->cache_mode == CACHE_WRITEBACK
+      && (conn->capable & FUSE_CAP_WRITEBACK_CACHE) )
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+  // F2H interface of each node, backed by a file per node
+  for (int k = 0; k < simports->n_nodes; k++) {
+    sim_node_t* node = &simports->nodes[k];
+    char f2h_log_path[MAX_PATH_LEN];
+    char f2h_mem_path[MAX_PATH_LEN];
+    bool fits = node->name
+      ? (   format_path ( f2h_log_path, "%s/%s.%s"
+                        , pctxt->workdir_path, node->name, "f2h.log" )
+         && format_path (f2h_mem_path, "%s.%s", pctxt->f2h_mem_path, node->name) )
+      : (   format_path (f2h_log_path, "%s/%s", pctxt->workdir_path, "f2h.log")
+         && format_path (f2h_mem_path, "%s", pctxt->f2h_mem_path) );
+    if (!fits) exit (EXIT_FAILURE);
+    node->f2h = f2h_init ( node->name, node->path, text ? f2h_log_path : NULL
+                         , f2h_mem_path, pctxt->f2h_size
+                         , dev_poller_kick, simports->events );
+  }
+  // the ports connect on first use, and the F2H ports as soon as their
+  // simulator exposes them, all following their simulator's restarts, and the
+  // transactions of the ports are abandoned past their timeout or when their
+  // FUSE request is interrupted
+  simports->watch = port_watch_create (simports);
+  axi_interrupted = fuse_interrupted;
   // return simulator ports
   return (void*) simports;
 }
@@ -88,9 +315,34 @@ static void* _init (struct fuse_conn_info* conn, struct fuse_config* cfg) {
 static void _destroy (void* private_data) {
   printf ("cheri-bgas-fuse-devfs -- destroy\n");
   sim_ports_t* simports = EXPOSE_SIMPORTS();
-  //TODO f2h_destroy (simports->f2h);
-  h2f_destroy (simports->h2f);
-  h2f_lw_destroy (simports->h2flw);
+  if (simports->watch) port_watch_destroy (simports->watch);
+  for (int k = 0; k < simports->n_nodes; k++)
+    if (simports->nodes[k].f2h) f2h_destroy (simports->nodes[k].f2h);
+  dev_poller_destroy (simports->events);
+  uart_streams_destroy (simports->streams, simports->n_streams);
+  // the pollers answer the last cache write-backs and posted writes, and stop
+  // once the ports are disconnected
+  for (int i = 0; i < simports->n_ports; i++) {
+    if (simports->ports[i]->cache) page_cache_destroy (simports->ports[i]->cache);
+    axi_drain_posted (simports->ports[i]);
+  }
+  for (int i = 0; i < simports->n_ports; i++)
+    axi_sim_port_destroy (simports->ports[i]);
+  for (int j = 0; j < simports->n_pollers; j++)
+    axi_poller_destroy (simports->pollers[j]);
+  trace_close ();
+  for (int i = 0; i < simports->devs->n_entries; i++)
+    if (simports->devs->entries[i].rcache)
+      read_cache_destroy (simports->devs->entries[i].rcache);
+  dev_registry_destroy (simports->devs);
+  devmap_destroy (simports->map);
+  for (int k = 0; k < simports->n_nodes; k++) {
+    free (simports->nodes[k].name);
+    free (simports->nodes[k].path);
+  }
+  free (simports->nodes);
+  free (simports->pollers);
+  free (simports->ports);
   free (simports);
   //free (ctxt);
 }
@@ -98,54 +350,568 @@ static void _destroy (void* private_data) {
 static int _getattr ( const char* path
                     , struct stat* st
                     , struct fuse_file_info* fi ) {
-  printf ("cheri-bgas-fuse-devfs -- getattr\n");
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- getattr\n");
   st->st_uid = getuid ();
   st->st_gid = getgid ();
   st->st_atime = time (NULL);
   st->st_mtime = time (NULL);
-  //sim_ports_t* simports = EXPOSE_SIMPORTS();
-  if (strcmp (path, "/") == 0) {
+  const dev_entry_t* entry = NULL;
+  const char* rest = NULL;
+  const sim_node_t* node = sim_node_find (EXPOSE_SIMPORTS(), path, &rest);
+  if (strcmp (path, "/") == 0 || (node && node->name && *rest == '\0')) {
     st->st_mode = S_IFDIR | 0755;
     st->st_nlink = 2;
-  } else if (   devs_find (path, h2f_lw_devs, n_h2f_lw_devs) != NULL
-             || devs_find (path, h2f_devs, n_h2f_devs) != NULL) {
+  } else if (node && node->f2h && strcmp (rest, F2H_MEM_ENTRY) == 0) {
+    st->st_mode = S_IFLNK | 0777;
+    st->st_nlink = 1;
+    st->st_size = strlen (node->f2h->mem_path);
+  } else if (stats_is_path (path)) {
+    // statistics are rendered when opened, so have no size until then
+    st->st_mode = stats_mode (EXPOSE_SIMPORTS(), path);
+    if (!st->st_mode) return -ENOENT;
+    st->st_nlink = S_ISDIR (st->st_mode) ? 2 : 1;
+    st->st_size = 0;
+  } else if (uart_stream_find ( EXPOSE_SIMPORTS()->streams
+                              , EXPOSE_SIMPORTS()->n_streams, path )) {
+    // streams have no size, like ttys
     st->st_mode = S_IFREG | 0644;
     st->st_nlink = 1;
     st->st_size = 0;
+  } else if ((entry = dev_registry_find (EXPOSE_SIMPORTS()->devs, path))) {
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = entry->dev->range;
   } else return -ENOENT;
   return 0;
 }
 
+// list the devices of a node
+static void readdir_devs ( void* entries
+                         , fuse_fill_dir_t add_entry
+                         , const dev_registry_t* devs
+                         , const sim_node_t* node ) {
+  for (int i = 0; i < devs->n_entries; i++)
+    if (devs->entries[i].node == node->name)
+      add_entry (entries, devs->entries[i].dev->name, NULL, 0, 0);
+}
+
 static int _readdir ( const char* path
                     , void* entries
                     , fuse_fill_dir_t add_entry
                     , off_t offset
                     , struct fuse_file_info* fi
                     , enum fuse_readdir_flags flags ) {
-  printf ("cheri-bgas-fuse-devfs -- readdir\n");
-  if (strcmp (path, "/") != 0) return -ENOENT;
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- readdir\n");
+  const sim_ports_t* simports = EXPOSE_SIMPORTS();
+  const dev_registry_t* devs = simports->devs;
+  bool multi = simports->nodes[0].name != NULL;
+  const char* rest = NULL;
+  const sim_node_t* stats = stats_node (simports, path);
+  const sim_node_t* node = sim_node_find (simports, path, &rest);
+  bool root = strcmp (path, "/") == 0;
+  bool node_dir = multi ? (node && *rest == '\0') : root;
+  if (strcmp (path, STATS_DIR) != 0 && !stats && !root && !node_dir)
+    return -ENOENT;
   add_entry (entries, ".", NULL, 0, 0);
   add_entry (entries, "..", NULL, 0, 0);
-  for (int i = 0; i < n_h2f_lw_devs; i++)
-    add_entry (entries, h2f_lw_devs[i].name, NULL, 0, 0);
-  for (int i = 0; i < n_h2f_devs; i++)
-    add_entry (entries, h2f_devs[i].name, NULL, 0, 0);
+  if (strcmp (path, STATS_DIR) == 0) {
+    add_entry (entries, STATS_COUNTERS + strlen (STATS_DIR "/"), NULL, 0, 0);
+    add_entry (entries, STATS_METRICS + strlen (STATS_DIR "/"), NULL, 0, 0);
+    add_entry (entries, STATS_RESET + strlen (STATS_DIR "/"), NULL, 0, 0);
+    add_entry (entries, STATS_WATCHDOG + strlen (STATS_DIR "/"), NULL, 0, 0);
+    // the devices' statistics, in a folder per node when serving several
+    for (int k = 0; k < simports->n_nodes; k++)
+      if (multi) add_entry (entries, simports->nodes[k].name, NULL, 0, 0);
+      else readdir_devs (entries, add_entry, devs, &simports->nodes[k]);
+    return 0;
+  }
+  if (stats) {
+    readdir_devs (entries, add_entry, devs, stats);
+    return 0;
+  }
+  if (root) add_entry (entries, STATS_DIR + 1, NULL, 0, 0);
+  if (root && multi) {
+    for (int k = 0; k < simports->n_nodes; k++)
+      add_entry (entries, simports->nodes[k].name, NULL, 0, 0);
+    return 0;
+  }
+  // the devices of a node, at the root when serving a single one
+  readdir_devs (entries, add_entry, devs, node);
+  for (int i = 0; i < simports->n_streams; i++)
+    if (simports->streams[i].entry->node == node->name)
+      add_entry ( entries, simports->streams[i].name
+                           + (node->name ? strlen (node->name) + 1 : 0)
+                , NULL, 0, 0 );
+  if (node->f2h) add_entry (entries, F2H_MEM_ENTRY + 1, NULL, 0, 0);
   return 0;
 }
 
+// the F2H memory entry is a link to the backing file, so that mapping it
+// shares the pages the F2H port serves the simulated system from
+static int _readlink (const char* path, char* buf, size_t size) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- readlink\n");
+  const char* rest = NULL;
+  const sim_node_t* node = sim_node_find (EXPOSE_SIMPORTS(), path, &rest);
+  if (!node || !node->f2h || strcmp (rest, F2H_MEM_ENTRY) != 0) return -ENOENT;
+  strncpy (buf, node->f2h->mem_path, size - 1);
+  buf[size - 1] = '\0';
+  return 0;
+}
+
+// keep the file opened in a file handle
+static void devfs_fh_keep (struct fuse_file_info* fi, const devfs_fh_t* fh) {
+  devfs_fh_t* kept = malloc (sizeof (devfs_fh_t));
+  *kept = *fh;
+  fi->fh = (uint64_t) (uintptr_t) kept;
+}
+
 static int _open (const char* path, struct fuse_file_info* fi) {
-  printf ("cheri-bgas-fuse-devfs -- open\n");
-  if (   strcmp (path, "/") == 0
-      || devs_find (path, h2f_lw_devs, n_h2f_lw_devs) != NULL
-      || devs_find (path, h2f_devs, n_h2f_devs) != NULL ) return 0;
-  return -ENOENT;
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- open\n");
+  if (strcmp (path, "/") == 0) return 0;
+  devfs_fh_t fh;
+  if (!devfs_fh_resolve (path, &fh)) return -ENOENT;
+  if (fh.kind == DEVFS_FH_RESET) {
+    if ((fi->flags & O_ACCMODE) != O_WRONLY) return -EACCES;
+    fi->direct_io = 1;
+    devfs_fh_keep (fi, &fh);
+    return 0;
+  }
+  if (fh.kind == DEVFS_FH_STATS) {
+    // other statistics are read-only, and rendered once per open
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    int ret = stats_snapshot (EXPOSE_SIMPORTS(), path, &fh.snap);
+    if (ret < 0) return ret;
+    fi->direct_io = 1;
+    devfs_fh_keep (fi, &fh);
+    return 0;
+  }
+  if (fh.kind == DEVFS_FH_STREAM) {
+    int ret = axi_sim_port_connect (fh.stream->entry->simport);
+    if (ret < 0) return ret;
+    uart_stream_open (fh.stream);
+    fi->direct_io = 1;
+    fi->nonseekable = 1;
+    devfs_fh_keep (fi, &fh);
+    return 0;
+  }
+  dev_entry_t* entry = fh.entry;
+  // the device's port connects to the simulator on first use
+  int ret = axi_sim_port_connect (entry->simport);
+  if (ret < 0) return ret;
+  devfs_fh_keep (fi, &fh);
+  if (dev_cache (entry->dev, entry->simport)) {
+    // cached memory devices go through the kernel page cache, which makes
+    // them mappable, but start afresh on each open as ioctls bypass it
+    fi->direct_io = 0;
+    fi->keep_cache = 0;
+  } else {
+    // device memory must not be cached by the kernel, and each read / write
+    // must reach the simulator with its original offset and size
+    fi->direct_io = 1;
+  }
+  return 0;
 }
 
-struct fmem_request {
-  uint32_t offset;
-  uint32_t data;
-  uint32_t access_width;
-};
+static int _read ( const char* path
+                 , char* buf
+                 , size_t size
+                 , off_t offset
+                 , struct fuse_file_info* fi ) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- read\n");
+  uint64_t t_entry = lat_now ();
+  devfs_fh_t tmp;
+  const devfs_fh_t* fh = devfs_fh_get (path, fi, &tmp);
+  if (!fh) return -ENOENT;
+  if (fh->kind == DEVFS_FH_STREAM)
+    return uart_stream_read ( fh->stream, (uint8_t*) buf, size
+                            , fi && (fi->flags & O_NONBLOCK) );
+  if (fh->kind != DEVFS_FH_DEV) {
+    const stats_snapshot_t* snap = (fh->kind == DEVFS_FH_STATS) ? fh->snap : NULL;
+    if (!snap) return -EBADF;
+    if (offset < 0 || (size_t) offset >= snap->len) return 0;
+    if (size > snap->len - offset) size = snap->len - offset;
+    memcpy (buf, snap->buf + offset, size);
+    return size;
+  }
+  dev_entry_t* entry = fh->entry;
+  const mem_mapped_dev_t* dev = entry->dev;
+  axi_sim_port_t* simport = entry->simport;
+  // clamp the access to the device range
+  if (offset < 0) return -EINVAL;
+  if ((uint64_t) offset >= dev->range) return 0;
+  if (size > dev->range - offset) size = dev->range - offset;
+  // read the range through the caches, or as a sequence of pipelined AXI4 INCR
+  // bursts, once the posted writes before it landed
+  uint64_t addr = dev->base_addr + offset;
+  if (!entry->rcache) axi_drain_posted (simport);
+  page_cache_t* cache = dev_cache (dev, simport);
+  int ret;
+  if (cache) ret = page_cache_read (cache, addr, (uint8_t*) buf, size);
+  else if (entry->rcache)
+    ret = read_cache_read (entry->rcache, addr, (uint8_t*) buf, size);
+  else ret = axi_read (simport, addr, (uint8_t*) buf, size);
+  return dev_reply (entry, AXI_TXN_READ, t_entry, ret < 0 ? ret : (int) size);
+}
+
+static int _write ( const char* path
+                  , const char* buf
+                  , size_t size
+                  , off_t offset
+                  , struct fuse_file_info* fi ) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- write\n");
+  uint64_t t_entry = lat_now ();
+  devfs_fh_t tmp;
+  const devfs_fh_t* fh = devfs_fh_get (path, fi, &tmp);
+  if (!fh) return -ENOENT;
+  if (fh->kind == DEVFS_FH_RESET) {
+    stats_reset (EXPOSE_SIMPORTS());
+    return size;
+  }
+  if (fh->kind == DEVFS_FH_STATS) return -EACCES;
+  if (fh->kind == DEVFS_FH_STREAM)
+    return uart_stream_write ( fh->stream, (const uint8_t*) buf, size
+                             , fi && (fi->flags & O_NONBLOCK) );
+  dev_entry_t* entry = fh->entry;
+  const mem_mapped_dev_t* dev = entry->dev;
+  axi_sim_port_t* simport = entry->simport;
+  // writes past the end of the device range are rejected
+  if (offset < 0) return -EINVAL;
+  if ((uint64_t) offset >= dev->range) return -ENOSPC;
+  if (size > dev->range - offset) size = dev->range - offset;
+  // write the range through the cache, or as a sequence of pipelined AXI4 INCR
+  // bursts, which are posted in posted writes mode
+  uint64_t addr = dev->base_addr + offset;
+  page_cache_t* cache = dev_cache (dev, simport);
+  int ret = 0;
+  if (cache) ret = page_cache_write (cache, addr, (const uint8_t*) buf, size);
+  else if (EXPOSE_SIMPORTS()->posted_writes)
+    axi_write_posted (simport, addr, (const uint8_t*) buf, size);
+  else ret = axi_write (simport, addr, (const uint8_t*) buf, size);
+  if (entry->rcache) read_cache_invalidate (entry->rcache, addr, size);
+  return dev_reply (entry, AXI_TXN_WRITE, t_entry, ret < 0 ? ret : (int) size);
+}
+
+// writing to the statistics reset file may first truncate it
+static int _truncate (const char* path, off_t size, struct fuse_file_info* fi) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- truncate\n");
+  return (strcmp (path, STATS_RESET) == 0) ? 0 : -EINVAL;
+}
+
+// write the dirty cached pages of a device back to the simulator, wait for
+// the posted writes to be answered, and report any of them which failed since
+// the last sync
+static int dev_sync (dev_entry_t* entry) {
+  page_cache_t* cache = dev_cache (entry->dev, entry->simport);
+  int ret = cache ? page_cache_writeback (cache) : 0;
+  axi_drain_posted (entry->simport);
+  unsigned long errors = atomic_load (&entry->stats.posted_errors);
+  if (atomic_exchange (&entry->stats.reported, errors) != errors && ret == 0)
+    ret = -EIO;
+  return ret;
+}
+
+static int _flush (const char* path, struct fuse_file_info* fi) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- flush\n");
+  devfs_fh_t tmp;
+  const devfs_fh_t* fh = devfs_fh_get (path, fi, &tmp);
+  if (!fh) return -ENOENT;
+  return (fh->kind == DEVFS_FH_DEV) ? dev_sync (fh->entry) : 0;
+}
+
+static int _fsync ( const char* path
+                  , int datasync
+                  , struct fuse_file_info* fi ) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- fsync\n");
+  devfs_fh_t tmp;
+  const devfs_fh_t* fh = devfs_fh_get (path, fi, &tmp);
+  if (!fh) return -ENOENT;
+  // streams wait for their buffered bytes to be sent
+  if (fh->kind == DEVFS_FH_STREAM) return uart_stream_sync (fh->stream);
+  return (fh->kind == DEVFS_FH_DEV) ? dev_sync (fh->entry) : 0;
+}
+
+static int _release (const char* path, struct fuse_file_info* fi) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- release\n");
+  devfs_fh_t* fh = (devfs_fh_t*) (uintptr_t) fi->fh;
+  if (!fh) return 0;
+  if (fh->kind == DEVFS_FH_STATS) stats_snapshot_free (fh->snap);
+  else if (fh->kind == DEVFS_FH_STREAM) uart_stream_release (fh->stream);
+  else if (fh->kind == DEVFS_FH_DEV) dev_sync (fh->entry);
+  free (fh);
+  fi->fh = 0;
+  return 0;
+}
+
+// Check a single access to a device, whose bytes may be at any offset and
+// span several beats, and make it coherent with the device's cache, which
+// single accesses bypass. Sets the accessed address.
+static int fmem_range ( axi_sim_port_t* simport
+                      , const mem_mapped_dev_t* dev
+                      , uint64_t offset
+                      , uint32_t access_width
+                      , uint64_t* addr ) {
+  if (access_width == 0 || access_width > FMEM_MAX_ACCESS_WIDTH) return -EINVAL;
+  if (access_width > dev->range || offset > dev->range - access_width)
+    return -ERANGE;
+  *addr = dev->base_addr + offset;
+  page_cache_t* cache = dev_cache (dev, simport);
+  if (cache) {
+    int ret = page_cache_invalidate (cache, *addr, access_width);
+    if (ret < 0) return ret;
+  }
+  return 0;
+}
+
+// Prepare the AXI4 transactions of a single access to a device, from or into
+// its data: a single narrow beat when the access fits in a beat, or else a
+// burst over the beats it spans, the part of an access past a 4KiB boundary
+// taking a second transaction, its tail. The write strobes select exactly the
+// accessed bytes. Returns the number of transactions, or a negative error.
+static int fmem_txn ( axi_sim_port_t* simport
+                    , const mem_mapped_dev_t* dev
+                    , axi_txn_kind_t kind
+                    , uint64_t offset
+                    , uint32_t access_width
+                    , uint8_t* data
+                    , axi_txn_t* txn
+                    , axi_txn_t* tail ) {
+  uint64_t addr;
+  int ret = fmem_range (simport, dev, offset, access_width, &addr);
+  if (ret != 0) return ret;
+  int data_width_bytes = simport->fns->data_width_bytes;
+  size_t head = axi_burst_chunk (addr, access_width, data_width_bytes);
+  axi_txn_burst (txn, kind, data_width_bytes, addr, head);
+  txn->rdst = data;
+  if (head == access_width) return 1;
+  axi_txn_burst ( tail, kind, data_width_bytes
+                , addr + head, access_width - head );
+  tail->rdst = data + head;
+  return 2;
+}
+
+// submit the transactions of a batch access, and wait for them to complete
+static void fmem_submit ( axi_sim_port_t* simport
+                        , axi_txn_t* txn
+                        , axi_txn_t* tail
+                        , int n ) {
+  axi_submit (simport, txn);
+  if (n > 1) axi_submit (simport, tail);
+}
+
+static int fmem_wait ( axi_sim_port_t* simport
+                     , axi_txn_t* txn
+                     , axi_txn_t* tail
+                     , int n ) {
+  int status = axi_wait (simport, txn);
+  if (n > 1) {
+    int tail_status = axi_wait (simport, tail);
+    if (status == 0) status = tail_status;
+  }
+  return status;
+}
+
+// Perform a single access of a fmem request, from or into its data, split
+// into as few transactions as its beats allow (or read from the device's read
+// cache, which its writes invalidate)
+static int fmem_single ( dev_entry_t* entry
+                       , axi_txn_kind_t kind
+                       , uint64_t offset
+                       , uint32_t access_width
+                       , uint8_t* data
+                       , uint64_t t_entry ) {
+  axi_sim_port_t* simport = entry->simport;
+  uint64_t addr;
+  int ret = fmem_range (simport, entry->dev, offset, access_width, &addr);
+  if (ret != 0) return ret;
+  if (kind == AXI_TXN_READ && entry->rcache)
+    ret = read_cache_read (entry->rcache, addr, data, access_width);
+  else if (kind == AXI_TXN_READ) {
+    axi_drain_posted (simport);
+    ret = axi_read (simport, addr, data, access_width);
+  } else {
+    if (EXPOSE_SIMPORTS()->posted_writes)
+      axi_write_posted (simport, addr, data, access_width);
+    else ret = axi_write (simport, addr, data, access_width);
+    if (entry->rcache) read_cache_invalidate (entry->rcache, addr, access_width);
+  }
+  return dev_reply (entry, kind, t_entry, ret);
+}
+
+// A write of a batch to a beat which the batch's previous access (a write as
+// well) also writes, without overlapping its bytes, is merged into that
+// write's transaction, which then writes from a beat buffer under a mask
+typedef struct {
+  uint64_t addr;                            // of the beat
+  uint8_t data[FMEM_MAX_ACCESS_WIDTH];
+  uint8_t written[FMEM_MAX_ACCESS_WIDTH / 8]; // bit i for addr + i
+  uint8_t wmask[FMEM_MAX_ACCESS_WIDTH / 8];   // from the first written byte
+} fmem_beat_t;
+
+// whether a batch access can be merged with other writes to its beat
+static bool fmem_op_mergeable ( const struct fmem_op* op
+                              , const mem_mapped_dev_t* dev
+                              , int dwb ) {
+  uint64_t first = dev->base_addr + op->offset;
+  uint64_t last = first + op->access_width - 1;
+  return op->cmd == FMEM_OP_WRITE && op->flags == 0
+      && op->access_width >= 1 && op->access_width <= sizeof (op->data)
+      && (first & ~((uint64_t) dwb - 1)) == (last & ~((uint64_t) dwb - 1));
+}
+
+// add the bytes of a write at an address to a beat buffer, if they are not
+// written already
+static bool fmem_beat_add ( fmem_beat_t* beat
+                          , uint64_t addr
+                          , const uint8_t* data
+                          , int len ) {
+  int first = addr - beat->addr;
+  for (int i = first; i < first + len; i++)
+    if ((beat->written[i / 8] >> (i % 8)) & 1) return false;
+  for (int i = first; i < first + len; i++) {
+    beat->data[i] = data[i - first];
+    beat->written[i / 8] |= 1 << (i % 8);
+  }
+  return true;
+}
+
+// turn the transaction of a write into a masked write of its beat buffer
+static void fmem_beat_txn (fmem_beat_t* beat, axi_txn_t* txn, int dwb) {
+  int first = dwb, last = 0;
+  for (int i = 0; i < dwb; i++)
+    if ((beat->written[i / 8] >> (i % 8)) & 1) {
+      if (i < first) first = i;
+      last = i;
+    }
+  memset (beat->wmask, 0, sizeof (beat->wmask));
+  for (int i = first; i <= last; i++)
+    if ((beat->written[i / 8] >> (i % 8)) & 1)
+      beat->wmask[(i - first) / 8] |= 1 << ((i - first) % 8);
+  axi_txn_burst (txn, AXI_TXN_WRITE, dwb, beat->addr + first, last - first + 1);
+  txn->wsrc = beat->data + first;
+  txn->wmask = beat->wmask;
+}
+
+// Perform a batch of accesses, submitting them without waiting for the
+// previous ones to complete, except across fences, read-backs and comparisons.
+// Consecutive writes to distinct bytes of a beat are merged into a single
+// masked write, which is only submitted once the next access is known.
+static int fmem_batch ( axi_sim_port_t* simport
+                      , const mem_mapped_dev_t* dev
+                      , struct fmem_batch* batch ) {
+  if (batch->count > FMEM_BATCH_MAX) return -EINVAL;
+  // the batch's accesses are spread across IDs, so must follow the posted
+  // writes rather than overtake them
+  axi_drain_posted (simport);
+  int dwb = simport->fns->data_width_bytes;
+  axi_txn_t txns[FMEM_BATCH_MAX];
+  axi_txn_t tails[FMEM_BATCH_MAX]; // of the accesses crossing a 4KiB boundary
+  int n_txns[FMEM_BATCH_MAX];      // 2 for an access with a tail, or else 1
+  fmem_beat_t beats[FMEM_BATCH_MAX];
+  int carrier[FMEM_BATCH_MAX]; // the access whose transaction performs each
+  int result[FMEM_BATCH_MAX];  // the status of each carrier's transaction
+  int pending[FMEM_BATCH_MAX]; // submitted accesses, in submission order
+  int n_pending = 0;
+  int open = -1;               // a write to merge the next one into
+  int n_merged = 0;            // writes merged into the open one
+  bool stop = false;
+  batch->completed = 0;
+  for (uint32_t i = 0; i <= batch->count; i++) {
+    struct fmem_op* op = (i < batch->count) ? &batch->ops[i] : NULL;
+    bool last = !op;
+    // merge a write into the open one when possible, or else submit the open
+    // one
+    if (   open >= 0 && !last && !stop && fmem_op_mergeable (op, dev, dwb)
+        && ((dev->base_addr + op->offset) & ~((uint64_t) dwb - 1)) == beats[open].addr ) {
+      uint64_t addr;
+      int ret = fmem_range (simport, dev, op->offset, op->access_width, &addr);
+      if (ret != 0) {
+        op->status = ret;
+        batch->completed++;
+        continue;
+      }
+      if (fmem_beat_add (&beats[open], addr, (const uint8_t*) &op->data, op->access_width)) {
+        carrier[i] = open;
+        pending[n_pending++] = i;
+        n_merged++;
+        continue;
+      }
+    }
+    if (open >= 0) {
+      if (n_merged > 0) fmem_beat_txn (&beats[open], &txns[open], dwb);
+      axi_submit (simport, &txns[open]);
+      open = -1;
+    }
+    // retire the pending accesses when required
+    if (   last || stop || (op->flags & FMEM_OP_FENCE)
+        || (n_pending > 0 &&
+            (batch->ops[pending[n_pending - 1]].flags & FMEM_OP_COMPARE)) ) {
+      for (int k = 0; k < n_pending; k++) {
+        int j = pending[k];
+        struct fmem_op* done = &batch->ops[j];
+        if (carrier[j] == j)
+          result[j] = fmem_wait (simport, &txns[j], &tails[j], n_txns[j]);
+        int s = result[carrier[j]];
+        done->status = s < 0 ? s : FMEM_OP_OK;
+        if (   s == 0 && (done->flags & FMEM_OP_COMPARE)
+            && ((done->data ^ done->expect) & done->mask) != 0 ) {
+          done->status = FMEM_OP_MISMATCH;
+          stop = true;
+        }
+        batch->completed++;
+      }
+      n_pending = 0;
+    }
+    if (last) break;
+    if (stop) {
+      op->status = FMEM_OP_SKIPPED;
+      continue;
+    }
+    // submit the access
+    axi_txn_t* txn = &txns[i];
+    axi_txn_t* tail = &tails[i];
+    uint8_t* data = (uint8_t*) &op->data;
+    bool write = op->cmd == FMEM_OP_WRITE;
+    int ret = (op->access_width > sizeof (op->data)) ? -EINVAL
+            : fmem_txn ( simport, dev, write ? AXI_TXN_WRITE : AXI_TXN_READ
+                       , op->offset, op->access_width, data, txn, tail );
+    if (ret < 0) {
+      op->status = ret;
+      batch->completed++;
+      continue;
+    }
+    n_txns[i] = ret;
+    carrier[i] = i;
+    if (write) {
+      if (fmem_op_mergeable (op, dev, dwb)) {
+        // keep the write open for the next ones to merge into it
+        fmem_beat_t* beat = &beats[i];
+        beat->addr = txn->addr & ~((uint64_t) dwb - 1);
+        memset (beat->written, 0, sizeof (beat->written));
+        fmem_beat_add (beat, txn->addr, txn->wsrc, txn->len);
+        open = i;
+        n_merged = 0;
+        pending[n_pending++] = i;
+        continue;
+      }
+      if (op->flags & FMEM_OP_READBACK) {
+        // the read must only be issued once the write completed
+        fmem_submit (simport, txn, tail, n_txns[i]);
+        int status = fmem_wait (simport, txn, tail, n_txns[i]);
+        if (status < 0) {
+          op->status = status;
+          batch->completed++;
+          continue;
+        }
+        op->data = 0;
+        fmem_txn ( simport, dev, AXI_TXN_READ
+                 , op->offset, op->access_width, data, txn, tail );
+      }
+    } else op->data = 0;
+    fmem_submit (simport, txn, tail, n_txns[i]);
+    pending[n_pending++] = i;
+  }
+  return 0;
+}
 
 static int _ioctl ( const char* path
                   , unsigned int cmd
@@ -153,167 +919,146 @@ static int _ioctl ( const char* path
                   , struct fuse_file_info* fi
                   , unsigned int flags
                   , void* data ) {
-  printf ("cheri-bgas-fuse-devfs -- ioctl\n");
-  sim_ports_t* simports = EXPOSE_SIMPORTS();
-  struct fmem_request* fmemReq = (struct fmem_request*) data;
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- ioctl\n");
 
-  // find device and initialize axi functions
-  const mem_mapped_dev_t* dev = NULL;
-  t_axi4_awflit* (*aw_create_flit) (const uint8_t* raw_flit) = NULL;
-  t_axi4_wflit*  (*w_create_flit)  (const uint8_t* raw_flit) = NULL;
-  t_axi4_bflit*  (*b_create_flit)  (const uint8_t* raw_flit) = NULL;
-  t_axi4_arflit* (*ar_create_flit) (const uint8_t* raw_flit) = NULL;
-  t_axi4_rflit*  (*r_create_flit)  (const uint8_t* raw_flit) = NULL;
-  void (*aw_fprint_flit) (FILE* f, const t_axi4_awflit* flit) = NULL;
-  void (*w_fprint_flit)  (FILE* f, const t_axi4_wflit* flit)  = NULL;
-  void (*b_fprint_flit)  (FILE* f, const t_axi4_bflit* flit)  = NULL;
-  void (*ar_fprint_flit) (FILE* f, const t_axi4_arflit* flit) = NULL;
-  void (*r_fprint_flit)  (FILE* f, const t_axi4_rflit* flit)  = NULL;
-  axi_sim_port_t* simport = NULL;
-  uint64_t offset_mask = (~0 << (int) log2 (fmemReq->access_width));
-  int data_width_bytes = 0;
-  if ((dev = devs_find (path, h2f_lw_devs, n_h2f_lw_devs))) {
-    aw_create_flit = &H2F_LW_AW_(create_flit);
-    w_create_flit  = &H2F_LW_W_(create_flit);
-    b_create_flit  = &H2F_LW_B_(create_flit);
-    ar_create_flit = &H2F_LW_AR_(create_flit);
-    r_create_flit  = &H2F_LW_R_(create_flit);
-    aw_fprint_flit = &H2F_LW_AW_(fprint_flit);
-    w_fprint_flit  = &H2F_LW_W_(fprint_flit);
-    b_fprint_flit  = &H2F_LW_B_(fprint_flit);
-    ar_fprint_flit = &H2F_LW_AR_(fprint_flit);
-    r_fprint_flit  = &H2F_LW_R_(fprint_flit);
-    simport = simports->h2flw;
-    offset_mask &= 0x3;
-    data_width_bytes = 4;
-  }
-  else if ((dev = devs_find (path, h2f_devs, n_h2f_devs))) {
-    aw_create_flit = &H2F_AW_(create_flit);
-    w_create_flit  = &H2F_W_(create_flit);
-    b_create_flit  = &H2F_B_(create_flit);
-    ar_create_flit = &H2F_AR_(create_flit);
-    r_create_flit  = &H2F_R_(create_flit);
-    aw_fprint_flit = &H2F_AW_(fprint_flit);
-    w_fprint_flit  = &H2F_W_(fprint_flit);
-    b_fprint_flit  = &H2F_B_(fprint_flit);
-    ar_fprint_flit = &H2F_AR_(fprint_flit);
-    r_fprint_flit  = &H2F_R_(fprint_flit);
-    simport = simports->h2f;
-    offset_mask &= 0xf;
-    data_width_bytes = 16;
-  } else return ERANGE;
-
-  // compute address and check for in range accesses
-  printf ("found device \"%s\"\n", dev->name);
-  uint64_t addr = 0xffffffff & (fmemReq->offset + dev->base_addr);
-  uint64_t range = 0xffffffff & dev->range;
-  // Each AXI flit represents an access within an N-byte aligned region
-  // e.g. for h2flw the data width is 4 bytes => each flit represents an access within a 4-byte aligned region.
-  // If the address isn't N-byte aligned, there is effectively an offset from the start of the region.
-  // That is what flit_offset represents.
-  // the write-data and read-data send and received in flits are for the aligned region, so flit_offset marks where to start taking data from those buffers.
-  uint64_t flit_offset = addr & offset_mask;
-  if (fmemReq->offset + fmemReq->access_width > range) return ERANGE;
-
-  // prepare AXI4 access size and byte strobe
-  uint8_t size = 0;
-  // strb is a byte-select passed in the flit
-  // The first set bit in strb must enable a byte greater than or equal to the one addressed by addr.
-  // e.g. if using 4-byte aligned regions, and addr = 2, bits 0 and 1 of strb must always be 0, and bits 2 and 3 may be 0 or 1.
-  // max data_width_bytes = 16bytes, strb is a byte select => 16-bits wide
-  uint16_t strb = 0;
-  switch(fmemReq->access_width) {
-    case 1: size = 0; strb = 0x0001 << flit_offset; break;
-    case 2: size = 1; strb = 0x0003 << flit_offset; break;
-    case 4: size = 2; strb = 0x000f << flit_offset; break;
-    default: return -1;
-  }
+  // find device and its simulator port
+  uint64_t t_entry = lat_now ();
+  devfs_fh_t tmp;
+  const devfs_fh_t* fh = devfs_fh_get (path, fi, &tmp);
+  if (!fh) return -ENOENT;
+  if (fh->kind != DEVFS_FH_DEV) return -ENOTTY;
+  dev_entry_t* entry = fh->entry;
+  const mem_mapped_dev_t* dev = entry->dev;
+  axi_sim_port_t* simport = entry->simport;
+  DEVFS_DEBUG ("found device \"%s\"\n", dev->name);
 
   // perform AXI4 read/write operation
+  struct fmem_request* fmemReq = (struct fmem_request*) data;
+  struct fmem_request_v2* fmemReq2 = (struct fmem_request_v2*) data;
   switch (cmd) {
 
-    case _IOWR('X', 1, struct fmem_request): { // FMEM READ
-      printf ("fmem read ioctl\n");
-      // send an AXI4 read request AR flit
-      t_axi4_arflit* arflit = ar_create_flit (NULL);
-      arflit->arid[0] = 0;
-      for (int i = 0; i < 4; i++) arflit->araddr[i] = ((uint8_t*) &addr)[i];
-      arflit->arlen = 0;
-      arflit->arsize = size;
-      /*TODO*/ arflit->arburst = 0;
-      /*TODO*/ arflit->arlock = 0;
-      /*TODO*/ arflit->arcache = 0;
-      /*TODO*/ arflit->arprot = 0;
-      /*TODO*/ arflit->arqos = 0;
-      /*TODO*/ arflit->arregion = 0;
-      arflit->aruser[0] = 0;
-      bub_fifo_ProduceElement (simport->fifo->ar, (void*) arflit);
-      ar_fprint_flit (simport->logfile, arflit);
-      fprintf (simport->logfile, "\n");
-      // get an AXI4 read response R flit
-      t_axi4_rflit* rflit = r_create_flit (NULL);
-      bub_fifo_ConsumeElement (simport->fifo->r, (void*) rflit);
-      r_fprint_flit (simport->logfile, rflit);
-      fprintf (simport->logfile, "\n");
-      fflush (simport->logfile);
-      // return the response data through the fmem request pointer
-      // TODO check rflit->rresp
-      for (int i = 0; i < fmemReq->access_width; i++)
-        ((uint8_t*) &(fmemReq->data))[i] = rflit->rdata[flit_offset + i];
-      return 0;
+    case FMEM_READ: {
+      DEVFS_DEBUG ("fmem read ioctl\n");
+      if (fmemReq->access_width > sizeof (fmemReq->data)) return -EINVAL;
+      return fmem_single ( entry, AXI_TXN_READ, fmemReq->offset
+                         , fmemReq->access_width, (uint8_t*) &(fmemReq->data)
+                         , t_entry );
       break;
     }
 
-    case _IOWR('X', 2, struct fmem_request):  { // FMEM WRITE
-      printf ("fmem write ioctl\n");
-      // send an AXI4 write request AW flit
-      t_axi4_awflit* awflit = aw_create_flit (NULL);
-      awflit->awid[0] = 0;
-      for (int i = 0; i < 4; i++) awflit->awaddr[i] = ((uint8_t*) &addr)[i];
-      awflit->awlen = 0;
-      awflit->awsize = size;
-      /*TODO*/ awflit->awburst = 0;
-      /*TODO*/ awflit->awlock = 0;
-      /*TODO*/ awflit->awcache = 0;
-      /*TODO*/ awflit->awprot = 0;
-      /*TODO*/ awflit->awqos = 0;
-      /*TODO*/ awflit->awregion = 0;
-      awflit->awuser[0];
-      /**/printf ("fmem write ioctl -- pre log\n");
-      aw_fprint_flit (simport->logfile, awflit);
-      fprintf (simport->logfile, "\n");
-      /**/printf ("fmem write ioctl -- post log\n");
-      bub_fifo_ProduceElement (simport->fifo->aw, (void*) awflit);
-      // send an AXI4 write request W flit
-      t_axi4_wflit* wflit = w_create_flit (NULL);
-      for (int i = 0; i < 4; i++)
-        wflit->wdata[flit_offset + i] = ((uint8_t*) &fmemReq->data)[i];
-      wflit->wstrb[0] = strb & 0xFF;
-      // If data_width_bytes > 8 then there is a second byte of wstrb that we need to set
-      if (data_width_bytes > 8) {
-        wflit->wstrb[1] = (strb >> 8) & 0xFF;
-      }
-      wflit->wlast = 0b00000001;
-      wflit->wuser[0] = 0;
-      w_fprint_flit (simport->logfile, wflit);
-      fprintf (simport->logfile, "\n");
-      bub_fifo_ProduceElement (simport->fifo->w, (void*) wflit);
-      // get an AXI4 write response B flit
-      // in case the sent flits never respond, flush the log
-      fflush (simport->logfile);
-      t_axi4_bflit* bflit = b_create_flit (NULL);
-      bub_fifo_ConsumeElement (simport->fifo->b, (void*) bflit);
-      b_fprint_flit (simport->logfile, bflit);
-      fprintf (simport->logfile, "\n");
-      fflush (simport->logfile);
-      // TODO check bflit->bresp
-      return 0;
+    case FMEM_WRITE: {
+      DEVFS_DEBUG ("fmem write ioctl\n");
+      if (fmemReq->access_width > sizeof (fmemReq->data)) return -EINVAL;
+      return fmem_single ( entry, AXI_TXN_WRITE, fmemReq->offset
+                         , fmemReq->access_width, (uint8_t*) &(fmemReq->data)
+                         , t_entry );
+      break;
+    }
+
+    case FMEM_READ_V2:
+    case FMEM_WRITE_V2: {
+      DEVFS_DEBUG ("fmem v2 ioctl\n");
+      if (fmemReq2->access_width == 0)
+        fmemReq2->access_width = simport->fns->data_width_bytes;
+      return fmem_single ( entry, (cmd == FMEM_READ_V2) ? AXI_TXN_READ
+                                                        : AXI_TXN_WRITE
+                         , fmemReq2->offset, fmemReq2->access_width
+                         , fmemReq2->data, t_entry );
+      break;
+    }
+
+    case FMEM_BATCH: {
+      DEVFS_DEBUG ("fmem batch ioctl\n");
+      // batch reads always reach the device, and its writes invalidate the
+      // device's read cache once performed
+      struct fmem_batch* batch = (struct fmem_batch*) data;
+      int ret = fmem_batch (simport, dev, batch);
+      for (uint32_t i = 0; entry->rcache && i < batch->count && i < FMEM_BATCH_MAX; i++)
+        if (batch->ops[i].cmd == FMEM_OP_WRITE)
+          read_cache_invalidate ( entry->rcache
+                                , dev->base_addr + batch->ops[i].offset
+                                , batch->ops[i].access_width );
+      return ret;
+      break;
+    }
+
+    case FMEM_INVALIDATE: {
+      DEVFS_DEBUG ("fmem invalidate ioctl\n");
+      struct fmem_invalidate* inval = (struct fmem_invalidate*) data;
+      if (inval->offset > dev->range) return -ERANGE;
+      uint64_t len = dev->range - inval->offset;
+      if (inval->length != 0 && inval->length < len) len = inval->length;
+      uint64_t addr = dev->base_addr + inval->offset;
+      page_cache_t* cache = dev_cache (dev, simport);
+      int ret = cache ? page_cache_invalidate (cache, addr, len) : 0;
+      if (entry->rcache) read_cache_invalidate (entry->rcache, addr, len);
+      return ret;
       break;
     }
 
   }
 
-  return -1;
+  return -ENOTTY;
+}
+
+// Wait for a device to be ready, as told by its status register, if it has one
+static int _poll ( const char* path
+                 , struct fuse_file_info* fi
+                 , struct fuse_pollhandle* ph
+                 , unsigned* reventsp ) {
+  DEVFS_DEBUG ("cheri-bgas-fuse-devfs -- poll\n");
+  devfs_fh_t tmp;
+  const devfs_fh_t* fh = devfs_fh_get (path, fi, &tmp);
+  if (fh && fh->kind == DEVFS_FH_STREAM)
+    return uart_stream_poll (fh->stream, fi ? fi->poll_events : 0, ph, reventsp);
+  if (fh && fh->kind == DEVFS_FH_DEV)
+    return dev_poller_poll (EXPOSE_SIMPORTS()->events, fh->entry, ph, reventsp);
+  // the statistics files are always ready
+  if (ph) fuse_pollhandle_destroy (ph);
+  *reventsp = DEV_POLL_ALWAYS;
+  return fh ? 0 : -ENOENT;
+}
+
+// Expand a comma separated list of simulator ports folders and glob patterns
+// into the folders of the nodes to serve, each named after its folder
+static int nodes_expand (const char* arg, setup_ctxt_t* ctxt) {
+  glob_t g;
+  char* list = strdup (arg);
+  int flags = GLOB_NOCHECK;
+  for (char* item = strtok (list, ","); item; item = strtok (NULL, ",")) {
+    glob (item, flags, NULL, &g);
+    flags |= GLOB_APPEND;
+  }
+  free (list);
+  if (!(flags & GLOB_APPEND)) {
+    fprintf (stderr, "no simulator ports folder in \"%s\"\n", arg);
+    return -1;
+  }
+  ctxt->n_nodes = g.gl_pathc;
+  ctxt->node_paths = malloc (g.gl_pathc * sizeof (char*));
+  ctxt->node_names = malloc (g.gl_pathc * sizeof (char*));
+  for (size_t k = 0; k < g.gl_pathc; k++) {
+    struct stat st;
+    char* path = realpath (g.gl_pathv[k], NULL);
+    if (!path || stat (path, &st) != 0 || !S_ISDIR (st.st_mode)) {
+      fprintf (stderr, "no simulator ports folder \"%s\"\n", g.gl_pathv[k]);
+      return -1;
+    }
+    ctxt->node_paths[k] = path;
+    ctxt->node_names[k] = strrchr (path, '/') + 1;
+    // node folders must not hide the statistics folder, nor each other
+    if (ctxt->node_names[k][0] == '\0' || ctxt->node_names[k][0] == '.') {
+      fprintf (stderr, "invalid node name \"%s\"\n", ctxt->node_names[k]);
+      return -1;
+    }
+    for (size_t j = 0; j < k; j++)
+      if (strcmp (ctxt->node_names[j], ctxt->node_names[k]) == 0) {
+        fprintf (stderr, "duplicate node name \"%s\"\n", ctxt->node_names[k]);
+        return -1;
+      }
+  }
+  globfree (&g);
+  return 0;
 }
 
 int main (int argc, char** argv)
@@ -321,14 +1066,32 @@ int main (int argc, char** argv)
   // prepate an initial constect to call the fuse_main with
   setup_ctxt_t ctxt;
 
-  // grab the path to the simulator's ports folder from the  command line args
+  // grab the path to the simulator's ports folder from the  command line args,
+  // or the list of folders of several simulated nodes
   if ((argc < 3) || (argv[1][0] == '-')) {
-    printf ("%s PATH_TO_SIMULATOR_PORTS <standard fuse flags>\n", argv[0]);
+    printf ( "%s PATH_TO_SIMULATOR_PORTS|NODE_PORTS,...|'NODE_PORTS_GLOB'"
+             " [-o log=off|trace|text]"
+             " [-o coherence=uncached|writethrough|writeback]"
+             " [-o cache_pages=N] [-o devmap=FILE]"
+             " [-o f2h_mem=FILE] [-o f2h_size=BYTES] [-o posted_writes]"
+             " [-o pollers=N] [-o timeout_ms=N] [-o poll_ms=N]"
+             " <standard fuse flags>\n"
+           , argv[0] );
     return -1;
   }
-  char* simports_dir = realpath (argv[1], NULL);
-  strcpy (ctxt.simports_path, simports_dir);
-  free (simports_dir);
+  ctxt.n_nodes = 0;
+  if (strpbrk (argv[1], ",*?[")) {
+    if (nodes_expand (argv[1], &ctxt) < 0) return -1;
+  } else {
+    char* simports_dir = realpath (argv[1], NULL);
+    if (!simports_dir) {
+      fprintf (stderr, "no simulator ports folder \"%s\"\n", argv[1]);
+      return -1;
+    }
+    bool fits = format_path (ctxt.simports_path, "%s", simports_dir);
+    free (simports_dir);
+    if (!fits) return -1;
+  }
   argv[1] = argv[0];
   argv = &(argv[1]);
   argc--;
@@ -337,18 +1100,82 @@ int main (int argc, char** argv)
   char current_workdir_path[MAX_PATH_LEN];
   getcwd(ctxt.workdir_path, MAX_PATH_LEN);
 
+  // grab the devfs specific options, and leave the others to fuse
+  struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+  ctxt.log = NULL;
+  ctxt.coherence = NULL;
+  ctxt.cache_pages = DEFAULT_CACHE_PAGES;
+  ctxt.cache_mode = CACHE_UNCACHED;
+  ctxt.devmap = NULL;
+  ctxt.f2h_mem = NULL;
+  ctxt.f2h_size = DEFAULT_F2H_SIZE;
+  ctxt.posted_writes = 0;
+  ctxt.pollers = 0;
+  ctxt.timeout_ms = 0;
+  ctxt.poll_ms = DEFAULT_POLL_MS;
+  if (fuse_opt_parse (&args, &ctxt, devfs_opts, NULL) == -1) return -1;
+  // have fuse signal the threads serving the requests which get interrupted,
+  // which wakes their transaction waits up (see axi_wait)
+  if (fuse_opt_add_arg (&args, "-ointr") == -1) return -1;
+  if (ctxt.log) {
+    if (strcmp (ctxt.log, "off") == 0) devfs_log_level = DEVFS_LOG_OFF;
+    else if (strcmp (ctxt.log, "trace") == 0) devfs_log_level = DEVFS_LOG_TRACE;
+    else if (strcmp (ctxt.log, "text") == 0) devfs_log_level = DEVFS_LOG_TEXT;
+    else {
+      fprintf (stderr, "unknown log level \"%s\"\n", ctxt.log);
+      return -1;
+    }
+  }
+  if (ctxt.coherence) {
+    if (strcmp (ctxt.coherence, "uncached") == 0)
+      ctxt.cache_mode = CACHE_UNCACHED;
+    else if (strcmp (ctxt.coherence, "writethrough") == 0)
+      ctxt.cache_mode = CACHE_WRITETHROUGH;
+    else if (strcmp (ctxt.coherence, "writeback") == 0)
+      ctxt.cache_mode = CACHE_WRITEBACK;
+    else {
+      fprintf (stderr, "unknown coherence mode \"%s\"\n", ctxt.coherence);
+      return -1;
+    }
+  }
+
+  // load the device map (before fuse changes the working directory)
+  ctxt.map = ctxt.devmap ? devmap_load (ctxt.devmap) : devmap_builtin ();
+  if (!ctxt.map) return -1;
+
+  // F2H host memory backing file, relative to the current working directory
+  const char* f2h_mem = ctxt.f2h_mem ? ctxt.f2h_mem : "f2h.mem";
+  bool fits = (f2h_mem[0] == '/')
+    ? format_path (ctxt.f2h_mem_path, "%s", f2h_mem)
+    : format_path (ctxt.f2h_mem_path, "%s/%s", ctxt.workdir_path, f2h_mem);
+  if (!fits) return -1;
+  if (ctxt.f2h_size <= 0) {
+    fprintf (stderr, "invalid f2h_size %ld\n", ctxt.f2h_size);
+    return -1;
+  }
+
   // gather the various fuse operations
   static struct fuse_operations ops = {
-    .init    = _init
-  , .destroy = _destroy
-  , .getattr = _getattr
-  , .readdir = _readdir
-  , .open    = _open
-  , .ioctl   = _ioctl
+    .init     = _init
+  , .destroy  = _destroy
+  , .getattr  = _getattr
+  , .readdir  = _readdir
+  , .readlink = _readlink
+  , .open     = _open
+  , .read     = _read
+  , .write    = _write
+  , .flush    = _flush
+  , .fsync    = _fsync
+  , .release  = _release
+  , .truncate = _truncate
+  , .ioctl    = _ioctl
+  , .poll     = _poll
   };
 
   printf ("cheri-bgas-fuse-devfs -- fuse_main\n");
 
   // call fuse main, with initial private data context set
-  return fuse_main (argc, argv, &ops, &ctxt);
+  int ret = fuse_main (args.argc, args.argv, &ops, &ctxt);
+  fuse_opt_free_args (&args);
+  return ret;
 }
@@ -40,18 +40,237 @@
 * $FreeBSD$
 */
 
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <BlueUnixBridges.h>
 #include <BlueAXI4UnixBridges.h>
+#include <mpsc_ring.h>
+#include <latency_hist.h>
 
+// Entries of the devfs besides the device files, whose names the device map
+// must leave to them
+#define F2H_MEM_ENTRY "/f2h_mem"     // link to a node's F2H backing file
+#define UART_STREAM_SUFFIX ".stream" // stream view of a device (uart_stream.h)
+#define STATS_DIR "/.stats"          // statistics folder (devfs_stats.h)
+
+// AXI4 port descriptor, with the flit helpers for the port configuration
+typedef struct {
+  int id_width;
+  int addr_width;
+  int data_width_bytes;
+  t_axi4_awflit* (*aw_create_flit) (const uint8_t* raw_flit);
+  t_axi4_wflit*  (*w_create_flit)  (const uint8_t* raw_flit);
+  t_axi4_bflit*  (*b_create_flit)  (const uint8_t* raw_flit);
+  t_axi4_arflit* (*ar_create_flit) (const uint8_t* raw_flit);
+  t_axi4_rflit*  (*r_create_flit)  (const uint8_t* raw_flit);
+  void (*aw_fprint_flit) (FILE* f, const t_axi4_awflit* flit);
+  void (*w_fprint_flit)  (FILE* f, const t_axi4_wflit* flit);
+  void (*b_fprint_flit)  (FILE* f, const t_axi4_bflit* flit);
+  void (*ar_fprint_flit) (FILE* f, const t_axi4_arflit* flit);
+  void (*r_fprint_flit)  (FILE* f, const t_axi4_rflit* flit);
+  baub_port_fifo_desc_t* (*fifo_OpenAsSlave) (char* path);
+  baub_port_fifo_desc_t* (*fifo_OpenAsMaster) (char* path);
+} axi_port_fns_t;
+
+// number of bytes of the address fields of a port's AW and AR flits
+#define AXI_ADDR_BYTES(fns) (((fns)->addr_width + 7) / 8)
+
+// maximum number of distinct AXI4 IDs used on a port
+#define AXI_MAX_IDS 16
+
+typedef enum { AXI_TXN_READ, AXI_TXN_WRITE } axi_txn_kind_t;
+
+// Life cycle of a transaction in the engine
+typedef enum {
+  AXI_TXN_QUEUED  // submitted, waiting for the request thread
+, AXI_TXN_ISSUED  // in its ID queue, waiting for its responses
+, AXI_TXN_DONE    // completed
+} axi_txn_state_t;
+
+// Counters of the completed transactions of a port or a device
+typedef struct {
+  atomic_ulong reads;       // successful read transactions
+  atomic_ulong writes;      // successful write transactions
+  atomic_ulong read_bytes;
+  atomic_ulong write_bytes;
+  atomic_ulong slverr;      // transactions answered with an SLVERR
+  atomic_ulong decerr;      // transactions answered with a DECERR
+  atomic_ulong timeouts;    // transactions abandoned past their timeout
+  atomic_ulong cancelled;   // transactions abandoned on an interrupt
+} axi_stats_t;
+
+// Stages of the latency of a device access
+typedef enum {
+  LAT_QUEUE     // from the submission to the issue of the first request flit
+, LAT_PRODUCE   // issue of all the request flits into the port's fifos
+, LAT_RESPONSE  // from the issue of the first request flit to the completion
+, LAT_FUSE      // from the FUSE operation entry to its reply
+, LAT_STAGES
+} lat_stage_t;
+
+// Per-device counters, including those of the posted writes, whose errors are
+// only known once the write already returned, and per direction (indexed by
+// axi_txn_kind_t) latency histograms
+typedef struct {
+  axi_stats_t axi;
+  lat_hist_t lat[2][LAT_STAGES];
+  atomic_ulong posted;        // posted writes answered
+  atomic_ulong posted_errors; // posted writes answered with an error
+  atomic_ulong reported;      // posted errors already reported by an fsync
+  atomic_ulong cache_hits;    // reads served by the device's read cache
+  atomic_ulong cache_misses;  // reads of the read cache filled from the device
+  atomic_ulong stream_rx;     // bytes received by the device's stream view
+  atomic_ulong stream_tx;     // bytes sent by the device's stream view
+} dev_stats_t;
+
+// An AXI4 transaction (one AR or AW request and its R or B responses).
+// The transaction accesses the [addr, addr + len) byte range, which must be
+// covered by the beats of the request described by axaddr, axsize and nbeats.
+typedef struct axi_txn {
+  axi_txn_kind_t kind;
+  // AR / AW request
+  uint64_t axaddr;
+  uint8_t axsize;
+  int nbeats;
+  // accessed byte range, and buffer to read it into or write it from
+  uint64_t addr;
+  size_t len;
+  union {
+    uint8_t* rdst;
+    const uint8_t* wsrc;
+  };
+  // optional bitmap of the bytes to write in the range (bit i for addr + i)
+  const uint8_t* wmask;
+  // posted writes are owned by the engine, and only count their errors
+  bool posted;
+  // ordered transactions are issued on ID 0, so are answered in order with
+  // the other ordered transactions (and the posted writes) of their kind
+  bool ordered;
+  // in flight state, owned by the transaction engine
+  dev_stats_t* stats;       // counters of the accessed device, or NULL
+  uint64_t timeout_ns;      // abandoned past this age, or 0
+  uint64_t t_submit;
+  uint64_t t_issue;
+  axi_txn_state_t state;
+  int cancel;               // status to fail with once issued, or 0
+  bool abandoned;           // a stand-in for an abandoned transaction
+  bool stuck;               // already reported by the watchdog
+  int id;
+  int beat;
+  int status;
+  sem_t completion;
+  struct axi_txn* next;
+} axi_txn_t;
+
+// A queue of the transactions in flight with the same AXI4 ID, in issue order
+typedef struct {
+  axi_txn_t* head;
+  axi_txn_t* tail;
+  int count;
+} axi_id_queue_t;
+
+// Preallocated flits of a port, reused across transactions. Each flit is only
+// ever used by one engine thread: the request thread sends the AR, AW and W
+// flits, and the poller or the response threads receive the R and B flits.
+typedef struct {
+  t_axi4_awflit* aw;
+  t_axi4_wflit*  w;
+  t_axi4_bflit*  b;
+  t_axi4_arflit* ar;
+  t_axi4_rflit*  r;
+} axi_flit_pool_t;
+
+// Transaction engine state of a port. Any thread submits transactions
+// through a lock-free ring, a request thread issues their AR / AW + W flits,
+// and the poller shared by all the ports (or, failing that, one response
+// thread per response channel) matches responses back to their transaction
+// and signals its completion.
 typedef struct {
-  baub_port_fifo_desc_t* fifo;
-  FILE* logfile;
+  int n_ids;
+  mpsc_ring_t submissions;
+  sem_t doorbell;          // one post per submitted transaction
+  atomic_bool stop;
+  pthread_t req_thread;
+  pthread_mutex_t tx_lock; // held by the request thread while issuing flits
+  int wakefd;              // eventfd kicking the request thread out of a send
+  atomic_int issue_cancel; // status to give the issuing transaction up with
+  atomic_bool torn;        // the flits of a transaction were only partly sent
+  pthread_t r_thread;
+  pthread_t b_thread;
+  bool rb_threads;         // whether the response threads are running
+  axi_flit_pool_t flits;
+  atomic_ulong n_txns;
+  atomic_ulong n_allocs;   // heap allocations, flat once the port is set up
+  // the transaction whose flits the request thread is sending, or NULL
+  const axi_txn_t* _Atomic issuing;
+  pthread_mutex_t lock;    // protects everything below
+  pthread_cond_t cond;
+  int outstanding;
+  axi_stats_t stats;
+  axi_id_queue_t rd[AXI_MAX_IDS];
+  axi_id_queue_t wr[AXI_MAX_IDS];
+  // posted writes
+  struct axi_posted* posted_slots;
+  struct axi_posted* posted_free;
+  int posted;              // posted writes in flight
+  pthread_cond_t posted_cond;
+} axi_engine_t;
+
+// Connection state of a simulator port
+typedef enum {
+  AXI_LINK_IDLE  // not connected yet, connected on first use
+, AXI_LINK_UP    // connected to the simulator
+, AXI_LINK_DOWN  // the simulator went away, reconnected once it is back
+} axi_link_t;
+
+typedef struct {
+  char* name;    // "<node>/<port>" when serving several nodes
+  char* path;    // the port's folder in the simulator ports folder
+  pthread_mutex_t link_lock; // serializes connections and disconnections
+  atomic_int link;           // axi_link_t, the transport is only open when up
+  atomic_bool lost;          // the simulator hung up, to be disconnected
+  atomic_uint connections;   // times connected, telling simulator restarts
+  baub_port_fifo_desc_t* fifo; // or NULL when served through shm
+  struct shm_port* shm;        // shared memory rings, or NULL
+  int req_fds[3];              // watch descriptors on the AW, W and AR pipes
+                               // of a fifo port, or -1
+  struct axi_poller* poller;   // receives its responses when connected, or
+                               // NULL to use response threads
+  FILE* logfile; // text log, only open at the DEVFS_LOG_TEXT log level
+  int trace_port;
+  const axi_port_fns_t* fns;
+  uint64_t timeout_ns;      // of the transactions outside of its devices
+  axi_engine_t engine;
+  struct page_cache* cache; // cache of the port's memory devices, or NULL
+  struct dev_registry* devs; // to account transactions to their device
 } axi_sim_port_t;
 
+// A simulated node, served from the ports folder of its simulator
+typedef struct {
+  char* name;            // the node's folder in the devfs, or NULL when a
+                         // single simulator is served at the root
+  char* path;            // its simulator ports folder
+  struct f2h_port* f2h;  // served once the simulator exposes it
+} sim_node_t;
+
 typedef struct {
-  axi_sim_port_t* h2flw;
-  axi_sim_port_t* h2f;
-  axi_sim_port_t* f2h;
+  int n_nodes;
+  sim_node_t* nodes;
+  int n_ports;
+  axi_sim_port_t** ports;   // the ports of the device map, for every node
+  struct devmap* map;
+  struct dev_registry* devs;
+  int n_pollers;
+  struct axi_poller** pollers; // receive the responses of the ports
+  struct port_watch* watch; // connects and disconnects the ports
+  struct dev_poller* events; // wakes up the polls of the devices
+  int n_streams;
+  struct uart_stream* streams; // stream views of the UART-like devices
+  bool posted_writes;       // "-o posted_writes" option
+  atomic_ulong stats_since; // time of the last statistics reset
 } sim_ports_t;
 
 #endif
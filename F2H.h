@@ -0,0 +1,476 @@
+#ifndef F2H_H
+#define F2H_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <BlueUnixBridges.h>
+#include <BlueAXI4UnixBridges.h>
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_burst.h>
+#include <axi_engine.h>
+
+// F2H AXI4 port parameters
+////////////////////////////////////////////////////////////////////////////////
+// On the F2H port, the simulated system is the AXI4 master and the devfs
+// serves its accesses from a host memory backing file, which host tools can
+// map to share buffers with the simulated system.
+
+#define F2H_FOLDER "f2h"
+
+#ifndef F2H_ID
+#define F2H_ID 4
+#endif
+#ifndef F2H_ADDR
+#define F2H_ADDR 32
+#endif
+#ifndef F2H_DATA
+#define F2H_DATA 128
+#endif
+#ifndef F2H_AWUSER
+#define F2H_AWUSER 0
+#endif
+#ifndef F2H_WUSER
+#define F2H_WUSER 0
+#endif
+#ifndef F2H_BUSER
+#define F2H_BUSER 0
+#endif
+#ifndef F2H_ARUSER
+#define F2H_ARUSER 0
+#endif
+#ifndef F2H_RUSER
+#define F2H_RUSER 0
+#endif
+
+DEF_AXI4_API( F2H_ID, F2H_ADDR, F2H_DATA
+            , F2H_AWUSER, F2H_WUSER, F2H_BUSER
+            , F2H_ARUSER, F2H_RUSER
+            , f2h )
+
+#define _F2H_( F2H_ID, F2H_ADDR, F2H_DATA \
+             , F2H_AWUSER, F2H_WUSER, F2H_BUSER \
+             , F2H_ARUSER, F2H_RUSER \
+             , sym ) \
+  AXI4_( F2H_ID, F2H_ADDR, F2H_DATA \
+       , F2H_AWUSER, F2H_WUSER, F2H_BUSER \
+       , F2H_ARUSER, F2H_RUSER \
+       , f2h, sym )
+#define F2H_(sym) _F2H_( F2H_ID, F2H_ADDR, F2H_DATA \
+                       , F2H_AWUSER, F2H_WUSER, F2H_BUSER \
+                       , F2H_ARUSER, F2H_RUSER \
+                       , sym )
+
+#define _F2H_AW_(F2H_ID, F2H_ADDR, F2H_AWUSER, sym) \
+  AXI4_AW_(F2H_ID, F2H_ADDR, F2H_AWUSER, f2h, sym)
+#define F2H_AW_(sym) _F2H_AW_(F2H_ID, F2H_ADDR, F2H_AWUSER, sym)
+
+#define _F2H_W_(F2H_DATA, F2H_WUSER, sym) AXI4_W_(F2H_DATA, F2H_WUSER, f2h, sym)
+#define F2H_W_(sym) _F2H_W_(F2H_DATA, F2H_WUSER, sym)
+
+#define _F2H_B_(F2H_ID, F2H_BUSER, sym) AXI4_B_(F2H_ID, F2H_BUSER, f2h, sym)
+#define F2H_B_(sym) _F2H_B_(F2H_ID, F2H_BUSER, sym)
+
+#define _F2H_AR_(F2H_ID, F2H_ADDR, F2H_ARUSER, sym) \
+  AXI4_AR_(F2H_ID, F2H_ADDR, F2H_ARUSER, f2h, sym)
+#define F2H_AR_(sym) _F2H_AR_(F2H_ID, F2H_ADDR, F2H_ARUSER, sym)
+
+#define _F2H_R_(F2H_ID, F2H_DATA, F2H_RUSER, sym) \
+  AXI4_R_(F2H_ID, F2H_DATA, F2H_RUSER, f2h, sym)
+#define F2H_R_(sym) _F2H_R_(F2H_ID, F2H_DATA, F2H_RUSER, sym)
+
+// F2H AXI4 flit helpers
+static const axi_port_fns_t f2h_fns =
+{ .id_width = F2H_ID
+, .addr_width = F2H_ADDR
+, .data_width_bytes = F2H_DATA / 8
+, .aw_create_flit = &F2H_AW_(create_flit)
+, .w_create_flit  = &F2H_W_(create_flit)
+, .b_create_flit  = &F2H_B_(create_flit)
+, .ar_create_flit = &F2H_AR_(create_flit)
+, .r_create_flit  = &F2H_R_(create_flit)
+, .aw_fprint_flit = &F2H_AW_(fprint_flit)
+, .w_fprint_flit  = &F2H_W_(fprint_flit)
+, .b_fprint_flit  = &F2H_B_(fprint_flit)
+, .ar_fprint_flit = &F2H_AR_(fprint_flit)
+, .r_fprint_flit  = &F2H_R_(fprint_flit)
+, .fifo_OpenAsSlave  = &F2H_(fifo_OpenAsSlave)
+, .fifo_OpenAsMaster = &F2H_(fifo_OpenAsMaster)
+};
+
+// F2H service
+////////////////////////////////////////////////////////////////////////////////
+// A read thread answers each AR request with its R beats, and a write thread
+// consumes each AW request and its W beats and answers with a B response.
+// Requests are served as soon as they arrive, in order, so any number of
+// transactions may be outstanding on any number of IDs. Accesses outside of
+// the backing memory get a DECERR response. Each write, once answered, is
+// signaled to an optional callback.
+//
+// Like the H2F ports (see axi_ports.h), the F2H port connects to its
+// simulator once its folder exists, is disconnected when the simulator goes
+// away, and reconnected when it comes back (see port_watch.h), the backing
+// memory outliving the connections. The service threads only run while the
+// port is connected. A response waits for room in its channel pipe, watched
+// through a descriptor of its own, so that a simulator which stopped taking
+// responses does not hold a disconnection up.
+
+// the response channel pipes in the F2H port's folder
+enum { F2H_RESP_R, F2H_RESP_B, F2H_RESP_CHANS };
+static const char* const f2h_resp_pipes[F2H_RESP_CHANS] = { "r", "b" };
+
+typedef struct f2h_port {
+  char* name;                // "<node>/f2h" when serving several nodes
+  char* path;                // the port's folder in the simulator ports folder
+  pthread_mutex_t link_lock; // serializes connections and disconnections
+  atomic_int link;           // axi_link_t, the fifo is only open when up
+  atomic_uint connections;   // times connected, telling simulator restarts
+  baub_port_fifo_desc_t* fifo;
+  int resp_fds[F2H_RESP_CHANS]; // watch descriptors on the R and B pipes, or -1
+  int wakefd;                // eventfd kicking the service threads out of a send
+  FILE* logfile; // text log, only open at the DEVFS_LOG_TEXT log level
+  int trace_port;
+  const axi_port_fns_t* fns;
+  // host memory backing the port's address space
+  char* mem_path;
+  uint8_t* mem;
+  uint64_t size;
+  // service threads and their flits
+  pthread_t rd_thread;
+  pthread_t wr_thread;
+  t_axi4_arflit* ar;
+  t_axi4_rflit* r;
+  t_axi4_awflit* aw;
+  t_axi4_wflit* w;
+  t_axi4_bflit* b;
+  atomic_ulong n_reads;
+  atomic_ulong n_writes;
+  void (*written) (void* arg); // called after each write, or NULL
+  void* written_arg;
+} f2h_port_t;
+
+// Open the watch descriptors of the response pipes, read-write and never read
+// (see axi_req_watch_open). The responses to a pipe which cannot be watched
+// are sent blocking.
+static void f2h_resp_watch_open (f2h_port_t* f2h) {
+  for (int i = 0; i < F2H_RESP_CHANS; i++) {
+    char path[strlen (f2h->path) + strlen (f2h_resp_pipes[i]) + 2];
+    sprintf (path, "%s/%s", f2h->path, f2h_resp_pipes[i]);
+    f2h->resp_fds[i] = open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  }
+}
+
+static void f2h_resp_watch_close (f2h_port_t* f2h) {
+  for (int i = 0; i < F2H_RESP_CHANS; i++) {
+    if (f2h->resp_fds[i] >= 0) close (f2h->resp_fds[i]);
+    f2h->resp_fds[i] = -1;
+  }
+}
+
+// Wait until a response pipe takes a flit without blocking. Returns false once
+// the port is disconnected.
+static bool f2h_send_wait (f2h_port_t* f2h, int chan) {
+  struct pollfd fds[2] = { { .fd = f2h->resp_fds[chan], .events = POLLOUT }
+                         , { .fd = f2h->wakefd, .events = POLLIN } };
+  for (;;) {
+    if (atomic_load (&f2h->link) != AXI_LINK_UP) return false;
+    if (fds[0].fd < 0) return true;
+    if (poll (fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror ("F2H send poll");
+      return false;
+    }
+    if (fds[0].revents & POLLOUT) return atomic_load (&f2h->link) == AXI_LINK_UP;
+  }
+}
+
+static uint64_t f2h_flit_addr (const f2h_port_t* f2h, const uint8_t* axaddr) {
+  uint64_t addr = 0;
+  for (int i = 0; i < AXI_ADDR_BYTES (f2h->fns); i++)
+    addr |= (uint64_t) axaddr[i] << (8 * i);
+  return addr;
+}
+
+// Each returns false if its responses were given up on a disconnection.
+static bool f2h_read (f2h_port_t* f2h, const t_axi4_arflit* ar) {
+  int dwb = f2h->fns->data_width_bytes;
+  uint64_t addr = f2h_flit_addr (f2h, ar->araddr);
+  uint64_t size = 1 << ar->arsize;
+  t_axi4_rflit* rflit = f2h->r;
+  for (int beat = 0; beat <= ar->arlen; beat++) {
+    uint64_t start = axi_beat_addr (addr, ar->arsize, ar->arlen, ar->arburst, beat);
+    uint64_t end = (start & ~(size - 1)) + size;
+    memset (rflit->rdata, 0, dwb);
+    if (end <= f2h->size) {
+      for (uint64_t a = start; a < end; a++) rflit->rdata[a % dwb] = f2h->mem[a];
+      rflit->rresp = AXI4_RESP_OKAY;
+    } else rflit->rresp = AXI4_RESP_DECERR;
+    rflit->rid[0] = ar->arid[0];
+    rflit->rlast = (beat == ar->arlen) ? 1 : 0;
+    rflit->ruser[0] = 0;
+    if (!f2h_send_wait (f2h, F2H_RESP_R)) return false;
+    AXI_LOG_FLIT (f2h, r, rflit);
+    bub_fifo_ProduceElement (f2h->fifo->r, (void*) rflit);
+  }
+  atomic_fetch_add_explicit (&f2h->n_reads, 1, memory_order_relaxed);
+  return true;
+}
+
+static bool f2h_write (f2h_port_t* f2h, const t_axi4_awflit* aw) {
+  int dwb = f2h->fns->data_width_bytes;
+  uint64_t addr = f2h_flit_addr (f2h, aw->awaddr);
+  uint8_t resp = AXI4_RESP_OKAY;
+  t_axi4_wflit* wflit = f2h->w;
+  for (int beat = 0; beat <= aw->awlen; beat++) {
+    pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+    bub_fifo_ConsumeElement (f2h->fifo->w, (void*) wflit);
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+    AXI_LOG_FLIT (f2h, w, wflit);
+    uint64_t start = axi_beat_addr (addr, aw->awsize, aw->awlen, aw->awburst, beat);
+    uint64_t lanes = start & ~((uint64_t) dwb - 1);
+    for (int i = 0; i < dwb; i++) {
+      if (!((wflit->wstrb[i / 8] >> (i % 8)) & 1)) continue;
+      if (lanes + i < f2h->size) f2h->mem[lanes + i] = wflit->wdata[i];
+      else resp = AXI4_RESP_DECERR;
+    }
+  }
+  t_axi4_bflit* bflit = f2h->b;
+  bflit->bid[0] = aw->awid[0];
+  bflit->bresp = resp;
+  bflit->buser[0] = 0;
+  if (!f2h_send_wait (f2h, F2H_RESP_B)) return false;
+  AXI_LOG_FLIT (f2h, b, bflit);
+  bub_fifo_ProduceElement (f2h->fifo->b, (void*) bflit);
+  atomic_fetch_add_explicit (&f2h->n_writes, 1, memory_order_relaxed);
+  if (f2h->written) f2h->written (f2h->written_arg);
+  return true;
+}
+
+// The service threads only get cancelled while waiting for a flit, and return
+// once their responses are given up.
+static void* f2h_rd_thread (void* arg) {
+  f2h_port_t* f2h = (f2h_port_t*) arg;
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+  do {
+    pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+    bub_fifo_ConsumeElement (f2h->fifo->ar, (void*) f2h->ar);
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+    AXI_LOG_FLIT (f2h, ar, f2h->ar);
+  } while (f2h_read (f2h, f2h->ar));
+  return NULL;
+}
+
+static void* f2h_wr_thread (void* arg) {
+  f2h_port_t* f2h = (f2h_port_t*) arg;
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+  do {
+    pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+    bub_fifo_ConsumeElement (f2h->fifo->aw, (void*) f2h->aw);
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+    AXI_LOG_FLIT (f2h, aw, f2h->aw);
+  } while (f2h_write (f2h, f2h->aw));
+  return NULL;
+}
+
+// F2H connections
+////////////////////////////////////////////////////////////////////////////////
+
+// Open the F2H fifos, with the simulated system as the master, and start
+// serving them. Returns false if the port's folder is missing or its fifos
+// cannot be opened.
+static bool f2h_attach (f2h_port_t* f2h) {
+  if (access (f2h->path, F_OK) != 0) return false;
+  if (!(f2h->fifo = f2h->fns->fifo_OpenAsMaster (f2h->path))) return false;
+  f2h_resp_watch_open (f2h);
+  atomic_fetch_add (&f2h->connections, 1);
+  atomic_store (&f2h->link, AXI_LINK_UP);
+  pthread_create (&f2h->rd_thread, NULL, f2h_rd_thread, f2h);
+  pthread_create (&f2h->wr_thread, NULL, f2h_wr_thread, f2h);
+  printf ("%s -- connected\n", f2h->name);
+  return true;
+}
+
+// Stop the service threads, the ones waiting to send a response giving it up,
+// and close the F2H fifos.
+static void f2h_detach (f2h_port_t* f2h) {
+  atomic_store (&f2h->link, AXI_LINK_DOWN);
+  uint64_t n = 1;
+  if (write (f2h->wakefd, &n, sizeof (n)) < 0) perror ("F2H kick");
+  pthread_cancel (f2h->rd_thread);
+  pthread_cancel (f2h->wr_thread);
+  pthread_join (f2h->rd_thread, NULL);
+  pthread_join (f2h->wr_thread, NULL);
+  if (read (f2h->wakefd, &n, sizeof (n)) < 0 && errno != EAGAIN)
+    perror ("F2H wakeup");
+  f2h_resp_watch_close (f2h);
+  baub_fifo_Close (f2h->fifo);
+  f2h->fifo = NULL;
+}
+
+// connect the F2H port, if it is not connected yet and its simulator is there
+static void f2h_connect (f2h_port_t* f2h) {
+  pthread_mutex_lock (&f2h->link_lock);
+  if (atomic_load (&f2h->link) != AXI_LINK_UP) f2h_attach (f2h);
+  pthread_mutex_unlock (&f2h->link_lock);
+}
+
+// disconnect the F2H port if its simulator went away
+static void f2h_disconnect (f2h_port_t* f2h, const char* why) {
+  pthread_mutex_lock (&f2h->link_lock);
+  if (atomic_load (&f2h->link) == AXI_LINK_UP) {
+    printf ("%s -- disconnected (%s)\n", f2h->name, why);
+    f2h_detach (f2h);
+  }
+  pthread_mutex_unlock (&f2h->link_lock);
+}
+
+// F2H setup
+////////////////////////////////////////////////////////////////////////////////
+
+// Set the F2H port of a simulator ports folder up, named after its node (or
+// NULL when serving a single simulator), backed by the host memory file at
+// mem_path (created, or grown, to size bytes, but never shrunk, so that a
+// larger file keeps its contents past size), calling written (if not NULL)
+// after each write, and serve it once the simulator exposes it.
+static f2h_port_t* f2h_init ( const char* node
+                            , const char* portpath
+                            , const char* logpath
+                            , const char* mem_path
+                            , uint64_t size
+                            , void (*written) (void* arg)
+                            , void* written_arg ) {
+  f2h_port_t* f2h = malloc (sizeof (f2h_port_t));
+  f2h->name = malloc ((node ? strlen (node) + 1 : 0) + strlen (F2H_FOLDER) + 1);
+  if (node) sprintf (f2h->name, "%s/%s", node, F2H_FOLDER);
+  else strcpy (f2h->name, F2H_FOLDER);
+  f2h->path = (char*) malloc (strlen (portpath) + strlen ("/" F2H_FOLDER) + 1);
+  strcpy (f2h->path, portpath);
+  strcat (f2h->path, "/" F2H_FOLDER);
+  f2h->fns = &f2h_fns;
+  f2h->wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (f2h->wakefd < 0) {
+    perror ("F2H setup");
+    exit (EXIT_FAILURE);
+  }
+  // host memory backing file
+  f2h->mem_path = strdup (mem_path);
+  f2h->size = size;
+  int fd = open (mem_path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (   fd < 0 || fstat (fd, &st) != 0
+      || ((uint64_t) st.st_size < size && ftruncate (fd, size) != 0) ) {
+    fprintf (stderr, "Failed to create \"%s\": ", mem_path);
+    perror (NULL);
+    exit (EXIT_FAILURE);
+  }
+  if ((uint64_t) st.st_size > size)
+    printf ( "%s -- only the first 0x%" PRIx64 " bytes of its 0x%" PRIx64
+             " are served\n", mem_path, size, (uint64_t) st.st_size );
+  f2h->mem = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (f2h->mem == MAP_FAILED) {
+    fprintf (stderr, "Failed to mmap \"%s\": ", mem_path);
+    perror (NULL);
+    exit (EXIT_FAILURE);
+  }
+  printf ( "name: %15s, backing file: %s, range: 0x%" PRIx64 "\n"
+         , f2h->name, mem_path, size );
+  // F2H logstream, text log or binary trace
+  f2h->logfile = NULL;
+  if (logpath && (f2h->logfile = fopen (logpath, "w")) == NULL) {
+    fprintf(stderr, "Failed fopen(\"%s\", \"w\"): ", logpath);
+    perror(NULL);
+    exit (EXIT_FAILURE);
+  }
+  f2h->trace_port = trace_port (f2h->name, F2H_ID, F2H_ADDR, F2H_DATA / 8);
+  // the service threads' flits
+  f2h->ar = f2h_fns.ar_create_flit (NULL);
+  f2h->r  = f2h_fns.r_create_flit (NULL);
+  f2h->aw = f2h_fns.aw_create_flit (NULL);
+  f2h->w  = f2h_fns.w_create_flit (NULL);
+  f2h->b  = f2h_fns.b_create_flit (NULL);
+  atomic_init (&f2h->n_reads, 0);
+  atomic_init (&f2h->n_writes, 0);
+  f2h->written = written;
+  f2h->written_arg = written_arg;
+  // F2H interface, served right away if the simulator already exposes it
+  pthread_mutex_init (&f2h->link_lock, NULL);
+  atomic_init (&f2h->link, AXI_LINK_IDLE);
+  atomic_init (&f2h->connections, 0);
+  f2h->fifo = NULL;
+  for (int i = 0; i < F2H_RESP_CHANS; i++) f2h->resp_fds[i] = -1;
+  f2h_connect (f2h);
+  if (atomic_load (&f2h->link) != AXI_LINK_UP)
+    printf ("no F2H port in %s yet\n", portpath);
+  return f2h;
+}
+
+static void f2h_destroy (f2h_port_t* f2h) {
+  if (atomic_load (&f2h->link) == AXI_LINK_UP) f2h_detach (f2h);
+  printf ( "%s -- %lu reads, %lu writes served\n"
+         , f2h->name, atomic_load (&f2h->n_reads), atomic_load (&f2h->n_writes) );
+  free (f2h->ar);
+  free (f2h->r);
+  free (f2h->aw);
+  free (f2h->w);
+  free (f2h->b);
+  munmap (f2h->mem, f2h->size);
+  free (f2h->mem_path);
+  if (f2h->logfile) fclose (f2h->logfile);
+  pthread_mutex_destroy (&f2h->link_lock);
+  close (f2h->wakefd);
+  free (f2h->path);
+  free (f2h->name);
+  free (f2h);
+}
+
+#endif
@@ -54,7 +54,8 @@
 static const mem_mapped_dev_t h2f_devs[] =
 { { .name      = "dma_window"
   , .base_addr = 0x00000000
-  , .range     = 0x40000000 },
+  , .range     = 0x40000000
+  , .is_memory = true },
 };
 int n_h2f_devs = sizeof(h2f_devs)/sizeof(mem_mapped_dev_t);
 
@@ -124,26 +125,23 @@ DEF_AXI4_API( H2F_ID, H2F_ADDR, H2F_DATA
   AXI4_R_(H2F_ID, H2F_DATA, H2F_RUSER, h2f, sym)
 #define H2F_R_(sym) _H2F_R_(H2F_ID, H2F_DATA, H2F_RUSER, sym)
 
-static axi_sim_port_t* h2f_init (const char* portpath, const char* logpath) {
-  axi_sim_port_t* axi_sim_port = malloc (sizeof (axi_sim_port_t));
-  // H2F interface
-  size_t len = strlen (portpath) + 1;
-  /**/devs_print (h2f_devs, n_h2f_devs);
-  char* h2fPath = (char*) malloc (len + strlen ("/" H2F_FOLDER));
-  strcpy (h2fPath, portpath);
-  strcat (h2fPath, "/" H2F_FOLDER);
-  axi_sim_port->fifo = H2F_(fifo_OpenAsSlave)(h2fPath);
-  // H2F logstream
-  axi_sim_port->logfile = fopen (logpath, "w+");
-  //TODO check for fopen error
-  free (h2fPath);
-  return axi_sim_port;
-}
-
-static void h2f_destroy (axi_sim_port_t* axi_sim_port) {
-  fclose (axi_sim_port->logfile);
-  baub_fifo_Close (axi_sim_port->fifo);
-  free (axi_sim_port);
-}
+// H2F AXI4 flit helpers
+static const axi_port_fns_t h2f_fns =
+{ .id_width = H2F_ID
+, .addr_width = H2F_ADDR
+, .data_width_bytes = H2F_DATA / 8
+, .aw_create_flit = &H2F_AW_(create_flit)
+, .w_create_flit  = &H2F_W_(create_flit)
+, .b_create_flit  = &H2F_B_(create_flit)
+, .ar_create_flit = &H2F_AR_(create_flit)
+, .r_create_flit  = &H2F_R_(create_flit)
+, .aw_fprint_flit = &H2F_AW_(fprint_flit)
+, .w_fprint_flit  = &H2F_W_(fprint_flit)
+, .b_fprint_flit  = &H2F_B_(fprint_flit)
+, .ar_fprint_flit = &H2F_AR_(fprint_flit)
+, .r_fprint_flit  = &H2F_R_(fprint_flit)
+, .fifo_OpenAsSlave  = &H2F_(fifo_OpenAsSlave)
+, .fifo_OpenAsMaster = &H2F_(fifo_OpenAsMaster)
+};
 
 #endif
@@ -157,29 +157,23 @@ DEF_AXI4_API( H2F_LW_ID, H2F_LW_ADDR, H2F_LW_DATA
   AXI4_R_(H2F_LW_ID, H2F_LW_DATA, H2F_LW_RUSER, h2f_lw, sym)
 #define H2F_LW_R_(sym) _H2F_LW_R_(H2F_LW_ID, H2F_LW_DATA, H2F_LW_RUSER, sym)
 
-static axi_sim_port_t* h2f_lw_init (const char* portpath, const char* logpath) {
-  axi_sim_port_t* axi_sim_port = malloc (sizeof (axi_sim_port_t));
-  // H2F LW interface
-  size_t len = strlen (portpath) + 1;
-  /**/devs_print (h2f_lw_devs, n_h2f_lw_devs);
-  char* h2flwPath = (char*) malloc (len + strlen ("/" H2F_LW_FOLDER));
-  strcpy (h2flwPath, portpath);
-  strcat (h2flwPath, "/" H2F_LW_FOLDER);
-  axi_sim_port->fifo = H2F_LW_(fifo_OpenAsSlave)(h2flwPath);
-  // H2F LW logstream
-  if ((axi_sim_port->logfile = fopen (logpath, "w")) == NULL) {
-    fprintf(stderr, "Failed fopen(\"%s\", \"w\"): ", logpath);
-    perror(NULL);
-    exit (EXIT_FAILURE);
-  }
-  free (h2flwPath);
-  return axi_sim_port;
-}
-
-static void h2f_lw_destroy (axi_sim_port_t* axi_sim_port) {
-  fclose (axi_sim_port->logfile);
-  baub_fifo_Close (axi_sim_port->fifo);
-  free (axi_sim_port);
-}
+// H2F LW AXI4 flit helpers
+static const axi_port_fns_t h2f_lw_fns =
+{ .id_width = H2F_LW_ID
+, .addr_width = H2F_LW_ADDR
+, .data_width_bytes = H2F_LW_DATA / 8
+, .aw_create_flit = &H2F_LW_AW_(create_flit)
+, .w_create_flit  = &H2F_LW_W_(create_flit)
+, .b_create_flit  = &H2F_LW_B_(create_flit)
+, .ar_create_flit = &H2F_LW_AR_(create_flit)
+, .r_create_flit  = &H2F_LW_R_(create_flit)
+, .aw_fprint_flit = &H2F_LW_AW_(fprint_flit)
+, .w_fprint_flit  = &H2F_LW_W_(fprint_flit)
+, .b_fprint_flit  = &H2F_LW_B_(fprint_flit)
+, .ar_fprint_flit = &H2F_LW_AR_(fprint_flit)
+, .r_fprint_flit  = &H2F_LW_R_(fprint_flit)
+, .fifo_OpenAsSlave  = &H2F_LW_(fifo_OpenAsSlave)
+, .fifo_OpenAsMaster = &H2F_LW_(fifo_OpenAsMaster)
+};
 
 #endif
@@ -0,0 +1,120 @@
+#ifndef AXI_BURST_H
+#define AXI_BURST_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <inttypes.h>
+#include <BlueUnixBridges.h>
+#include <BlueAXI4UnixBridges.h>
+#include <CHERI_BGAS_fuse_devfs.h>
+
+// AXI4 burst parameters
+////////////////////////////////////////////////////////////////////////////////
+
+#define AXI4_BURST_FIXED 0
+#define AXI4_BURST_INCR  1
+#define AXI4_BURST_WRAP  2
+
+// an INCR burst is at most 256 beats long and must not cross a 4KiB boundary
+#define AXI4_MAX_BURST_BEATS 256
+#define AXI4_BOUNDARY 0x1000
+
+// AXI4 RRESP / BRESP encoding
+#define AXI4_RESP_OKAY   0
+#define AXI4_RESP_EXOKAY 1
+#define AXI4_RESP_SLVERR 2
+#define AXI4_RESP_DECERR 3
+
+// AXI4 size field encoding for a given number of bytes per beat
+static uint8_t axi_size_encode (int nbytes) {
+  uint8_t size = 0;
+  while ((1 << size) < nbytes) size++;
+  return size;
+}
+
+// number of beats of the INCR burst starting with the beat containing addr
+// and covering as much as possible of the len bytes from addr
+static int axi_burst_beats (uint64_t addr, size_t len, int data_width_bytes) {
+  uint64_t beat_addr = addr & ~((uint64_t) data_width_bytes - 1);
+  uint64_t boundary = (beat_addr | (AXI4_BOUNDARY - 1)) + 1;
+  uint64_t end = addr + len;
+  if (end > boundary) end = boundary;
+  uint64_t nbeats = (end - beat_addr + data_width_bytes - 1) / data_width_bytes;
+  if (nbeats > AXI4_MAX_BURST_BEATS) nbeats = AXI4_MAX_BURST_BEATS;
+  return (int) nbeats;
+}
+
+// number of bytes from addr that the next burst can cover
+static size_t axi_burst_chunk (uint64_t addr, size_t len, int data_width_bytes) {
+  uint64_t beat_addr = addr & ~((uint64_t) data_width_bytes - 1);
+  int nbeats = axi_burst_beats (addr, len, data_width_bytes);
+  size_t chunk = beat_addr + (uint64_t) nbeats * data_width_bytes - addr;
+  return (chunk < len) ? chunk : len;
+}
+
+// size of the smallest naturally aligned block, of at most a beat, holding a
+// byte range within a beat
+static int axi_block_bytes (uint64_t addr, size_t len, int data_width_bytes) {
+  int block = 1;
+  while (   block < data_width_bytes
+         && (addr & ~((uint64_t) block - 1)) + block < addr + len) block <<= 1;
+  return block;
+}
+
+// address of a beat of a burst (for bursts received from a master)
+static uint64_t axi_beat_addr ( uint64_t addr
+                              , uint8_t axsize
+                              , uint8_t axlen
+                              , uint8_t axburst
+                              , int beat ) {
+  uint64_t size = 1 << axsize;
+  switch (axburst) {
+    case AXI4_BURST_FIXED: return addr;
+    case AXI4_BURST_WRAP: {
+      uint64_t wrap = size * (axlen + 1);
+      uint64_t lower = addr & ~(wrap - 1);
+      return lower + ((addr + beat * size) & (wrap - 1));
+    }
+    default:
+      return beat ? (addr & ~(size - 1)) + beat * size : addr;
+  }
+}
+
+#endif
@@ -0,0 +1,1054 @@
+#ifndef AXI_ENGINE_H
+#define AXI_ENGINE_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <BlueUnixBridges.h>
+#include <BlueAXI4UnixBridges.h>
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_burst.h>
+#include <mpsc_ring.h>
+#include <trace.h>
+#include <dev_registry.h>
+#include <shm_ring.h>
+
+// number of bursts a single byte range transfer keeps in flight
+#ifndef AXI_ENGINE_WINDOW
+#define AXI_ENGINE_WINDOW 8
+#endif
+
+// number of transactions a port keeps in flight
+#ifndef AXI_ENGINE_MAX_OUTSTANDING
+#define AXI_ENGINE_MAX_OUTSTANDING 64
+#endif
+
+// number of posted writes a port keeps in flight
+#ifndef AXI_ENGINE_POSTED
+#define AXI_ENGINE_POSTED 32
+#endif
+
+// how long a waiter sleeps between checks for its request's interruption
+#ifndef AXI_WAIT_SLICE_NS
+#define AXI_WAIT_SLICE_NS 50000000ull
+#endif
+
+// age past which a transaction without a timeout is reported as stuck
+#ifndef AXI_STUCK_NS
+#define AXI_STUCK_NS 1000000000ull
+#endif
+
+// A posted write, together with a copy of the data it writes. It belongs to
+// the engine from its submission to its B response.
+typedef struct axi_posted {
+  axi_txn_t txn;
+  uint8_t data[AXI4_BOUNDARY];
+  struct axi_posted* next_free;
+} axi_posted_t;
+
+// Transaction helpers
+////////////////////////////////////////////////////////////////////////////////
+
+// A transaction covering a byte range (which must fit in one burst, see
+// axi_burst_chunk) with one INCR burst of full data width beats, or, when the
+// range fits in a beat, with a single narrow beat over the smallest naturally
+// aligned block holding it. Either way, the write strobes select exactly the
+// bytes of the range.
+static void axi_txn_burst ( axi_txn_t* txn
+                          , axi_txn_kind_t kind
+                          , int data_width_bytes
+                          , uint64_t addr
+                          , size_t len ) {
+  txn->kind = kind;
+  txn->nbeats = axi_burst_beats (addr, len, data_width_bytes);
+  int block = (txn->nbeats == 1) ? axi_block_bytes (addr, len, data_width_bytes)
+                                 : data_width_bytes;
+  txn->axaddr = addr & ~((uint64_t) block - 1);
+  txn->axsize = axi_size_encode (block);
+  txn->addr = addr;
+  txn->len = len;
+  txn->wmask = NULL;
+  txn->posted = false;
+  txn->ordered = false;
+}
+
+// whether a byte of a write transaction's range is to be written
+static bool axi_txn_wbyte (const axi_txn_t* txn, uint64_t addr) {
+  if (addr < txn->addr || addr >= txn->addr + txn->len) return false;
+  uint64_t i = addr - txn->addr;
+  return !txn->wmask || ((txn->wmask[i / 8] >> (i % 8)) & 1);
+}
+
+// the address of the data lane 0 of a transaction's beat
+// (bursts are full data width, so only single beat transactions are narrow)
+static uint64_t axi_txn_beat_addr (const axi_txn_t* txn, int beat, int dwb) {
+  return (txn->axaddr & ~((uint64_t) dwb - 1)) + (uint64_t) beat * dwb;
+}
+
+static void axi_id_queue_push (axi_id_queue_t* q, axi_txn_t* txn) {
+  txn->next = NULL;
+  if (q->tail) q->tail->next = txn;
+  else q->head = txn;
+  q->tail = txn;
+  q->count++;
+}
+
+static axi_txn_t* axi_id_queue_pop (axi_id_queue_t* q) {
+  axi_txn_t* txn = q->head;
+  if (!txn) return NULL;
+  q->head = txn->next;
+  if (!q->head) q->tail = NULL;
+  q->count--;
+  return txn;
+}
+
+// take a transaction out of the queue
+static void axi_id_queue_remove (axi_id_queue_t* q, axi_txn_t* txn) {
+  axi_txn_t** link = &q->head;
+  axi_txn_t* prev = NULL;
+  while (*link != txn) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  *link = txn->next;
+  if (q->tail == txn) q->tail = prev;
+  q->count--;
+}
+
+// put a transaction in the place of another one of the queue
+static void axi_id_queue_replace ( axi_id_queue_t* q
+                                 , axi_txn_t* old
+                                 , axi_txn_t* txn ) {
+  axi_txn_t** link = &q->head;
+  while (*link != old) link = &(*link)->next;
+  txn->next = old->next;
+  *link = txn;
+  if (q->tail == old) q->tail = txn;
+}
+
+// pick the least busy ID. Transactions sharing an ID are answered in order,
+// so spreading them across IDs lets the simulator answer out of order.
+static int axi_id_alloc (axi_id_queue_t queues[], int n_ids) {
+  int id = 0;
+  for (int i = 1; i < n_ids; i++)
+    if (queues[i].count < queues[id].count) id = i;
+  return id;
+}
+
+// Flit pool
+////////////////////////////////////////////////////////////////////////////////
+
+// count a heap allocation made on behalf of an engine, and return it
+static void* axi_counted (axi_engine_t* engine, void* p) {
+  atomic_fetch_add_explicit (&engine->n_allocs, 1, memory_order_relaxed);
+  return p;
+}
+
+static void axi_flit_pool_init ( axi_engine_t* engine
+                               , const axi_port_fns_t* fns ) {
+  axi_flit_pool_t* pool = &engine->flits;
+  pool->aw = axi_counted (engine, fns->aw_create_flit (NULL));
+  pool->w  = axi_counted (engine, fns->w_create_flit (NULL));
+  pool->b  = axi_counted (engine, fns->b_create_flit (NULL));
+  pool->ar = axi_counted (engine, fns->ar_create_flit (NULL));
+  pool->r  = axi_counted (engine, fns->r_create_flit (NULL));
+}
+
+static void axi_flit_pool_destroy (axi_flit_pool_t* pool) {
+  free (pool->aw);
+  free (pool->w);
+  free (pool->b);
+  free (pool->ar);
+  free (pool->r);
+}
+
+// Transport
+////////////////////////////////////////////////////////////////////////////////
+// A port is served through its fifos, or through the shared memory rings of
+// its folder when the simulator provides them (see shm_ring.h).
+//
+// The request thread must not block for good in a send to a simulator which
+// stopped consuming its requests. A fifo send first waits for room in its
+// channel pipe, watched through a descriptor of its own, and a shared memory
+// send waits on its ring. Either wait gives up when the transaction being
+// sent is abandoned (see axi_abandon) or the port is disconnected, either of
+// which kicks the request thread.
+
+// the request channel pipes in a port's folder, as laid out by
+// BlueAXI4UnixBridges
+enum { AXI_REQ_AW, AXI_REQ_W, AXI_REQ_AR, AXI_REQ_CHANS };
+static const char* const axi_req_pipes[AXI_REQ_CHANS] = { "aw", "w", "ar" };
+
+// Open the watch descriptors of the request pipes of a fifo port. They are
+// opened read-write, which opens a pipe whether or not the simulator has
+// opened its end yet, but never read. The flits to a pipe which cannot be
+// watched are sent blocking.
+static void axi_req_watch_open (axi_sim_port_t* simport) {
+  for (int i = 0; i < AXI_REQ_CHANS; i++) {
+    char path[strlen (simport->path) + strlen (axi_req_pipes[i]) + 2];
+    sprintf (path, "%s/%s", simport->path, axi_req_pipes[i]);
+    simport->req_fds[i] = open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  }
+}
+
+static void axi_req_watch_close (axi_sim_port_t* simport) {
+  for (int i = 0; i < AXI_REQ_CHANS; i++) {
+    if (simport->req_fds[i] >= 0) close (simport->req_fds[i]);
+    simport->req_fds[i] = -1;
+  }
+}
+
+// wake the request thread up if it waits to send a flit
+static void axi_engine_kick (axi_engine_t* engine) {
+  uint64_t one = 1;
+  if (write (engine->wakefd, &one, sizeof (one)) < 0) perror ("engine kick");
+}
+
+// the status to give the issuing transaction up with, or 0
+static int axi_send_cancelled (axi_sim_port_t* simport) {
+  int status = atomic_load (&simport->engine.issue_cancel);
+  if (status) return status;
+  return (atomic_load (&simport->link) == AXI_LINK_UP) ? 0 : -ENOTCONN;
+}
+
+// Wait until a request pipe takes a flit without blocking (a flit is written
+// with a single write of less than PIPE_BUF bytes, which a pipe polled
+// writable takes whole), or return the status to give the issuing up with
+static int axi_send_wait (axi_sim_port_t* simport, int chan) {
+  axi_engine_t* engine = &simport->engine;
+  struct pollfd fds[2] = { { .fd = simport->req_fds[chan], .events = POLLOUT }
+                         , { .fd = engine->wakefd, .events = POLLIN } };
+  for (;;) {
+    int status = axi_send_cancelled (simport);
+    if (status || fds[0].fd < 0) return status;
+    if (poll (fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror ("engine send poll");
+      return -EIO;
+    }
+    if (fds[0].revents & POLLOUT) return axi_send_cancelled (simport);
+    uint64_t n;
+    if (   (fds[1].revents & POLLIN)
+        && read (engine->wakefd, &n, sizeof (n)) < 0 && errno != EAGAIN )
+      perror ("engine wakeup");
+  }
+}
+
+// the status of a shared memory send which was given up
+static int axi_send_refused (axi_sim_port_t* simport) {
+  int status = axi_send_cancelled (simport);
+  return status ? status : -ENOTCONN;
+}
+
+// Send a request flit. Each returns 0, or the status its send was given up
+// with.
+static int axi_send_aw (axi_sim_port_t* simport, t_axi4_awflit* awflit) {
+  if (simport->shm)
+    return shm_send_aw (simport->shm, simport->fns, awflit)
+           ? 0 : axi_send_refused (simport);
+  int status = axi_send_wait (simport, AXI_REQ_AW);
+  if (status == 0) bub_fifo_ProduceElement (simport->fifo->aw, (void*) awflit);
+  return status;
+}
+
+static int axi_send_w (axi_sim_port_t* simport, t_axi4_wflit* wflit) {
+  if (simport->shm)
+    return shm_send_w (simport->shm, simport->fns, wflit)
+           ? 0 : axi_send_refused (simport);
+  int status = axi_send_wait (simport, AXI_REQ_W);
+  if (status == 0) bub_fifo_ProduceElement (simport->fifo->w, (void*) wflit);
+  return status;
+}
+
+static int axi_send_ar (axi_sim_port_t* simport, t_axi4_arflit* arflit) {
+  if (simport->shm)
+    return shm_send_ar (simport->shm, simport->fns, arflit)
+           ? 0 : axi_send_refused (simport);
+  int status = axi_send_wait (simport, AXI_REQ_AR);
+  if (status == 0) bub_fifo_ProduceElement (simport->fifo->ar, (void*) arflit);
+  return status;
+}
+
+// receive a response flit, waiting for one, or return false once the port's
+// rings are stopped
+static bool axi_recv_r (axi_sim_port_t* simport, t_axi4_rflit* rflit) {
+  if (simport->shm) return shm_recv_r (simport->shm, simport->fns, rflit);
+  bub_fifo_ConsumeElement (simport->fifo->r, (void*) rflit);
+  return true;
+}
+
+static bool axi_recv_b (axi_sim_port_t* simport, t_axi4_bflit* bflit) {
+  if (simport->shm) return shm_recv_b (simport->shm, simport->fns, bflit);
+  bub_fifo_ConsumeElement (simport->fifo->b, (void*) bflit);
+  return true;
+}
+
+// Requests issue
+////////////////////////////////////////////////////////////////////////////////
+
+// log a flit in the binary trace, or in the port's text log without
+// interleaving it with the other threads' flits
+#define AXI_LOG_FLIT(simport, chan, flit) do { \
+  if (devfs_log_level == DEVFS_LOG_TRACE) \
+    trace_##chan ((simport)->trace_port, flit); \
+  else if (devfs_log_level == DEVFS_LOG_TEXT) { \
+    flockfile ((simport)->logfile); \
+    (simport)->fns->chan##_fprint_flit ((simport)->logfile, flit); \
+    fprintf ((simport)->logfile, "\n"); \
+    fflush ((simport)->logfile); \
+    funlockfile ((simport)->logfile); \
+  } \
+} while (0)
+
+// Issue the flits of a transaction, or give up with a status, telling through
+// torn whether some of its flits were sent already. The transaction may
+// complete and be reused by its submitter as soon as its last flit is sent,
+// so it is only accessed through a copy taken beforehand.
+static int axi_issue ( axi_sim_port_t* simport
+                     , const axi_txn_t* submitted
+                     , bool* torn ) {
+  const axi_port_fns_t* fns = simport->fns;
+  int dwb = fns->data_width_bytes;
+  axi_txn_t copy = *submitted;
+  const axi_txn_t* txn = &copy;
+  *torn = false;
+  int status;
+  if (txn->kind == AXI_TXN_READ) {
+    // send an AXI4 read request AR flit
+    t_axi4_arflit* arflit = simport->engine.flits.ar;
+    arflit->arid[0] = txn->id;
+    for (int i = 0; i < AXI_ADDR_BYTES (fns); i++)
+      arflit->araddr[i] = ((uint8_t*) &txn->axaddr)[i];
+    arflit->arlen = txn->nbeats - 1;
+    arflit->arsize = txn->axsize;
+    arflit->arburst = AXI4_BURST_INCR;
+    /*TODO*/ arflit->arlock = 0;
+    /*TODO*/ arflit->arcache = 0;
+    /*TODO*/ arflit->arprot = 0;
+    /*TODO*/ arflit->arqos = 0;
+    /*TODO*/ arflit->arregion = 0;
+    arflit->aruser[0] = 0;
+    if ((status = axi_send_ar (simport, arflit)) != 0) return status;
+    AXI_LOG_FLIT (simport, ar, arflit);
+  } else {
+    // send an AXI4 write request AW flit
+    t_axi4_awflit* awflit = simport->engine.flits.aw;
+    awflit->awid[0] = txn->id;
+    for (int i = 0; i < AXI_ADDR_BYTES (fns); i++)
+      awflit->awaddr[i] = ((uint8_t*) &txn->axaddr)[i];
+    awflit->awlen = txn->nbeats - 1;
+    awflit->awsize = txn->axsize;
+    awflit->awburst = AXI4_BURST_INCR;
+    /*TODO*/ awflit->awlock = 0;
+    /*TODO*/ awflit->awcache = 0;
+    /*TODO*/ awflit->awprot = 0;
+    /*TODO*/ awflit->awqos = 0;
+    /*TODO*/ awflit->awregion = 0;
+    awflit->awuser[0] = 0;
+    if ((status = axi_send_aw (simport, awflit)) != 0) return status;
+    AXI_LOG_FLIT (simport, aw, awflit);
+    *torn = true;
+    // send the AXI4 write data W flits, one per beat, with the bytes outside
+    // of the accessed range (or masked off) strobed off
+    t_axi4_wflit* wflit = simport->engine.flits.w;
+    for (int beat = 0; beat < txn->nbeats; beat++) {
+      uint64_t pos = axi_txn_beat_addr (txn, beat, dwb);
+      for (int i = 0; i < (dwb + 7) / 8; i++) wflit->wstrb[i] = 0;
+      for (int i = 0; i < dwb; i++) {
+        if (axi_txn_wbyte (txn, pos + i)) {
+          wflit->wdata[i] = txn->wsrc[pos + i - txn->addr];
+          wflit->wstrb[i / 8] |= 1 << (i % 8);
+        } else wflit->wdata[i] = 0;
+      }
+      wflit->wlast = (beat == txn->nbeats - 1) ? 1 : 0;
+      wflit->wuser[0] = 0;
+      if ((status = axi_send_w (simport, wflit)) != 0) return status;
+      AXI_LOG_FLIT (simport, w, wflit);
+    }
+    *torn = false;
+  }
+  return 0;
+}
+
+static void axi_fail (axi_engine_t* engine, axi_txn_t* txn, int status);
+static void axi_give_up ( axi_sim_port_t* simport, axi_txn_t* txn
+                        , int status, bool torn );
+
+// the request thread issues the submitted transactions in submission order
+static void* axi_req_thread (void* arg) {
+  axi_sim_port_t* simport = (axi_sim_port_t*) arg;
+  axi_engine_t* engine = &simport->engine;
+  for (;;) {
+    while (sem_wait (&engine->doorbell) != 0);
+    if (atomic_load (&engine->stop)) break;
+    // a later submitter may have rung the doorbell before an earlier one
+    // finished publishing its transaction
+    axi_txn_t* txn;
+    while (!(txn = (axi_txn_t*) mpsc_ring_pop (&engine->submissions)))
+      sched_yield ();
+    // allocate an ID, waiting for room when too many transactions are in
+    // flight. The ID queue order must match the AR (resp. AW) flits order.
+    pthread_mutex_lock (&engine->lock);
+    while (engine->outstanding >= AXI_ENGINE_MAX_OUTSTANDING && !txn->cancel)
+      pthread_cond_wait (&engine->cond, &engine->lock);
+    // transactions submitted just before a disconnection, or after a torn
+    // one, or abandoned by their waiter in the meantime, fail straight away
+    if (   txn->cancel || atomic_load (&simport->link) != AXI_LINK_UP
+        || atomic_load (&engine->torn) ) {
+      axi_fail (engine, txn, txn->cancel ? txn->cancel : -ENOTCONN);
+      pthread_mutex_unlock (&engine->lock);
+      continue;
+    }
+    axi_id_queue_t* queues =
+      (txn->kind == AXI_TXN_READ) ? engine->rd : engine->wr;
+    // posted writes share an ID, which keeps them in order with each other,
+    // and with the ordered transactions
+    txn->id = (txn->posted || txn->ordered) ? 0
+            : axi_id_alloc (queues, engine->n_ids);
+    txn->t_issue = lat_now ();
+    txn->state = AXI_TXN_ISSUED;
+    axi_id_queue_push (&queues[txn->id], txn);
+    engine->outstanding++;
+    // the transaction is not abandoned while its flits are being sent, but
+    // their sending is given up
+    atomic_store (&engine->issue_cancel, 0);
+    atomic_store (&engine->issuing, txn);
+    // the transaction may complete as soon as its flits are issued
+    dev_stats_t* stats = txn->stats;
+    axi_txn_kind_t kind = txn->kind;
+    uint64_t t_issue = txn->t_issue;
+    if (stats)
+      lat_hist_record (&stats->lat[kind][LAT_QUEUE], t_issue - txn->t_submit);
+    pthread_mutex_unlock (&engine->lock);
+    // a disconnection gives the sending up too, and closes the transport and
+    // fails the transactions in flight once no flit is being sent anymore,
+    // so a given up transaction fails first
+    pthread_mutex_lock (&engine->tx_lock);
+    bool torn;
+    int status = axi_issue (simport, txn, &torn);
+    if (status != 0) {
+      pthread_mutex_lock (&engine->lock);
+      axi_give_up (simport, txn, status, torn);
+      pthread_mutex_unlock (&engine->lock);
+    }
+    atomic_store (&engine->issuing, NULL);
+    pthread_mutex_unlock (&engine->tx_lock);
+    if (stats)
+      lat_hist_record (&stats->lat[kind][LAT_PRODUCE], lat_now () - t_issue);
+  }
+  return NULL;
+}
+
+// Responses handling
+////////////////////////////////////////////////////////////////////////////////
+// The handlers below are called with the engine lock held.
+
+// the status of a transaction answered with an AXI4 response
+static int axi_resp_status (uint8_t resp) {
+  switch (resp) {
+    case AXI4_RESP_SLVERR: return -EIO;
+    case AXI4_RESP_DECERR: return -EFAULT;
+    default: return 0;
+  }
+}
+
+// count a completed transaction
+static void axi_stats_count (axi_stats_t* stats, const axi_txn_t* txn) {
+  const memory_order relaxed = memory_order_relaxed;
+  if (txn->status == 0 && txn->kind == AXI_TXN_READ) {
+    atomic_fetch_add_explicit (&stats->reads, 1, relaxed);
+    atomic_fetch_add_explicit (&stats->read_bytes, txn->len, relaxed);
+  } else if (txn->status == 0) {
+    atomic_fetch_add_explicit (&stats->writes, 1, relaxed);
+    atomic_fetch_add_explicit (&stats->write_bytes, txn->len, relaxed);
+  } else if (txn->status == -EIO)
+    atomic_fetch_add_explicit (&stats->slverr, 1, relaxed);
+  else if (txn->status == -EFAULT)
+    atomic_fetch_add_explicit (&stats->decerr, 1, relaxed);
+  else if (txn->status == -ETIMEDOUT)
+    atomic_fetch_add_explicit (&stats->timeouts, 1, relaxed);
+  else if (txn->status == -EINTR)
+    atomic_fetch_add_explicit (&stats->cancelled, 1, relaxed);
+}
+
+// Signal a transaction completion. The transaction belongs to the waiting
+// thread again as soon as the completion is posted, and posted writes go back
+// to the free slots. The stand-in of an abandoned transaction is just freed.
+static void axi_complete (axi_engine_t* engine, axi_txn_t* txn) {
+  if (txn->abandoned) {
+    free (txn);
+    return;
+  }
+  txn->state = AXI_TXN_DONE;
+  axi_stats_count (&engine->stats, txn);
+  if (txn->stats) {
+    axi_stats_count (&txn->stats->axi, txn);
+    lat_hist_record ( &txn->stats->lat[txn->kind][LAT_RESPONSE]
+                    , lat_now () - txn->t_issue );
+  }
+  engine->outstanding--;
+  pthread_cond_signal (&engine->cond);
+  if (txn->posted) {
+    axi_posted_t* slot = (axi_posted_t*) txn;
+    slot->next_free = engine->posted_free;
+    engine->posted_free = slot;
+    engine->posted--;
+    pthread_cond_broadcast (&engine->posted_cond);
+  } else sem_post (&txn->completion);
+}
+
+// Complete a transaction which was never issued with an error, as when its
+// port is not connected. A failed posted write is reported by the next flush
+// or fsync of its device.
+static void axi_fail (axi_engine_t* engine, axi_txn_t* txn, int status) {
+  txn->status = status;
+  txn->t_issue = lat_now ();
+  if (txn->posted && txn->stats) atomic_fetch_add (&txn->stats->posted_errors, 1);
+  engine->outstanding++;
+  axi_complete (engine, txn);
+}
+
+// Fail a transaction whose flits could not all be sent, taking it out of its
+// ID queue. The requests of a port on which only some of the flits of a
+// transaction were sent cannot be resumed, so the port fails its later
+// transactions, and is disconnected by the port watcher (see port_watch.h)
+// until its simulator is back. Called with the engine lock held.
+static void axi_give_up ( axi_sim_port_t* simport, axi_txn_t* txn
+                        , int status, bool torn ) {
+  axi_engine_t* engine = &simport->engine;
+  axi_id_queue_remove ( (txn->kind == AXI_TXN_READ) ? &engine->rd[txn->id]
+                                                    : &engine->wr[txn->id]
+                      , txn );
+  if (torn) {
+    fprintf ( stderr, "%s -- write to 0x%" PRIx64 " given up half sent,"
+                      " reconnecting\n"
+            , simport->name, txn->addr );
+    atomic_store (&engine->torn, true);
+    atomic_store (&simport->lost, true);
+  }
+  txn->status = status;
+  if (txn->posted && txn->stats) atomic_fetch_add (&txn->stats->posted_errors, 1);
+  axi_complete (engine, txn);
+}
+
+// Abandon a transaction which is taking too long, or whose request was
+// interrupted, failing it with a status. An issued transaction is replaced in
+// its ID queue by a stand-in which swallows its late responses, and no longer
+// counts against the port's outstanding transactions. A transaction still
+// queued fails as soon as the request thread gets to it, and the request
+// thread gives up sending the flits of the one it is sending (which is left
+// for a later attempt if its flits were all sent already). Called with the
+// engine lock held.
+static void axi_abandon (axi_engine_t* engine, axi_txn_t* txn, int status) {
+  if (txn->state == AXI_TXN_DONE) return;
+  if (txn->state == AXI_TXN_QUEUED) {
+    txn->cancel = status;
+    pthread_cond_broadcast (&engine->cond);
+    return;
+  }
+  if (atomic_load (&engine->issuing) == txn) {
+    atomic_store (&engine->issue_cancel, status);
+    axi_engine_kick (engine);
+    return;
+  }
+  axi_txn_t* stand_in = axi_counted (engine, malloc (sizeof (axi_txn_t)));
+  *stand_in = (axi_txn_t) { .kind = txn->kind, .axaddr = txn->axaddr
+                          , .axsize = txn->axsize, .nbeats = txn->nbeats
+                          , .addr = txn->addr, .len = 0
+                          , .t_submit = txn->t_submit, .t_issue = txn->t_issue
+                          , .state = AXI_TXN_ISSUED, .abandoned = true
+                          , .stuck = true, .id = txn->id, .beat = txn->beat };
+  axi_id_queue_replace ( (txn->kind == AXI_TXN_READ) ? &engine->rd[txn->id]
+                                                     : &engine->wr[txn->id]
+                       , txn, stand_in );
+  txn->status = status;
+  if (txn->posted && txn->stats) atomic_fetch_add (&txn->stats->posted_errors, 1);
+  axi_complete (engine, txn);
+}
+
+// Fail all the transactions in flight on a port, once its responses are not
+// received anymore
+static void axi_fail_inflight (axi_sim_port_t* simport, int status) {
+  axi_engine_t* engine = &simport->engine;
+  pthread_mutex_lock (&engine->lock);
+  for (int id = 0; id < AXI_MAX_IDS; id++) {
+    axi_txn_t* txn;
+    while ((txn = axi_id_queue_pop (&engine->rd[id]))) {
+      txn->status = status;
+      axi_complete (engine, txn);
+    }
+    while ((txn = axi_id_queue_pop (&engine->wr[id]))) {
+      txn->status = status;
+      if (txn->posted && txn->stats)
+        atomic_fetch_add (&txn->stats->posted_errors, 1);
+      axi_complete (engine, txn);
+    }
+  }
+  pthread_mutex_unlock (&engine->lock);
+}
+
+static void axi_handle_rflit ( axi_sim_port_t* simport
+                             , const t_axi4_rflit* rflit ) {
+  axi_engine_t* engine = &simport->engine;
+  int dwb = simport->fns->data_width_bytes;
+  int id = (engine->n_ids > 1) ? rflit->rid[0] % engine->n_ids : 0;
+  axi_txn_t* txn = engine->rd[id].head;
+  if (!txn) {
+    fprintf (stderr, "unexpected R flit with id %d\n", id);
+    return;
+  }
+  // the first failed beat fails the transaction
+  if (txn->status == 0) txn->status = axi_resp_status (rflit->rresp);
+  uint64_t pos = axi_txn_beat_addr (txn, txn->beat, dwb);
+  for (int i = 0; i < dwb; i++)
+    if (pos + i >= txn->addr && pos + i < txn->addr + txn->len)
+      txn->rdst[pos + i - txn->addr] = rflit->rdata[i];
+  if (++txn->beat == txn->nbeats) {
+    axi_id_queue_pop (&engine->rd[id]);
+    axi_complete (engine, txn);
+  }
+}
+
+static void axi_handle_bflit ( axi_sim_port_t* simport
+                             , const t_axi4_bflit* bflit ) {
+  axi_engine_t* engine = &simport->engine;
+  int id = (engine->n_ids > 1) ? bflit->bid[0] % engine->n_ids : 0;
+  axi_txn_t* txn = axi_id_queue_pop (&engine->wr[id]);
+  if (!txn) {
+    fprintf (stderr, "unexpected B flit with id %d\n", id);
+    return;
+  }
+  txn->status = axi_resp_status (bflit->bresp);
+  // nobody waits for a posted write, so its errors are counted against its
+  // device, to be reported by the next flush or fsync
+  if (txn->posted && txn->stats) atomic_fetch_add (&txn->stats->posted, 1);
+  if (txn->posted && txn->status < 0) {
+    fprintf ( stderr, "%s -- posted write to 0x%" PRIx64 " failed (bresp %d)\n"
+            , simport->name, txn->addr, bflit->bresp );
+    if (txn->stats) atomic_fetch_add (&txn->stats->posted_errors, 1);
+  }
+  axi_complete (engine, txn);
+}
+
+// handle a flit received on a response channel
+static void axi_receive_rflit (axi_sim_port_t* simport, t_axi4_rflit* rflit) {
+  axi_engine_t* engine = &simport->engine;
+  AXI_LOG_FLIT (simport, r, rflit);
+  pthread_mutex_lock (&engine->lock);
+  axi_handle_rflit (simport, rflit);
+  pthread_mutex_unlock (&engine->lock);
+}
+
+static void axi_receive_bflit (axi_sim_port_t* simport, t_axi4_bflit* bflit) {
+  axi_engine_t* engine = &simport->engine;
+  AXI_LOG_FLIT (simport, b, bflit);
+  pthread_mutex_lock (&engine->lock);
+  axi_handle_bflit (simport, bflit);
+  pthread_mutex_unlock (&engine->lock);
+}
+
+// Ports whose response fifos are not served by the poller (see axi_poller.h)
+// run one response thread per channel. The response threads of a fifo port
+// only get cancelled while waiting for a flit, never while holding the engine
+// lock, and those of a shared memory port stop once its rings are stopped.
+static void* axi_r_thread (void* arg) {
+  axi_sim_port_t* simport = (axi_sim_port_t*) arg;
+  t_axi4_rflit* rflit = simport->engine.flits.r;
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+  for (;;) {
+    pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+    bool received = axi_recv_r (simport, rflit);
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+    if (!received) break;
+    axi_receive_rflit (simport, rflit);
+  }
+  return NULL;
+}
+
+static void* axi_b_thread (void* arg) {
+  axi_sim_port_t* simport = (axi_sim_port_t*) arg;
+  t_axi4_bflit* bflit = simport->engine.flits.b;
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+  for (;;) {
+    pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+    bool received = axi_recv_b (simport, bflit);
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+    if (!received) break;
+    axi_receive_bflit (simport, bflit);
+  }
+  return NULL;
+}
+
+// Engine setup
+////////////////////////////////////////////////////////////////////////////////
+
+// initialize the engine of a port, and start its request thread (its
+// responses are received by the poller or by response threads once the port
+// is connected)
+static void axi_engine_init (axi_sim_port_t* simport, int n_ids) {
+  axi_engine_t* engine = &simport->engine;
+  engine->n_ids = (n_ids < AXI_MAX_IDS) ? n_ids : AXI_MAX_IDS;
+  mpsc_ring_init (&engine->submissions);
+  sem_init (&engine->doorbell, 0, 0);
+  atomic_init (&engine->stop, false);
+  pthread_mutex_init (&engine->lock, NULL);
+  pthread_mutex_init (&engine->tx_lock, NULL);
+  engine->wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (engine->wakefd < 0) {
+    perror ("engine setup");
+    exit (EXIT_FAILURE);
+  }
+  atomic_init (&engine->issue_cancel, 0);
+  atomic_init (&engine->torn, false);
+  pthread_cond_init (&engine->cond, NULL);
+  atomic_init (&engine->n_allocs, 0);
+  axi_flit_pool_init (engine, simport->fns);
+  atomic_init (&engine->n_txns, 0);
+  atomic_init (&engine->issuing, NULL);
+  engine->outstanding = 0;
+  engine->stats = (axi_stats_t) { 0 };
+  engine->posted_slots =
+    axi_counted (engine, malloc (AXI_ENGINE_POSTED * sizeof (axi_posted_t)));
+  engine->posted_free = NULL;
+  for (int i = AXI_ENGINE_POSTED - 1; i >= 0; i--) {
+    engine->posted_slots[i].next_free = engine->posted_free;
+    engine->posted_free = &engine->posted_slots[i];
+  }
+  engine->posted = 0;
+  pthread_cond_init (&engine->posted_cond, NULL);
+  for (int i = 0; i < AXI_MAX_IDS; i++) {
+    engine->rd[i] = (axi_id_queue_t) { .head = NULL, .tail = NULL, .count = 0 };
+    engine->wr[i] = (axi_id_queue_t) { .head = NULL, .tail = NULL, .count = 0 };
+  }
+  engine->rb_threads = false;
+  pthread_create (&engine->req_thread, NULL, axi_req_thread, simport);
+}
+
+// receive the responses of a port on dedicated response threads
+static void axi_engine_start_rb_threads (axi_sim_port_t* simport) {
+  axi_engine_t* engine = &simport->engine;
+  engine->rb_threads = true;
+  pthread_create (&engine->r_thread, NULL, axi_r_thread, simport);
+  pthread_create (&engine->b_thread, NULL, axi_b_thread, simport);
+}
+
+// stop the response threads of a port, once its shared memory rings, if any,
+// are stopped
+static void axi_engine_stop_rb_threads (axi_sim_port_t* simport) {
+  axi_engine_t* engine = &simport->engine;
+  if (!engine->rb_threads) return;
+  if (!simport->shm) {
+    pthread_cancel (engine->r_thread);
+    pthread_cancel (engine->b_thread);
+  }
+  pthread_join (engine->r_thread, NULL);
+  pthread_join (engine->b_thread, NULL);
+  engine->rb_threads = false;
+}
+
+static void axi_drain_posted (axi_sim_port_t* simport);
+
+static void axi_engine_destroy (axi_sim_port_t* simport) {
+  axi_engine_t* engine = &simport->engine;
+  axi_drain_posted (simport);
+  atomic_store (&engine->stop, true);
+  sem_post (&engine->doorbell);
+  pthread_join (engine->req_thread, NULL);
+  printf ( "transaction engine -- %lu transactions, %lu allocations\n"
+         , atomic_load (&engine->n_txns)
+         , atomic_load (&engine->n_allocs) );
+  axi_flit_pool_destroy (&engine->flits);
+  free (engine->posted_slots);
+  pthread_cond_destroy (&engine->posted_cond);
+  pthread_cond_destroy (&engine->cond);
+  pthread_mutex_destroy (&engine->tx_lock);
+  close (engine->wakefd);
+  pthread_mutex_destroy (&engine->lock);
+  sem_destroy (&engine->doorbell);
+}
+
+// Transactions submission
+////////////////////////////////////////////////////////////////////////////////
+
+// hand a transaction over to the engine (any thread)
+static void axi_submit (axi_sim_port_t* simport, axi_txn_t* txn) {
+  axi_engine_t* engine = &simport->engine;
+  txn->beat = 0;
+  txn->status = 0;
+  txn->state = AXI_TXN_QUEUED;
+  txn->cancel = 0;
+  txn->abandoned = false;
+  txn->stuck = false;
+  dev_entry_t* entry = simport->devs
+    ? (dev_entry_t*) dev_registry_find_addr (simport->devs, simport, txn->addr)
+    : NULL;
+  txn->stats = entry ? &entry->stats : NULL;
+  txn->timeout_ns = entry ? entry->timeout_ns : simport->timeout_ns;
+  txn->t_submit = lat_now ();
+  if (!txn->posted) sem_init (&txn->completion, 0, 0);
+  atomic_fetch_add_explicit (&engine->n_txns, 1, memory_order_relaxed);
+  // ports without a simulator fail fast
+  if (atomic_load (&simport->link) != AXI_LINK_UP) {
+    pthread_mutex_lock (&engine->lock);
+    axi_fail (engine, txn, -ENOTCONN);
+    pthread_mutex_unlock (&engine->lock);
+    return;
+  }
+  while (!mpsc_ring_push (&engine->submissions, txn)) sched_yield ();
+  sem_post (&engine->doorbell);
+}
+
+// When set, checked by the waiters of the transactions for the interruption
+// of the request they serve, once their wait is interrupted by a signal (the
+// devfs sets it to fuse_interrupted, and has FUSE signal the threads serving
+// interrupted requests)
+static int (*axi_interrupted) (void) = NULL;
+
+// the CLOCK_REALTIME time, as sem_timedwait sleeps until, of a lat_now time
+static struct timespec axi_realtime_at (uint64_t t) {
+  uint64_t now = lat_now ();
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  uint64_t wake = ts.tv_sec * 1000000000ull + ts.tv_nsec + (t > now ? t - now : 0);
+  ts.tv_sec = wake / 1000000000ull;
+  ts.tv_nsec = wake % 1000000000ull;
+  return ts;
+}
+
+// Wait for a submitted transaction to complete, and return its status. A
+// transaction past its timeout is abandoned and fails with ETIMEDOUT, and one
+// whose request got interrupted fails with EINTR. The abandon of the
+// transaction whose flits are being sent takes effect once the request thread
+// gave them up, or is attempted again every AXI_WAIT_SLICE_NS.
+static int axi_wait (axi_sim_port_t* simport, axi_txn_t* txn) {
+  uint64_t deadline = txn->timeout_ns ? txn->t_submit + txn->timeout_ns : 0;
+  struct timespec ts;
+  if (deadline) ts = axi_realtime_at (deadline);
+  int abandoned = 0; // the status the transaction was abandoned with
+  for (;;) {
+    if (abandoned) ts = axi_realtime_at (lat_now () + AXI_WAIT_SLICE_NS);
+    int ret = (deadline || abandoned) ? sem_timedwait (&txn->completion, &ts)
+                                      : sem_wait (&txn->completion);
+    if (ret == 0) break;
+    int status = 0;
+    if (errno == ETIMEDOUT) status = abandoned ? abandoned : -ETIMEDOUT;
+    else if (   errno == EINTR && !abandoned
+             && axi_interrupted && axi_interrupted () ) status = -EINTR;
+    if (status == 0) continue;
+    abandoned = status;
+    pthread_mutex_lock (&simport->engine.lock);
+    axi_abandon (&simport->engine, txn, abandoned);
+    pthread_mutex_unlock (&simport->engine.lock);
+  }
+  sem_destroy (&txn->completion);
+  return txn->status;
+}
+
+// Watchdog
+////////////////////////////////////////////////////////////////////////////////
+// The transactions in flight are checked periodically (see port_watch.h): the
+// ID queue heads waiting for their responses for too long are reported as
+// stuck, and the posted writes past their timeout, which have no waiter to
+// abandon them, are abandoned.
+
+// the age past which a transaction is stuck
+static uint64_t axi_txn_stuck_ns (const axi_txn_t* txn) {
+  return txn->timeout_ns ? txn->timeout_ns : AXI_STUCK_NS;
+}
+
+static void axi_watchdog (axi_sim_port_t* simport) {
+  axi_engine_t* engine = &simport->engine;
+  pthread_mutex_lock (&engine->lock);
+  uint64_t now = lat_now ();
+  for (int id = 0; id < engine->n_ids; id++) {
+    for (int kind = AXI_TXN_READ; kind <= AXI_TXN_WRITE; kind++) {
+      axi_id_queue_t* q = (kind == AXI_TXN_READ) ? &engine->rd[id] : &engine->wr[id];
+      axi_txn_t* next;
+      for (axi_txn_t* txn = q->head; txn; txn = next) {
+        next = txn->next;
+        if (txn->abandoned) continue;
+        uint64_t age = now - txn->t_issue;
+        if (txn->posted && txn->timeout_ns && age >= txn->timeout_ns) {
+          fprintf ( stderr, "%s -- posted write to 0x%" PRIx64 " timed out\n"
+                  , simport->name, txn->addr );
+          axi_abandon (engine, txn, -ETIMEDOUT);
+        } else if (txn == q->head && !txn->stuck && age >= axi_txn_stuck_ns (txn)) {
+          txn->stuck = true;
+          fprintf ( stderr, "%s -- %s to 0x%" PRIx64 " on id %d stuck for %"
+                            PRIu64 " ms\n"
+                  , simport->name, (kind == AXI_TXN_READ) ? "read" : "write"
+                  , txn->addr, id, age / 1000000 );
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock (&engine->lock);
+}
+
+// Posted writes
+////////////////////////////////////////////////////////////////////////////////
+// A posted write returns as soon as it is handed over to the engine, which
+// answers its B response in the background. Reads must not pass the posted
+// writes before them, so they first drain them, as does a flush or fsync.
+
+// take a free posted write slot, waiting for one to be answered if need be
+static axi_posted_t* axi_posted_alloc (axi_sim_port_t* simport) {
+  axi_engine_t* engine = &simport->engine;
+  pthread_mutex_lock (&engine->lock);
+  while (!engine->posted_free)
+    pthread_cond_wait (&engine->posted_cond, &engine->lock);
+  axi_posted_t* slot = engine->posted_free;
+  engine->posted_free = slot->next_free;
+  engine->posted++;
+  pthread_mutex_unlock (&engine->lock);
+  return slot;
+}
+
+// submit a posted write prepared in a slot, with its data in the slot's copy
+static void axi_post (axi_sim_port_t* simport, axi_posted_t* slot) {
+  slot->txn.wsrc = slot->data;
+  slot->txn.posted = true;
+  axi_submit (simport, &slot->txn);
+}
+
+// wait for all the posted writes of a port to be answered
+static void axi_drain_posted (axi_sim_port_t* simport) {
+  axi_engine_t* engine = &simport->engine;
+  pthread_mutex_lock (&engine->lock);
+  while (engine->posted > 0)
+    pthread_cond_wait (&engine->posted_cond, &engine->lock);
+  pthread_mutex_unlock (&engine->lock);
+}
+
+// Byte range transfers, split into pipelined bursts
+////////////////////////////////////////////////////////////////////////////////
+
+// Transfer a byte range. Write masks are only supported for ranges starting
+// 8-byte aligned, so that each burst's mask starts on a mask byte boundary.
+static int axi_transfer ( axi_sim_port_t* simport
+                        , axi_txn_kind_t kind
+                        , uint64_t addr
+                        , uint8_t* buf
+                        , const uint8_t* wmask
+                        , size_t len ) {
+  uint64_t start = addr;
+  int dwb = simport->fns->data_width_bytes;
+  axi_txn_t txns[AXI_ENGINE_WINDOW];
+  int first = 0;
+  int n = 0;
+  int ret = 0;
+  while (len > 0 || n > 0) {
+    if (len > 0 && n < AXI_ENGINE_WINDOW) {
+      // keep up to AXI_ENGINE_WINDOW bursts in flight
+      axi_txn_t* txn = &txns[(first + n) % AXI_ENGINE_WINDOW];
+      size_t chunk = axi_burst_chunk (addr, len, dwb);
+      axi_txn_burst (txn, kind, dwb, addr, chunk);
+      txn->rdst = buf;
+      if (wmask) txn->wmask = wmask + (addr - start) / 8;
+      axi_submit (simport, txn);
+      n++;
+      addr += chunk;
+      buf += chunk;
+      len -= chunk;
+    } else {
+      // retire the oldest burst
+      int status = axi_wait (simport, &txns[first]);
+      if (ret == 0) ret = status;
+      first = (first + 1) % AXI_ENGINE_WINDOW;
+      n--;
+    }
+  }
+  return ret;
+}
+
+static int axi_read ( axi_sim_port_t* simport
+                    , uint64_t addr
+                    , uint8_t* dst
+                    , size_t len ) {
+  return axi_transfer (simport, AXI_TXN_READ, addr, dst, NULL, len);
+}
+
+static int axi_write ( axi_sim_port_t* simport
+                     , uint64_t addr
+                     , const uint8_t* src
+                     , size_t len ) {
+  return axi_transfer (simport, AXI_TXN_WRITE, addr, (uint8_t*) src, NULL, len);
+}
+
+// write a byte range as posted INCR bursts
+static void axi_write_posted ( axi_sim_port_t* simport
+                             , uint64_t addr
+                             , const uint8_t* src
+                             , size_t len ) {
+  int dwb = simport->fns->data_width_bytes;
+  while (len > 0) {
+    axi_posted_t* slot = axi_posted_alloc (simport);
+    size_t chunk = axi_burst_chunk (addr, len, dwb);
+    axi_txn_burst (&slot->txn, AXI_TXN_WRITE, dwb, addr, chunk);
+    memcpy (slot->data, src, chunk);
+    axi_post (simport, slot);
+    addr += chunk;
+    src += chunk;
+    len -= chunk;
+  }
+}
+
+// write the bytes of a range selected by a bitmap (addr must be 8-byte aligned)
+static int axi_write_masked ( axi_sim_port_t* simport
+                            , uint64_t addr
+                            , const uint8_t* src
+                            , const uint8_t* mask
+                            , size_t len ) {
+  return axi_transfer (simport, AXI_TXN_WRITE, addr, (uint8_t*) src, mask, len);
+}
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef AXI_POLLER_H
+#define AXI_POLLER_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_engine.h>
+
+// Event-driven response transport
+////////////////////////////////////////////////////////////////////////////////
+// A single poller thread waits on the R and B channel fifos of all the ports
+// with one epoll set, and on each wakeup drains every flit the ready channels
+// hold before waiting again, so an idle mount sleeps in epoll_wait and a busy
+// one handles many flits per wakeup. The fifos are watched through read-only
+// descriptors of their own opened on the channel pipes of the port's folder,
+// and still consumed through the bridge library, which never blocks on a
+// channel with bytes available. A port whose channel pipes cannot be watched
+// falls back to its own response threads. Ports are added as they connect and
+// removed as they disconnect, and a port whose simulator hangs up is reported
+// to the port watcher (see port_watch.h).
+
+#define AXI_POLLER_EVENTS 64
+
+// the channel pipes in a port's folder, as laid out by BlueAXI4UnixBridges
+#define AXI_POLLER_R_CHAN "r"
+#define AXI_POLLER_B_CHAN "b"
+
+typedef struct {
+  axi_sim_port_t* simport;
+  bool is_b;
+  int fd;
+} axi_poll_src_t;
+
+typedef struct axi_poller {
+  int epfd;
+  int stopfd;            // eventfd waking the poller up to stop
+  int lostfd;            // eventfd told about hung up ports, or -1
+  pthread_t thread;
+  pthread_mutex_t lock;  // held while handling events, and to remove ports
+  int n_srcs;
+  axi_poll_src_t* srcs;  // two per port, never reallocated, closed when -1
+  atomic_ulong n_wakeups;
+  atomic_ulong n_flits;
+} axi_poller_t;
+
+// open a watch descriptor on a channel pipe of a port
+static int axi_poller_open_chan (const axi_sim_port_t* simport, const char* chan) {
+  char path[strlen (simport->path) + strlen (chan) + 2];
+  sprintf (path, "%s/%s", simport->path, chan);
+  struct stat st;
+  if (stat (path, &st) < 0 || !S_ISFIFO (st.st_mode)) return -1;
+  return open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+// bytes waiting in a channel pipe
+static int axi_poller_pending (int fd) {
+  int n = 0;
+  if (ioctl (fd, FIONREAD, &n) < 0) return 0;
+  return n;
+}
+
+// Receive all the flits waiting on a channel. The bridge writes each flit
+// with a single write of less than PIPE_BUF bytes, so pending bytes always
+// hold whole flits.
+static int axi_poller_drain (axi_poll_src_t* src) {
+  axi_sim_port_t* simport = src->simport;
+  int n = 0;
+  while (axi_poller_pending (src->fd) > 0) {
+    if (src->is_b) {
+      t_axi4_bflit* bflit = simport->engine.flits.b;
+      bub_fifo_ConsumeElement (simport->fifo->b, (void*) bflit);
+      axi_receive_bflit (simport, bflit);
+    } else {
+      t_axi4_rflit* rflit = simport->engine.flits.r;
+      bub_fifo_ConsumeElement (simport->fifo->r, (void*) rflit);
+      axi_receive_rflit (simport, rflit);
+    }
+    n++;
+  }
+  return n;
+}
+
+static void* axi_poller_thread (void* arg) {
+  axi_poller_t* poller = (axi_poller_t*) arg;
+  struct epoll_event events[AXI_POLLER_EVENTS];
+  for (;;) {
+    int n = epoll_wait (poller->epfd, events, AXI_POLLER_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror ("axi poller epoll_wait");
+      break;
+    }
+    atomic_fetch_add (&poller->n_wakeups, 1);
+    pthread_mutex_lock (&poller->lock);
+    for (int i = 0; i < n; i++) {
+      axi_poll_src_t* src = (axi_poll_src_t*) events[i].data.ptr;
+      if (!src) {
+        pthread_mutex_unlock (&poller->lock);
+        return NULL;
+      }
+      // the port may have been removed since the event
+      if (src->fd < 0) continue;
+      atomic_fetch_add (&poller->n_flits, axi_poller_drain (src));
+      // a simulator closing its end leaves the pipe permanently readable, and
+      // has its port disconnected
+      if (   (events[i].events & EPOLLHUP)
+          && axi_poller_pending (src->fd) == 0 ) {
+        fprintf ( stderr, "%s -- simulator closed the %s channel\n"
+                , src->simport->name, src->is_b ? "B" : "R" );
+        epoll_ctl (poller->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+        atomic_store (&src->simport->lost, true);
+        uint64_t one = 1;
+        if (   poller->lostfd >= 0
+            && write (poller->lostfd, &one, sizeof (one)) < 0 )
+          perror ("axi poller lost port");
+      }
+    }
+    pthread_mutex_unlock (&poller->lock);
+  }
+  return NULL;
+}
+
+// Poller setup
+////////////////////////////////////////////////////////////////////////////////
+
+static axi_poller_t* axi_poller_create (int n_ports) {
+  axi_poller_t* poller = malloc (sizeof (axi_poller_t));
+  poller->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  poller->stopfd = eventfd (0, EFD_CLOEXEC);
+  if (poller->epfd < 0 || poller->stopfd < 0) {
+    perror ("axi poller setup");
+    exit (EXIT_FAILURE);
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl (poller->epfd, EPOLL_CTL_ADD, poller->stopfd, &ev);
+  poller->lostfd = -1;
+  pthread_mutex_init (&poller->lock, NULL);
+  poller->n_srcs = 2 * n_ports;
+  poller->srcs = malloc (poller->n_srcs * sizeof (axi_poll_src_t));
+  for (int i = 0; i < poller->n_srcs; i++)
+    poller->srcs[i] = (axi_poll_src_t) { .simport = NULL, .fd = -1 };
+  atomic_init (&poller->n_wakeups, 0);
+  atomic_init (&poller->n_flits, 0);
+  return poller;
+}
+
+// Have the poller receive the responses of a connected port. Returns false if
+// the port's channel pipes cannot be watched.
+static bool axi_poller_add (axi_poller_t* poller, axi_sim_port_t* simport) {
+  pthread_mutex_lock (&poller->lock);
+  int slot = 0;
+  while (slot < poller->n_srcs && poller->srcs[slot].simport) slot += 2;
+  if (slot == poller->n_srcs) {
+    pthread_mutex_unlock (&poller->lock);
+    return false;
+  }
+  int rfd = axi_poller_open_chan (simport, AXI_POLLER_R_CHAN);
+  int bfd = axi_poller_open_chan (simport, AXI_POLLER_B_CHAN);
+  axi_poll_src_t* r = &poller->srcs[slot];
+  axi_poll_src_t* b = &poller->srcs[slot + 1];
+  *r = (axi_poll_src_t) { .simport = simport, .is_b = false, .fd = rfd };
+  *b = (axi_poll_src_t) { .simport = simport, .is_b = true, .fd = bfd };
+  struct epoll_event rev = { .events = EPOLLIN, .data.ptr = r };
+  struct epoll_event bev = { .events = EPOLLIN, .data.ptr = b };
+  if (   rfd < 0 || bfd < 0
+      || epoll_ctl (poller->epfd, EPOLL_CTL_ADD, rfd, &rev) < 0
+      || epoll_ctl (poller->epfd, EPOLL_CTL_ADD, bfd, &bev) < 0 ) {
+    if (rfd >= 0) {
+      epoll_ctl (poller->epfd, EPOLL_CTL_DEL, rfd, NULL);
+      close (rfd);
+    }
+    if (bfd >= 0) close (bfd);
+    r->simport = b->simport = NULL;
+    r->fd = b->fd = -1;
+    pthread_mutex_unlock (&poller->lock);
+    return false;
+  }
+  pthread_mutex_unlock (&poller->lock);
+  return true;
+}
+
+// stop receiving the responses of a port, which is being disconnected
+static void axi_poller_remove (axi_poller_t* poller, axi_sim_port_t* simport) {
+  pthread_mutex_lock (&poller->lock);
+  for (int i = 0; i < poller->n_srcs; i++) {
+    axi_poll_src_t* src = &poller->srcs[i];
+    if (src->simport != simport) continue;
+    epoll_ctl (poller->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    close (src->fd);
+    src->fd = -1;
+    src->simport = NULL;
+  }
+  pthread_mutex_unlock (&poller->lock);
+}
+
+static void axi_poller_start (axi_poller_t* poller) {
+  pthread_create (&poller->thread, NULL, axi_poller_thread, poller);
+}
+
+// Stop the poller and close its descriptors. The ports must have been removed
+// or not have any transaction in flight anymore.
+static void axi_poller_destroy (axi_poller_t* poller) {
+  uint64_t one = 1;
+  if (write (poller->stopfd, &one, sizeof (one)) < 0) perror ("axi poller stop");
+  pthread_join (poller->thread, NULL);
+  printf ( "axi poller -- %lu flits in %lu wakeups\n"
+         , atomic_load (&poller->n_flits)
+         , atomic_load (&poller->n_wakeups) );
+  for (int i = 0; i < poller->n_srcs; i++)
+    if (poller->srcs[i].fd >= 0) close (poller->srcs[i].fd);
+  pthread_mutex_destroy (&poller->lock);
+  close (poller->stopfd);
+  close (poller->epfd);
+  free (poller->srcs);
+  free (poller);
+}
+
+#endif
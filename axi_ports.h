@@ -0,0 +1,311 @@
+#ifndef AXI_PORTS_H
+#define AXI_PORTS_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <mem_mapped_dev.h>
+#include <BlueUnixBridges.h>
+#include <BlueAXI4UnixBridges.h>
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <H2F_LW.h>
+#include <H2F.h>
+#include <axi_engine.h>
+#include <axi_poller.h>
+#include <shm_ring.h>
+
+// AXI4 port implementations
+////////////////////////////////////////////////////////////////////////////////
+// The flit helpers are specialized for a given ID, address and data width.
+// Besides the CHERI-BGAS H2F LW and H2F ports, the common port configurations
+// are instantiated here, and the ports of a device map pick theirs by width.
+
+#define AXI_PORT_PFX(id, addr, data) axi_##id##_##addr##_##data
+#define AXI_PORT_FNS(id, addr, data) axi_##id##_##addr##_##data##_fns
+
+#define _DEF_AXI_PORT(id, addr, data, pfx, fns) \
+  DEF_AXI4_API (id, addr, data, 0, 0, 0, 0, 0, pfx) \
+  static const axi_port_fns_t fns = \
+  { .id_width = id \
+  , .addr_width = addr \
+  , .data_width_bytes = data / 8 \
+  , .aw_create_flit = &AXI4_AW_(id, addr, 0, pfx, create_flit) \
+  , .w_create_flit  = &AXI4_W_(data, 0, pfx, create_flit) \
+  , .b_create_flit  = &AXI4_B_(id, 0, pfx, create_flit) \
+  , .ar_create_flit = &AXI4_AR_(id, addr, 0, pfx, create_flit) \
+  , .r_create_flit  = &AXI4_R_(id, data, 0, pfx, create_flit) \
+  , .aw_fprint_flit = &AXI4_AW_(id, addr, 0, pfx, fprint_flit) \
+  , .w_fprint_flit  = &AXI4_W_(data, 0, pfx, fprint_flit) \
+  , .b_fprint_flit  = &AXI4_B_(id, 0, pfx, fprint_flit) \
+  , .ar_fprint_flit = &AXI4_AR_(id, addr, 0, pfx, fprint_flit) \
+  , .r_fprint_flit  = &AXI4_R_(id, data, 0, pfx, fprint_flit) \
+  , .fifo_OpenAsSlave  = &AXI4_(id, addr, data, 0, 0, 0, 0, 0, pfx, fifo_OpenAsSlave) \
+  , .fifo_OpenAsMaster = &AXI4_(id, addr, data, 0, 0, 0, 0, 0, pfx, fifo_OpenAsMaster) \
+  };
+#define DEF_AXI_PORT(id, addr, data) \
+  _DEF_AXI_PORT ( id, addr, data \
+                , AXI_PORT_PFX (id, addr, data) \
+                , AXI_PORT_FNS (id, addr, data) )
+
+// instantiated configurations (ID width, address width, data width)
+#define AXI_PORT_CONFIGS(X) \
+  X (0, 32,  32) X (0, 32,  64) X (0, 32, 128) X (0, 32, 256) X (0, 32, 512) \
+  X (0, 64,  32) X (0, 64,  64) X (0, 64, 128) X (0, 64, 256) X (0, 64, 512) \
+  X (4, 32,  32) X (4, 32,  64) X (4, 32, 128) X (4, 32, 256) X (4, 32, 512) \
+  X (4, 64,  32) X (4, 64,  64) X (4, 64, 128) X (4, 64, 256) X (4, 64, 512)
+
+AXI_PORT_CONFIGS (DEF_AXI_PORT)
+
+#define AXI_PORT_FNS_REF(id, addr, data) &AXI_PORT_FNS (id, addr, data),
+static const axi_port_fns_t* const axi_port_impls[] =
+{ &h2f_lw_fns
+, &h2f_fns
+, AXI_PORT_CONFIGS (AXI_PORT_FNS_REF)
+};
+
+// find the implementation of a port configuration, or NULL
+static const axi_port_fns_t* axi_port_impl_find ( int id_width
+                                                , int addr_width
+                                                , int data_width ) {
+  for (size_t i = 0; i < sizeof (axi_port_impls) / sizeof (axi_port_impls[0]); i++)
+    if (   axi_port_impls[i]->id_width == id_width
+        && axi_port_impls[i]->addr_width == addr_width
+        && axi_port_impls[i]->data_width_bytes * 8 == data_width )
+      return axi_port_impls[i];
+  return NULL;
+}
+
+// print the supported port configurations
+static void axi_port_impls_print (FILE* f) {
+  for (size_t i = 0; i < sizeof (axi_port_impls) / sizeof (axi_port_impls[0]); i++)
+    fprintf ( f, "  id-width %d, addr-width %d, data-width %d\n"
+            , axi_port_impls[i]->id_width, axi_port_impls[i]->addr_width
+            , axi_port_impls[i]->data_width_bytes * 8 );
+}
+
+// Simulator ports
+////////////////////////////////////////////////////////////////////////////////
+
+// Set a port of the simulator ports folder up (the port's folder is named
+// after the port), and start its transaction engine. The port is connected to
+// the simulator on first use (see axi_sim_port_connect). The ports of a node
+// other than the root one are named after their node too.
+static axi_sim_port_t* axi_sim_port_init ( const char* name
+                                         , const char* node
+                                         , const axi_port_fns_t* fns
+                                         , const mem_mapped_dev_t devs[]
+                                         , int ndevs
+                                         , const char* portpath
+                                         , const char* logpath ) {
+  axi_sim_port_t* axi_sim_port = malloc (sizeof (axi_sim_port_t));
+  axi_sim_port->name = malloc ((node ? strlen (node) + 1 : 0) + strlen (name) + 1);
+  if (node) sprintf (axi_sim_port->name, "%s/%s", node, name);
+  else strcpy (axi_sim_port->name, name);
+  if (devfs_log_level >= DEVFS_LOG_TEXT) devs_print (devs, ndevs);
+  char* path = (char*) malloc (strlen (portpath) + strlen (name) + 2);
+  sprintf (path, "%s/%s", portpath, name);
+  axi_sim_port->path = path;
+  pthread_mutex_init (&axi_sim_port->link_lock, NULL);
+  atomic_init (&axi_sim_port->link, AXI_LINK_IDLE);
+  atomic_init (&axi_sim_port->lost, false);
+  atomic_init (&axi_sim_port->connections, 0);
+  axi_sim_port->fifo = NULL;
+  axi_sim_port->shm = NULL;
+  for (int i = 0; i < AXI_REQ_CHANS; i++) axi_sim_port->req_fds[i] = -1;
+  axi_sim_port->poller = NULL;
+  axi_sim_port->fns = fns;
+  axi_sim_port->timeout_ns = 0;
+  // logstream, text log or binary trace
+  axi_sim_port->logfile = NULL;
+  axi_sim_port->cache = NULL;
+  axi_sim_port->devs = NULL;
+  if (logpath && (axi_sim_port->logfile = fopen (logpath, "w")) == NULL) {
+    fprintf(stderr, "Failed fopen(\"%s\", \"w\"): ", logpath);
+    perror(NULL);
+    exit (EXIT_FAILURE);
+  }
+  axi_sim_port->trace_port =
+    trace_port ( axi_sim_port->name, fns->id_width, fns->addr_width
+               , fns->data_width_bytes );
+  // start the transaction engine
+  axi_engine_init (axi_sim_port, 1 << fns->id_width);
+  return axi_sim_port;
+}
+
+// The node a devfs path is in, with the rest of the path after the node's
+// folder ("" for the folder itself), or NULL. When a single simulator is
+// served, its node is the root folder.
+static const sim_node_t* sim_node_find ( const sim_ports_t* simports
+                                       , const char* path
+                                       , const char** rest ) {
+  if (simports->n_nodes == 1 && !simports->nodes[0].name) {
+    *rest = path;
+    return &simports->nodes[0];
+  }
+  if (path[0] != '/') return NULL;
+  for (int i = 0; i < simports->n_nodes; i++) {
+    size_t len = strlen (simports->nodes[i].name);
+    if (   strncmp (path + 1, simports->nodes[i].name, len) == 0
+        && (path[len + 1] == '\0' || path[len + 1] == '/') ) {
+      *rest = path + len + 1;
+      return &simports->nodes[i];
+    }
+  }
+  return NULL;
+}
+
+// Port connections
+////////////////////////////////////////////////////////////////////////////////
+// A port connects to its simulator on first use, once its folder exists. When
+// the simulator goes away (see port_watch.h), the port is disconnected: the
+// transactions in flight fail with ENOTCONN, as do the later ones until the
+// simulator comes back and the port is reconnected. The port's link lock is
+// held across these transitions.
+
+// Open the shared memory rings of a port, or else its fifos, and start
+// receiving its responses. Returns false if the port's folder is missing or
+// its transport cannot be opened.
+static bool axi_sim_port_attach (axi_sim_port_t* simport) {
+  if (access (simport->path, F_OK) != 0) return false;
+  if ((simport->shm = shm_port_open (simport->path, simport->fns))) {
+    printf ("%s -- using shared memory rings\n", simport->name);
+    simport->shm->abort = &simport->engine.issue_cancel;
+  } else if (!(simport->fifo = simport->fns->fifo_OpenAsSlave (simport->path)))
+    return false;
+  else axi_req_watch_open (simport);
+  // (shared memory ports sleep on their rings' doorbells instead)
+  if (simport->shm) axi_engine_start_rb_threads (simport);
+  else if (!simport->poller || !axi_poller_add (simport->poller, simport)) {
+    if (simport->poller)
+      printf ( "%s -- channel pipes not found, using response threads\n"
+             , simport->name );
+    axi_engine_start_rb_threads (simport);
+  }
+  atomic_store (&simport->lost, false);
+  atomic_store (&simport->engine.torn, false);
+  atomic_fetch_add (&simport->connections, 1);
+  atomic_store (&simport->link, AXI_LINK_UP);
+  printf ("%s -- connected\n", simport->name);
+  return true;
+}
+
+// Stop receiving the responses of a port and close its transport, once the
+// request thread is done with it, failing the transactions in flight. The
+// request thread gives up the flits it waits to send first, so that a
+// simulator which stopped taking them does not hold the disconnection up.
+static void axi_sim_port_detach (axi_sim_port_t* simport) {
+  axi_engine_t* engine = &simport->engine;
+  atomic_store (&simport->link, AXI_LINK_DOWN);
+  // wake up the threads sleeping on the rings, including the request thread,
+  // and the request thread waiting for room in a pipe
+  if (simport->shm) shm_port_stop (simport->shm);
+  axi_engine_kick (engine);
+  if (engine->rb_threads) axi_engine_stop_rb_threads (simport);
+  else if (simport->poller) axi_poller_remove (simport->poller, simport);
+  pthread_mutex_lock (&engine->tx_lock);
+  if (simport->shm) shm_port_close (simport->shm);
+  else {
+    axi_req_watch_close (simport);
+    baub_fifo_Close (simport->fifo);
+  }
+  simport->shm = NULL;
+  simport->fifo = NULL;
+  pthread_mutex_unlock (&engine->tx_lock);
+  axi_fail_inflight (simport, -ENOTCONN);
+}
+
+// Connect a port on first use. Returns -ENOTCONN if its simulator is not
+// there, or went away and has not come back yet.
+static int axi_sim_port_connect (axi_sim_port_t* simport) {
+  if (atomic_load (&simport->link) == AXI_LINK_UP) return 0;
+  pthread_mutex_lock (&simport->link_lock);
+  if (atomic_load (&simport->link) == AXI_LINK_IDLE)
+    axi_sim_port_attach (simport);
+  int ret = (atomic_load (&simport->link) == AXI_LINK_UP) ? 0 : -ENOTCONN;
+  pthread_mutex_unlock (&simport->link_lock);
+  return ret;
+}
+
+// the transports a disconnection applies to
+typedef enum { AXI_VIA_ANY, AXI_VIA_FIFO, AXI_VIA_SHM } axi_via_t;
+
+// Disconnect a port whose simulator went away, if it is connected through the
+// given transport. Returns whether it was disconnected.
+static bool axi_sim_port_disconnect ( axi_sim_port_t* simport
+                                    , axi_via_t via
+                                    , const char* why ) {
+  pthread_mutex_lock (&simport->link_lock);
+  bool up = atomic_load (&simport->link) == AXI_LINK_UP;
+  bool disconnect =
+    up && (via == AXI_VIA_ANY || (via == AXI_VIA_SHM) == (simport->shm != NULL));
+  if (disconnect) {
+    printf ("%s -- disconnected (%s)\n", simport->name, why);
+    axi_sim_port_detach (simport);
+  }
+  pthread_mutex_unlock (&simport->link_lock);
+  return disconnect;
+}
+
+// reconnect a port which was disconnected, once its simulator is back
+static void axi_sim_port_reconnect (axi_sim_port_t* simport) {
+  pthread_mutex_lock (&simport->link_lock);
+  if (atomic_load (&simport->link) == AXI_LINK_DOWN)
+    axi_sim_port_attach (simport);
+  pthread_mutex_unlock (&simport->link_lock);
+}
+
+static void axi_sim_port_destroy (axi_sim_port_t* axi_sim_port) {
+  axi_drain_posted (axi_sim_port);
+  if (atomic_load (&axi_sim_port->link) == AXI_LINK_UP)
+    axi_sim_port_detach (axi_sim_port);
+  axi_engine_destroy (axi_sim_port);
+  if (axi_sim_port->logfile) fclose (axi_sim_port->logfile);
+  pthread_mutex_destroy (&axi_sim_port->link_lock);
+  free (axi_sim_port->path);
+  free (axi_sim_port->name);
+  free (axi_sim_port);
+}
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef DEV_POLL_H
+#define DEV_POLL_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <fuse.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <dev_registry.h>
+#include <axi_engine.h>
+
+// Readiness of the device files for poll
+////////////////////////////////////////////////////////////////////////////////
+// A device with a status register (see devmap.h) is ready for reading while
+// any of the register's masked bits is set, so that clients can sleep in
+// poll / epoll until an interrupt is pending or a FIFO holds data, instead of
+// spinning on fmem reads. A poll of a device which is not ready leaves its
+// poll handle with the device, and a single background thread then reads the
+// status registers of the devices with waiters, every poll period, notifying
+// and dropping all the handles of a device once it is ready. The thread sleeps
+// while nobody waits, and is also woken up for an early check when the
+// simulated system writes to the host through its F2H port, which it may use
+// as an interrupt side channel. Devices without a status register are always
+// ready, like regular files.
+
+#define DEV_POLL_MAX_WAITERS 64 // per file, the oldest being woken up past it
+
+#define DEV_POLL_ALWAYS (POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM)
+
+// The poll handles of the clients waiting for a file to be ready
+typedef struct {
+  struct fuse_pollhandle* handles[DEV_POLL_MAX_WAITERS];
+  int n;
+} poll_waiters_t;
+
+// wake up and drop all the waiters of a file
+static void poll_waiters_wake (poll_waiters_t* w) {
+  for (int i = 0; i < w->n; i++) {
+    fuse_notify_poll (w->handles[i]);
+    fuse_pollhandle_destroy (w->handles[i]);
+  }
+  w->n = 0;
+}
+
+// keep the handle of a waiter. The high-level FUSE API does not tell which
+// file a handle polls, so the handles of the files which stopped polling are
+// only dropped by waking up the oldest handle when there are too many (a file
+// still polling then polls again).
+static void poll_waiters_add (poll_waiters_t* w, struct fuse_pollhandle* ph) {
+  if (w->n == DEV_POLL_MAX_WAITERS) {
+    fuse_notify_poll (w->handles[0]);
+    fuse_pollhandle_destroy (w->handles[0]);
+    memmove (&w->handles[0], &w->handles[1], (--w->n) * sizeof (w->handles[0]));
+  }
+  w->handles[w->n++] = ph;
+}
+
+static void poll_waiters_drop (poll_waiters_t* w) {
+  for (int i = 0; i < w->n; i++) fuse_pollhandle_destroy (w->handles[i]);
+  w->n = 0;
+}
+
+typedef struct dev_poll {
+  dev_entry_t* entry;
+  uint64_t addr; // of the 4-byte status register
+  uint32_t mask; // of its bits signaling the device is ready
+  poll_waiters_t waiters;
+} dev_poll_t;
+
+typedef struct dev_poller {
+  int n_polls;
+  dev_poll_t* polls;
+  uint64_t period_ns;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+  bool kicked;          // check the status registers without waiting
+  atomic_int n_waiting; // devices with waiters
+  atomic_ulong checks;  // status register reads
+  atomic_ulong wakeups; // devices found ready with waiters
+} dev_poller_t;
+
+// read the status register of a device, once the posted writes before it
+// landed (e.g. acknowledging the event)
+static int dev_poll_status (dev_poller_t* dp, dev_poll_t* p, uint32_t* status) {
+  *status = 0;
+  axi_drain_posted (p->entry->simport);
+  atomic_fetch_add (&dp->checks, 1);
+  return axi_read (p->entry->simport, p->addr, (uint8_t*) status, 4);
+}
+
+// wake up and drop all the waiters of a device (with the poller locked)
+static void dev_poll_notify (dev_poller_t* dp, dev_poll_t* p) {
+  if (p->waiters.n == 0) return;
+  poll_waiters_wake (&p->waiters);
+  atomic_fetch_sub (&dp->n_waiting, 1);
+  atomic_fetch_add (&dp->wakeups, 1);
+}
+
+static void* dev_poller_thread (void* arg) {
+  dev_poller_t* dp = (dev_poller_t*) arg;
+  pthread_mutex_lock (&dp->lock);
+  while (!dp->stop) {
+    if (atomic_load (&dp->n_waiting) == 0 && !dp->kicked)
+      pthread_cond_wait (&dp->cond, &dp->lock);
+    else if (!dp->kicked) {
+      struct timespec deadline;
+      clock_gettime (CLOCK_MONOTONIC, &deadline);
+      uint64_t ns = deadline.tv_nsec + dp->period_ns;
+      deadline.tv_sec += ns / 1000000000;
+      deadline.tv_nsec = ns % 1000000000;
+      pthread_cond_timedwait (&dp->cond, &dp->lock, &deadline);
+    }
+    if (dp->stop) break;
+    dp->kicked = false;
+    // the registers are read unlocked, the devices gaining waiters meanwhile
+    // being checked by their own poll
+    for (int i = 0; i < dp->n_polls; i++) {
+      dev_poll_t* p = &dp->polls[i];
+      if (p->waiters.n == 0) continue;
+      pthread_mutex_unlock (&dp->lock);
+      uint32_t status;
+      int ret = dev_poll_status (dp, p, &status);
+      pthread_mutex_lock (&dp->lock);
+      if (ret < 0 || (status & p->mask)) dev_poll_notify (dp, p);
+    }
+  }
+  pthread_mutex_unlock (&dp->lock);
+  return NULL;
+}
+
+// Poller interface
+////////////////////////////////////////////////////////////////////////////////
+
+// watch the status registers of the registered devices which have one, every
+// period_ms milliseconds while they have waiters
+static dev_poller_t* dev_poller_create (dev_registry_t* devs, int period_ms) {
+  dev_poller_t* dp = calloc (1, sizeof (dev_poller_t));
+  for (int i = 0; i < devs->n_entries; i++)
+    if (devs->entries[i].dev->has_poll_reg) dp->n_polls++;
+  dp->polls = calloc (dp->n_polls ? dp->n_polls : 1, sizeof (dev_poll_t));
+  if (!dp->polls) {
+    fprintf (stderr, "Failed to allocate the device poller\n");
+    exit (EXIT_FAILURE);
+  }
+  for (int i = 0, j = 0; i < devs->n_entries; i++) {
+    dev_entry_t* e = &devs->entries[i];
+    if (!e->dev->has_poll_reg) continue;
+    dev_poll_t* p = &dp->polls[j++];
+    p->entry = e;
+    p->addr = e->dev->base_addr + e->dev->poll_offset;
+    p->mask = e->dev->poll_mask;
+    e->poll = p;
+  }
+  dp->period_ns = (period_ms > 0 ? period_ms : 1) * 1000000ull;
+  pthread_mutex_init (&dp->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&dp->cond, &attr);
+  pthread_condattr_destroy (&attr);
+  atomic_init (&dp->n_waiting, 0);
+  atomic_init (&dp->checks, 0);
+  atomic_init (&dp->wakeups, 0);
+  if (dp->n_polls > 0) pthread_create (&dp->thread, NULL, dev_poller_thread, dp);
+  return dp;
+}
+
+// the poll of a device file, keeping its poll handle, if any, until the device
+// is ready
+static int dev_poller_poll ( dev_poller_t* dp
+                           , dev_entry_t* entry
+                           , struct fuse_pollhandle* ph
+                           , unsigned* reventsp ) {
+  dev_poll_t* p = entry->poll;
+  if (!p) {
+    if (ph) fuse_pollhandle_destroy (ph);
+    *reventsp = DEV_POLL_ALWAYS;
+    return 0;
+  }
+  uint32_t status;
+  int ret = dev_poll_status (dp, p, &status);
+  // writes never wait
+  *reventsp = POLLOUT | POLLWRNORM;
+  if (ret < 0) *reventsp |= POLLERR;
+  else if (status & p->mask) *reventsp |= POLLIN | POLLRDNORM | POLLPRI;
+  if (!ph) return 0;
+  if (*reventsp & (POLLIN | POLLERR)) {
+    fuse_pollhandle_destroy (ph);
+    return 0;
+  }
+  pthread_mutex_lock (&dp->lock);
+  poll_waiters_add (&p->waiters, ph);
+  if (p->waiters.n == 1 && atomic_fetch_add (&dp->n_waiting, 1) == 0)
+    pthread_cond_signal (&dp->cond);
+  pthread_mutex_unlock (&dp->lock);
+  return 0;
+}
+
+// check the status registers of the devices with waiters now (any thread)
+static void dev_poller_kick (void* arg) {
+  dev_poller_t* dp = (dev_poller_t*) arg;
+  if (atomic_load (&dp->n_waiting) == 0) return;
+  pthread_mutex_lock (&dp->lock);
+  dp->kicked = true;
+  pthread_cond_signal (&dp->cond);
+  pthread_mutex_unlock (&dp->lock);
+}
+
+static void dev_poller_destroy (dev_poller_t* dp) {
+  if (dp->n_polls > 0) {
+    pthread_mutex_lock (&dp->lock);
+    dp->stop = true;
+    pthread_cond_signal (&dp->cond);
+    pthread_mutex_unlock (&dp->lock);
+    pthread_join (dp->thread, NULL);
+    printf ( "device poller -- %lu status reads, %lu wakeups\n"
+           , atomic_load (&dp->checks), atomic_load (&dp->wakeups) );
+  }
+  for (int i = 0; i < dp->n_polls; i++) {
+    poll_waiters_drop (&dp->polls[i].waiters);
+    dp->polls[i].entry->poll = NULL;
+  }
+  pthread_cond_destroy (&dp->cond);
+  pthread_mutex_destroy (&dp->lock);
+  free (dp->polls);
+  free (dp);
+}
+
+#endif
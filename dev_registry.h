@@ -0,0 +1,228 @@
+#ifndef DEV_REGISTRY_H
+#define DEV_REGISTRY_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <mem_mapped_dev.h>
+
+// Registry of all the devices of all the simulator ports
+////////////////////////////////////////////////////////////////////////////////
+// Built once at init time, it offers O(1) lookup from a device path through an
+// open addressing hash table, and lookup from a port address through an
+// interval tree per port, laid out over the port's devices sorted by base
+// address (the nodes of a multi-node devfs share their addresses).
+
+// A device together with the simulator port to reach it
+typedef struct {
+  const mem_mapped_dev_t* dev;
+  axi_sim_port_t* simport;
+  const char* node; // the node of the device, or NULL at the root
+  char* name;       // the device's path in the devfs, without the leading '/'
+  uint64_t timeout_ns; // of the device's transactions, or 0 for none
+  struct read_cache* rcache; // of the device's registers, or NULL
+  struct dev_poll* poll;     // watch of its status register, or NULL
+  dev_stats_t stats;
+} dev_entry_t;
+
+typedef struct dev_registry {
+  int n_entries;
+  dev_entry_t* entries;  // in registration order
+  // name index
+  dev_entry_t** buckets;
+  uint32_t bucket_mask;
+  // address index, implicit balanced trees over the entries of each port
+  // sorted by base address, in which each node also holds the highest end
+  // address of its subtree
+  dev_entry_t** by_addr;
+  uint64_t* max_end;
+} dev_registry_t;
+
+static uint32_t dev_name_hash (const char* name) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (; *name; name++) h = (h ^ (uint8_t) *name) * 16777619u;
+  return h;
+}
+
+static uint64_t dev_end (const dev_entry_t* e) {
+  return e->dev->base_addr + e->dev->range;
+}
+
+// order the entries by port, then by base address
+static int dev_cmp_base (const void* a, const void* b) {
+  const dev_entry_t* ea = *(dev_entry_t* const*) a;
+  const dev_entry_t* eb = *(dev_entry_t* const*) b;
+  if (ea->simport != eb->simport)
+    return ((uintptr_t) ea->simport > (uintptr_t) eb->simport) ? 1 : -1;
+  uint64_t x = ea->dev->base_addr;
+  uint64_t y = eb->dev->base_addr;
+  return (x > y) - (x < y);
+}
+
+// compute the max_end of the subtree rooted in the middle of [lo, hi)
+static uint64_t dev_itree_build (dev_registry_t* reg, int lo, int hi) {
+  if (lo >= hi) return 0;
+  int mid = lo + (hi - lo) / 2;
+  uint64_t end = dev_end (reg->by_addr[mid]);
+  uint64_t l = dev_itree_build (reg, lo, mid);
+  uint64_t r = dev_itree_build (reg, mid + 1, hi);
+  if (l > end) end = l;
+  if (r > end) end = r;
+  return reg->max_end[mid] = end;
+}
+
+static const dev_entry_t* dev_itree_find ( const dev_registry_t* reg
+                                         , int lo, int hi
+                                         , uint64_t addr ) {
+  if (lo >= hi) return NULL;
+  int mid = lo + (hi - lo) / 2;
+  if (addr >= reg->max_end[mid]) return NULL; // nothing in this subtree
+  const dev_entry_t* e = dev_itree_find (reg, lo, mid, addr);
+  if (e) return e;
+  e = reg->by_addr[mid];
+  if (addr < e->dev->base_addr) return NULL; // nor further right
+  if (addr < dev_end (e)) return e;
+  return dev_itree_find (reg, mid + 1, hi, addr);
+}
+
+// the first entry of by_addr whose port is at or after a port address
+static int dev_port_lower_bound (const dev_registry_t* reg, uintptr_t simport) {
+  int lo = 0, hi = reg->n_entries;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if ((uintptr_t) reg->by_addr[mid]->simport < simport) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Registry interface
+////////////////////////////////////////////////////////////////////////////////
+
+static dev_registry_t* dev_registry_create () {
+  dev_registry_t* reg = calloc (1, sizeof (dev_registry_t));
+  return reg;
+}
+
+// register the devices reached through a simulator port of a node (NULL for
+// the root node), the devices without a timeout of their own taking the port's
+static void dev_registry_add ( dev_registry_t* reg
+                             , const mem_mapped_dev_t devs[]
+                             , int ndevs
+                             , axi_sim_port_t* simport
+                             , const char* node ) {
+  reg->entries =
+    realloc (reg->entries, (reg->n_entries + ndevs) * sizeof (dev_entry_t));
+  for (int i = 0; i < ndevs; i++) {
+    char* name = malloc ((node ? strlen (node) + 1 : 0) + strlen (devs[i].name) + 1);
+    if (node) sprintf (name, "%s/%s", node, devs[i].name);
+    else strcpy (name, devs[i].name);
+    reg->entries[reg->n_entries++] =
+      (dev_entry_t) { .dev = &devs[i], .simport = simport
+                    , .node = node, .name = name
+                    , .timeout_ns = devs[i].timeout_ms
+                                  ? devs[i].timeout_ms * 1000000ull
+                                  : simport->timeout_ns };
+  }
+}
+
+// build the indices once all the devices are registered
+static void dev_registry_build (dev_registry_t* reg) {
+  int n = reg->n_entries;
+  uint32_t n_buckets = 1;
+  while (n_buckets < 2 * (uint32_t) n) n_buckets <<= 1;
+  reg->buckets = calloc (n_buckets, sizeof (dev_entry_t*));
+  reg->bucket_mask = n_buckets - 1;
+  reg->by_addr = malloc (n * sizeof (dev_entry_t*));
+  reg->max_end = malloc (n * sizeof (uint64_t));
+  for (int i = 0; i < n; i++) {
+    dev_entry_t* e = &reg->entries[i];
+    uint32_t h = dev_name_hash (e->name) & reg->bucket_mask;
+    while (reg->buckets[h]) {
+      if (strcmp (reg->buckets[h]->name, e->name) == 0) {
+        fprintf (stderr, "duplicate device name \"%s\"\n", e->name);
+        exit (EXIT_FAILURE);
+      }
+      h = (h + 1) & reg->bucket_mask;
+    }
+    reg->buckets[h] = e;
+    reg->by_addr[i] = e;
+  }
+  qsort (reg->by_addr, n, sizeof (dev_entry_t*), dev_cmp_base);
+  for (int lo = 0, hi; lo < n; lo = hi) {
+    for (hi = lo + 1; hi < n && reg->by_addr[hi]->simport == reg->by_addr[lo]->simport; hi++);
+    dev_itree_build (reg, lo, hi);
+  }
+}
+
+// lookup a device from its path in the devfs
+static dev_entry_t* dev_registry_find ( const dev_registry_t* reg
+                                      , const char* path ) {
+  const char* name = path + 1;
+  uint32_t h = dev_name_hash (name) & reg->bucket_mask;
+  for (; reg->buckets[h]; h = (h + 1) & reg->bucket_mask)
+    if (strcmp (reg->buckets[h]->name, name) == 0) return reg->buckets[h];
+  return NULL;
+}
+
+// lookup the device of a simulator port covering an address
+static const dev_entry_t* dev_registry_find_addr ( const dev_registry_t* reg
+                                                 , const axi_sim_port_t* simport
+                                                 , uint64_t addr ) {
+  int lo = dev_port_lower_bound (reg, (uintptr_t) simport);
+  int hi = dev_port_lower_bound (reg, (uintptr_t) simport + 1);
+  return dev_itree_find (reg, lo, hi, addr);
+}
+
+static void dev_registry_destroy (dev_registry_t* reg) {
+  for (int i = 0; i < reg->n_entries; i++) free (reg->entries[i].name);
+  free (reg->max_end);
+  free (reg->by_addr);
+  free (reg->buckets);
+  free (reg->entries);
+  free (reg);
+}
+
+#endif
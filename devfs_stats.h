@@ -0,0 +1,419 @@
+#ifndef DEVFS_STATS_H
+#define DEVFS_STATS_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <dev_registry.h>
+#include <axi_ports.h>
+
+// Statistics files
+////////////////////////////////////////////////////////////////////////////////
+// The read-only files of the /.stats folder of the devfs are rendered from the
+// counters and histograms the transaction engines keep when they are opened,
+// and the rendered snapshot is kept in the file handle until released. Any
+// write to the /.stats/reset file resets all the statistics. The per-device
+// files follow the devfs layout, in a folder per node when serving several.
+// The /.stats/watchdog file lists the transactions in flight on each port.
+
+#define STATS_COUNTERS STATS_DIR "/counters"
+#define STATS_METRICS STATS_DIR "/metrics"
+#define STATS_RESET STATS_DIR "/reset"
+#define STATS_WATCHDOG STATS_DIR "/watchdog"
+
+// Prometheus histogram buckets, in powers of two nanoseconds
+#define STATS_PROM_MIN_LOG2 8
+#define STATS_PROM_MAX_LOG2 34
+
+static const char* stats_stage_names[LAT_STAGES] =
+  { "queue", "produce", "response", "fuse" };
+static const char* stats_kind_names[2] = { "read", "write" };
+
+// a rendered statistics file
+typedef struct {
+  char* buf;
+  size_t len;
+} stats_snapshot_t;
+
+static bool stats_is_path (const char* path) {
+  return strncmp (path, STATS_DIR, strlen (STATS_DIR)) == 0
+      && (path[strlen (STATS_DIR)] == '\0' || path[strlen (STATS_DIR)] == '/');
+}
+
+// the device of a /.stats/<device> path, or NULL
+static dev_entry_t* stats_dev (const sim_ports_t* simports, const char* path) {
+  if (strncmp (path, STATS_DIR "/", strlen (STATS_DIR) + 1) != 0) return NULL;
+  return dev_registry_find (simports->devs, path + strlen (STATS_DIR));
+}
+
+// the node of a /.stats/<node> folder, or NULL
+static const sim_node_t* stats_node (const sim_ports_t* simports, const char* path) {
+  if (strncmp (path, STATS_DIR "/", strlen (STATS_DIR) + 1) != 0) return NULL;
+  const char* rest;
+  const sim_node_t* node = sim_node_find (simports, path + strlen (STATS_DIR), &rest);
+  return (node && node->name && *rest == '\0') ? node : NULL;
+}
+
+// the mode of a statistics entry, or 0 if there is none
+static mode_t stats_mode (const sim_ports_t* simports, const char* path) {
+  if (strcmp (path, STATS_DIR) == 0 || stats_node (simports, path))
+    return S_IFDIR | 0555;
+  if (strcmp (path, STATS_RESET) == 0) return S_IFREG | 0200;
+  if (   strcmp (path, STATS_COUNTERS) == 0 || strcmp (path, STATS_METRICS) == 0
+      || strcmp (path, STATS_WATCHDOG) == 0 || stats_dev (simports, path) )
+    return S_IFREG | 0444;
+  return 0;
+}
+
+// Counters
+////////////////////////////////////////////////////////////////////////////////
+
+static void stats_fprint_counters ( FILE* f
+                                  , const char* kind
+                                  , const char* name
+                                  , const axi_stats_t* stats ) {
+  fprintf ( f, "%-4s %-24s %12lu %12lu %14lu %14lu %8lu %8lu %8lu %9lu\n"
+          , kind, name
+          , atomic_load (&stats->reads), atomic_load (&stats->writes)
+          , atomic_load (&stats->read_bytes), atomic_load (&stats->write_bytes)
+          , atomic_load (&stats->slverr), atomic_load (&stats->decerr)
+          , atomic_load (&stats->timeouts), atomic_load (&stats->cancelled) );
+}
+
+// one line per port then one line per device
+static void stats_render_counters (FILE* f, const sim_ports_t* simports) {
+  fprintf ( f, "%-4s %-24s %12s %12s %14s %14s %8s %8s %8s %9s\n", "#", "name"
+          , "reads", "writes", "read_bytes", "write_bytes", "slverr", "decerr"
+          , "timeouts", "cancelled" );
+  for (int i = 0; i < simports->n_ports; i++)
+    stats_fprint_counters ( f, "port", simports->ports[i]->name
+                          , &simports->ports[i]->engine.stats );
+  const dev_registry_t* devs = simports->devs;
+  for (int i = 0; i < devs->n_entries; i++)
+    stats_fprint_counters ( f, "dev", devs->entries[i].name
+                          , &devs->entries[i].stats.axi );
+}
+
+// Per-device JSON
+////////////////////////////////////////////////////////////////////////////////
+
+static void stats_fprint_hist_json (FILE* f, const lat_hist_t* h) {
+  unsigned long count = atomic_load (&h->count);
+  fprintf ( f, "{\"count\": %lu, \"mean\": %lu, \"max\": %lu"
+          , count, count ? atomic_load (&h->sum) / count : 0
+          , atomic_load (&h->max) );
+  fprintf ( f, ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+               ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+          , lat_hist_quantile (h, 0.5), lat_hist_quantile (h, 0.9)
+          , lat_hist_quantile (h, 0.99), lat_hist_quantile (h, 0.999) );
+  // the non-empty buckets, as [lowest, highest, count]
+  fprintf (f, ", \"buckets\": [");
+  const char* sep = "";
+  for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+    unsigned long n = atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+    if (n == 0) continue;
+    fprintf ( f, "%s[%" PRIu64 ", %" PRIu64 ", %lu]", sep
+            , lat_hist_low (i), lat_hist_high (i), n );
+    sep = ", ";
+  }
+  fprintf (f, "]}");
+}
+
+static void stats_render_dev_json ( FILE* f
+                                  , const sim_ports_t* simports
+                                  , const dev_entry_t* entry ) {
+  const dev_stats_t* stats = &entry->stats;
+  uint64_t elapsed = lat_now () - atomic_load (&simports->stats_since);
+  double secs = elapsed / 1e9;
+  unsigned long ops[2] = { atomic_load (&stats->axi.reads)
+                         , atomic_load (&stats->axi.writes) };
+  unsigned long bytes[2] = { atomic_load (&stats->axi.read_bytes)
+                           , atomic_load (&stats->axi.write_bytes) };
+  fprintf (f, "{\n  \"device\": \"%s\",\n", entry->dev->name);
+  if (entry->node) fprintf (f, "  \"node\": \"%s\",\n", entry->node);
+  fprintf (f, "  \"port\": \"%s\",\n", entry->simport->name);
+  fprintf (f, "  \"elapsed_ns\": %" PRIu64 ",\n", elapsed);
+  fprintf (f, "  \"slverr\": %lu,\n", atomic_load (&stats->axi.slverr));
+  fprintf (f, "  \"decerr\": %lu,\n", atomic_load (&stats->axi.decerr));
+  fprintf (f, "  \"timeouts\": %lu,\n", atomic_load (&stats->axi.timeouts));
+  fprintf (f, "  \"cancelled\": %lu,\n", atomic_load (&stats->axi.cancelled));
+  fprintf (f, "  \"timeout_ns\": %" PRIu64 ",\n", entry->timeout_ns);
+  fprintf (f, "  \"cache_hits\": %lu,\n", atomic_load (&stats->cache_hits));
+  fprintf (f, "  \"cache_misses\": %lu,\n", atomic_load (&stats->cache_misses));
+  fprintf (f, "  \"stream_rx_bytes\": %lu,\n", atomic_load (&stats->stream_rx));
+  fprintf (f, "  \"stream_tx_bytes\": %lu,\n", atomic_load (&stats->stream_tx));
+  for (int k = 0; k < 2; k++) {
+    fprintf (f, "  \"%s\": {\n", stats_kind_names[k]);
+    fprintf (f, "    \"transactions\": %lu,\n", ops[k]);
+    fprintf (f, "    \"bytes\": %lu,\n", bytes[k]);
+    fprintf ( f, "    \"transactions_per_second\": %.1f,\n"
+            , secs > 0 ? ops[k] / secs : 0 );
+    fprintf ( f, "    \"bytes_per_second\": %.1f,\n"
+            , secs > 0 ? bytes[k] / secs : 0 );
+    fprintf (f, "    \"latency_ns\": {\n");
+    for (int s = 0; s < LAT_STAGES; s++) {
+      fprintf (f, "      \"%s\": ", stats_stage_names[s]);
+      stats_fprint_hist_json (f, &stats->lat[k][s]);
+      fprintf (f, "%s\n", (s < LAT_STAGES - 1) ? "," : "");
+    }
+    fprintf (f, "    }\n  }%s\n", (k == 0) ? "," : "");
+  }
+  fprintf (f, "}\n");
+}
+
+// Prometheus text format, for all the devices
+////////////////////////////////////////////////////////////////////////////////
+
+// the labels identifying a device
+static void stats_prom_labels (char* buf, size_t size, const dev_entry_t* entry) {
+  // the port's name without its node
+  const char* port = entry->simport->name + (entry->node ? strlen (entry->node) + 1 : 0);
+  int n = snprintf (buf, size, "device=\"%s\",port=\"%s\"", entry->dev->name, port);
+  if (entry->node && n >= 0 && (size_t) n < size)
+    snprintf (buf + n, size - n, ",node=\"%s\"", entry->node);
+}
+
+static void stats_fprint_prom_hist ( FILE* f
+                                   , const dev_entry_t* entry
+                                   , int kind
+                                   , int stage ) {
+  const lat_hist_t* h = &entry->stats.lat[kind][stage];
+  char dev[192], labels[256];
+  stats_prom_labels (dev, sizeof (dev), entry);
+  snprintf ( labels, sizeof (labels), "%s,dir=\"%s\",stage=\"%s\""
+           , dev, stats_kind_names[kind], stats_stage_names[stage] );
+  // cumulative counts below each power of two, which is a bucket boundary:
+  // as the latencies are whole nanoseconds and Prometheus bounds inclusive,
+  // the bound is the power of two minus one nanosecond, printed exactly
+  unsigned long cumulative = 0;
+  int i = 0;
+  for (int l = STATS_PROM_MIN_LOG2; l <= STATS_PROM_MAX_LOG2; l++) {
+    for (; i < lat_hist_index (1ull << l); i++)
+      cumulative += atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+    fprintf ( f, "devfs_latency_seconds_bucket{%s,le=\"%.12g\"} %lu\n"
+            , labels, ((1ull << l) - 1) / 1e9, cumulative );
+  }
+  for (; i < LAT_HIST_BUCKETS; i++)
+    cumulative += atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+  fprintf ( f, "devfs_latency_seconds_bucket{%s,le=\"+Inf\"} %lu\n"
+          , labels, cumulative );
+  fprintf ( f, "devfs_latency_seconds_sum{%s} %.9g\n"
+          , labels, atomic_load (&h->sum) / 1e9 );
+  fprintf (f, "devfs_latency_seconds_count{%s} %lu\n", labels, cumulative);
+}
+
+static void stats_render_metrics (FILE* f, const sim_ports_t* simports) {
+  const dev_registry_t* devs = simports->devs;
+  char labels[192];
+  fprintf (f, "# HELP devfs_transactions_total Successful AXI4 transactions.\n");
+  fprintf (f, "# TYPE devfs_transactions_total counter\n");
+  for (int i = 0; i < devs->n_entries; i++) {
+    const dev_entry_t* e = &devs->entries[i];
+    stats_prom_labels (labels, sizeof (labels), e);
+    fprintf ( f, "devfs_transactions_total{%s,dir=\"read\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.reads) );
+    fprintf ( f, "devfs_transactions_total{%s,dir=\"write\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.writes) );
+  }
+  fprintf (f, "# HELP devfs_bytes_total Bytes transferred by AXI4 transactions.\n");
+  fprintf (f, "# TYPE devfs_bytes_total counter\n");
+  for (int i = 0; i < devs->n_entries; i++) {
+    const dev_entry_t* e = &devs->entries[i];
+    stats_prom_labels (labels, sizeof (labels), e);
+    fprintf ( f, "devfs_bytes_total{%s,dir=\"read\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.read_bytes) );
+    fprintf ( f, "devfs_bytes_total{%s,dir=\"write\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.write_bytes) );
+  }
+  fprintf (f, "# HELP devfs_errors_total AXI4 error responses.\n");
+  fprintf (f, "# TYPE devfs_errors_total counter\n");
+  for (int i = 0; i < devs->n_entries; i++) {
+    const dev_entry_t* e = &devs->entries[i];
+    stats_prom_labels (labels, sizeof (labels), e);
+    fprintf ( f, "devfs_errors_total{%s,resp=\"slverr\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.slverr) );
+    fprintf ( f, "devfs_errors_total{%s,resp=\"decerr\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.decerr) );
+  }
+  fprintf (f, "# HELP devfs_abandoned_total AXI4 transactions abandoned.\n");
+  fprintf (f, "# TYPE devfs_abandoned_total counter\n");
+  for (int i = 0; i < devs->n_entries; i++) {
+    const dev_entry_t* e = &devs->entries[i];
+    stats_prom_labels (labels, sizeof (labels), e);
+    fprintf ( f, "devfs_abandoned_total{%s,reason=\"timeout\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.timeouts) );
+    fprintf ( f, "devfs_abandoned_total{%s,reason=\"interrupt\"} %lu\n", labels
+            , atomic_load (&e->stats.axi.cancelled) );
+  }
+  fprintf (f, "# HELP devfs_read_cache_total Reads of the device read caches.\n");
+  fprintf (f, "# TYPE devfs_read_cache_total counter\n");
+  for (int i = 0; i < devs->n_entries; i++) {
+    const dev_entry_t* e = &devs->entries[i];
+    if (!e->rcache) continue;
+    stats_prom_labels (labels, sizeof (labels), e);
+    fprintf ( f, "devfs_read_cache_total{%s,result=\"hit\"} %lu\n", labels
+            , atomic_load (&e->stats.cache_hits) );
+    fprintf ( f, "devfs_read_cache_total{%s,result=\"miss\"} %lu\n", labels
+            , atomic_load (&e->stats.cache_misses) );
+  }
+  fprintf (f, "# HELP devfs_latency_seconds Device access latency by stage.\n");
+  fprintf (f, "# TYPE devfs_latency_seconds histogram\n");
+  for (int i = 0; i < devs->n_entries; i++)
+    for (int k = 0; k < 2; k++)
+      for (int s = 0; s < LAT_STAGES; s++)
+        stats_fprint_prom_hist (f, &devs->entries[i], k, s);
+}
+
+// Watchdog
+////////////////////////////////////////////////////////////////////////////////
+
+static const char* stats_link_names[] = { "idle", "up", "down" };
+
+// one line per port, then one line per ID queue holding transactions, with
+// the age of its oldest transaction and whether it is stuck (see axi_watchdog)
+// or abandoned and waiting for its late responses
+static void stats_render_watchdog (FILE* f, const sim_ports_t* simports) {
+  for (int i = 0; i < simports->n_ports; i++) {
+    axi_sim_port_t* simport = simports->ports[i];
+    axi_engine_t* engine = &simport->engine;
+    pthread_mutex_lock (&engine->lock);
+    uint64_t now = lat_now ();
+    fprintf ( f, "port %s link %s outstanding %d posted %d allocs %lu"
+                 " timeout_ms %" PRIu64 "\n"
+            , simport->name, stats_link_names[atomic_load (&simport->link)]
+            , engine->outstanding, engine->posted
+            , atomic_load (&engine->n_allocs), simport->timeout_ns / 1000000 );
+    for (int id = 0; id < engine->n_ids; id++) {
+      for (int kind = AXI_TXN_READ; kind <= AXI_TXN_WRITE; kind++) {
+        const axi_id_queue_t* q =
+          (kind == AXI_TXN_READ) ? &engine->rd[id] : &engine->wr[id];
+        const axi_txn_t* head = q->head;
+        if (!head) continue;
+        int abandoned = 0;
+        for (const axi_txn_t* txn = head; txn; txn = txn->next)
+          abandoned += txn->abandoned;
+        uint64_t age = now - head->t_issue;
+        const char* state = head->abandoned ? "abandoned"
+                          : (age >= axi_txn_stuck_ns (head)) ? "stuck" : "waiting";
+        fprintf ( f, "  id %d %-5s txns %d abandoned %d head 0x%" PRIx64
+                     " beat %d/%d age_ms %" PRIu64 " %s\n"
+                , id, stats_kind_names[kind], q->count, abandoned, head->addr
+                , head->beat, head->nbeats, age / 1000000, state );
+      }
+    }
+    pthread_mutex_unlock (&engine->lock);
+  }
+}
+
+// Interface
+////////////////////////////////////////////////////////////////////////////////
+
+// render a statistics file (-ENOENT if there is none) into a snapshot, to be
+// released with stats_snapshot_free
+static int stats_snapshot ( const sim_ports_t* simports
+                          , const char* path
+                          , stats_snapshot_t** snapshot ) {
+  const dev_entry_t* entry = stats_dev (simports, path);
+  if (   !entry && strcmp (path, STATS_COUNTERS) != 0
+      && strcmp (path, STATS_METRICS) != 0
+      && strcmp (path, STATS_WATCHDOG) != 0 ) return -ENOENT;
+  stats_snapshot_t* snap = malloc (sizeof (stats_snapshot_t));
+  snap->buf = NULL;
+  FILE* f = open_memstream (&snap->buf, &snap->len);
+  if (!f) {
+    free (snap);
+    return -ENOMEM;
+  }
+  if (entry) stats_render_dev_json (f, simports, entry);
+  else if (strcmp (path, STATS_COUNTERS) == 0)
+    stats_render_counters (f, simports);
+  else if (strcmp (path, STATS_WATCHDOG) == 0)
+    stats_render_watchdog (f, simports);
+  else stats_render_metrics (f, simports);
+  fclose (f);
+  *snapshot = snap;
+  return 0;
+}
+
+static void stats_snapshot_free (stats_snapshot_t* snap) {
+  free (snap->buf);
+  free (snap);
+}
+
+static void axi_stats_reset (axi_stats_t* stats) {
+  atomic_store (&stats->reads, 0);
+  atomic_store (&stats->writes, 0);
+  atomic_store (&stats->read_bytes, 0);
+  atomic_store (&stats->write_bytes, 0);
+  atomic_store (&stats->slverr, 0);
+  atomic_store (&stats->decerr, 0);
+  atomic_store (&stats->timeouts, 0);
+  atomic_store (&stats->cancelled, 0);
+}
+
+// reset the counters and histograms of all the ports and devices (the posted
+// write errors are left for flush and fsync to report)
+static void stats_reset (sim_ports_t* simports) {
+  for (int i = 0; i < simports->n_ports; i++)
+    axi_stats_reset (&simports->ports[i]->engine.stats);
+  dev_registry_t* devs = simports->devs;
+  for (int i = 0; i < devs->n_entries; i++) {
+    dev_stats_t* stats = &devs->entries[i].stats;
+    axi_stats_reset (&stats->axi);
+    atomic_store (&stats->cache_hits, 0);
+    atomic_store (&stats->cache_misses, 0);
+    atomic_store (&stats->stream_rx, 0);
+    atomic_store (&stats->stream_tx, 0);
+    for (int k = 0; k < 2; k++)
+      for (int s = 0; s < LAT_STAGES; s++) lat_hist_reset (&stats->lat[k][s]);
+  }
+  atomic_store (&simports->stats_since, lat_now ());
+}
+
+#endif
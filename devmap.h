@@ -0,0 +1,403 @@
+#ifndef DEVMAP_H
+#define DEVMAP_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include <mem_mapped_dev.h>
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_ports.h>
+
+// Device map
+////////////////////////////////////////////////////////////////////////////////
+// The simulator ports to connect to, and the devices reached through each of
+// them. A device map is either the built-in CHERI-BGAS one, or loaded at
+// startup from a device-tree-like description:
+//
+//   // comment
+//   h2f_lw {                      // a port, named after its fifos folder
+//     id-width = <0>;
+//     addr-width = <21>;
+//     data-width = <32>;
+//     timeout-ms = <100>;         // optional transaction timeout
+//     uart0 {                     // a device
+//       reg = <0x3000 0x1000>;    // base address and range
+//       timeout-ms = <1000>;      // optional, overrides the port's
+//     };
+//     misc {
+//       reg = <0x2000 0x1000>;
+//       cache-ttl-ms = <10>;      // reads served from the host for 10ms
+//       prefetchable;             // reads have no side effects, read ahead
+//     };
+//     irqs {
+//       reg = <0x1000 0x1000>;
+//       poll-reg = <0x0 0xff>;    // status register offset and ready bits
+//     };
+//     uart1 {
+//       reg = <0x4000 0x1000>;
+//       // a uart1.stream view: data and status registers offsets, the status
+//       // bits telling a byte was received and the TX FIFO can take more, and
+//       // its depth (optional, 1 by default)
+//       stream = <0x0 0x14 0x01 0x20 16>;
+//     };
+//     dma_window {
+//       reg = <0x0 0x40000000>;
+//       memory;                   // the device can be cached and mapped
+//     };
+//   };
+
+typedef struct {
+  const char* name;
+  const axi_port_fns_t* fns;
+  uint32_t timeout_ms; // transaction timeout, or 0 for the default one
+  int n_devs;
+  mem_mapped_dev_t* devs;
+} devmap_port_t;
+
+typedef struct devmap {
+  int n_ports;
+  devmap_port_t* ports;
+} devmap_t;
+
+static devmap_port_t* devmap_add_port ( devmap_t* map
+                                      , const char* name
+                                      , const axi_port_fns_t* fns ) {
+  map->ports = realloc (map->ports, (map->n_ports + 1) * sizeof (devmap_port_t));
+  devmap_port_t* port = &map->ports[map->n_ports++];
+  *port = (devmap_port_t) { .name = strdup (name), .fns = fns };
+  return port;
+}
+
+static mem_mapped_dev_t* devmap_add_dev (devmap_port_t* port, const char* name) {
+  port->devs = realloc (port->devs, (port->n_devs + 1) * sizeof (mem_mapped_dev_t));
+  mem_mapped_dev_t* dev = &port->devs[port->n_devs++];
+  *dev = (mem_mapped_dev_t) { .name = strdup (name) };
+  return dev;
+}
+
+static void devmap_destroy (devmap_t* map) {
+  for (int i = 0; i < map->n_ports; i++) {
+    for (int j = 0; j < map->ports[i].n_devs; j++)
+      free ((char*) map->ports[i].devs[j].name);
+    free (map->ports[i].devs);
+    free ((char*) map->ports[i].name);
+  }
+  free (map->ports);
+  free (map);
+}
+
+static void devmap_add_devs ( devmap_port_t* port
+                            , const mem_mapped_dev_t devs[]
+                            , int ndevs ) {
+  for (int i = 0; i < ndevs; i++) {
+    mem_mapped_dev_t* dev = devmap_add_dev (port, devs[i].name);
+    dev->base_addr = devs[i].base_addr;
+    dev->range = devs[i].range;
+    dev->is_memory = devs[i].is_memory;
+    dev->timeout_ms = devs[i].timeout_ms;
+    dev->cache_policy = devs[i].cache_policy;
+    dev->cache_ttl_ms = devs[i].cache_ttl_ms;
+    dev->has_poll_reg = devs[i].has_poll_reg;
+    dev->poll_offset = devs[i].poll_offset;
+    dev->poll_mask = devs[i].poll_mask;
+    dev->stream = devs[i].stream;
+  }
+}
+
+// the built-in CHERI-BGAS device map
+static devmap_t* devmap_builtin (void) {
+  devmap_t* map = calloc (1, sizeof (devmap_t));
+  devmap_add_devs ( devmap_add_port (map, H2F_LW_FOLDER, &h2f_lw_fns)
+                  , h2f_lw_devs, n_h2f_lw_devs );
+  devmap_add_devs ( devmap_add_port (map, H2F_FOLDER, &h2f_fns)
+                  , h2f_devs, n_h2f_devs );
+  return map;
+}
+
+// Device map parser
+////////////////////////////////////////////////////////////////////////////////
+
+#define DEVMAP_MAX_TOKEN 64
+#define DEVMAP_MAX_CELLS 8
+
+typedef struct {
+  const char* path;
+  const char* pos;
+  int line;
+  char tok[DEVMAP_MAX_TOKEN]; // current token, "" at the end of the input
+} devmap_lexer_t;
+
+static bool devmap_word_char (char c) {
+  return isalnum ((unsigned char) c) || (c && strchr ("_-.,+#@", c));
+}
+
+// move to the next token
+static void devmap_next (devmap_lexer_t* lx) {
+  for (;;) {
+    while (isspace ((unsigned char) *lx->pos))
+      if (*lx->pos++ == '\n') lx->line++;
+    if (lx->pos[0] == '/' && lx->pos[1] == '/')
+      while (*lx->pos && *lx->pos != '\n') lx->pos++;
+    else if (lx->pos[0] == '/' && lx->pos[1] == '*') {
+      for (lx->pos += 2; *lx->pos && !(lx->pos[0] == '*' && lx->pos[1] == '/');)
+        if (*lx->pos++ == '\n') lx->line++;
+      if (*lx->pos) lx->pos += 2;
+    } else break;
+  }
+  int n = 0;
+  if (devmap_word_char (*lx->pos))
+    while (devmap_word_char (*lx->pos) && n < DEVMAP_MAX_TOKEN - 1)
+      lx->tok[n++] = *lx->pos++;
+  else if (*lx->pos) lx->tok[n++] = *lx->pos++;
+  lx->tok[n] = '\0';
+}
+
+static bool devmap_error (devmap_lexer_t* lx, const char* msg) {
+  fprintf ( stderr, "%s:%d: %s (at \"%s\")\n"
+          , lx->path, lx->line, msg, lx->tok );
+  return false;
+}
+
+static bool devmap_expect (devmap_lexer_t* lx, const char* tok) {
+  if (strcmp (lx->tok, tok) != 0) {
+    char msg[32];
+    sprintf (msg, "expected \"%s\"", tok);
+    return devmap_error (lx, msg);
+  }
+  devmap_next (lx);
+  return true;
+}
+
+// parse the rest of a property after its name, "= <cells>;" or ";"
+static bool devmap_prop (devmap_lexer_t* lx, uint64_t cells[], int* n_cells) {
+  *n_cells = 0;
+  if (strcmp (lx->tok, "=") == 0) {
+    devmap_next (lx);
+    if (!devmap_expect (lx, "<")) return false;
+    while (strcmp (lx->tok, ">") != 0) {
+      char* end;
+      if (*n_cells == DEVMAP_MAX_CELLS) return devmap_error (lx, "too many cells");
+      cells[(*n_cells)++] = strtoull (lx->tok, &end, 0);
+      if (!lx->tok[0] || *end) return devmap_error (lx, "expected a number");
+      devmap_next (lx);
+    }
+    devmap_next (lx);
+  }
+  return devmap_expect (lx, ";");
+}
+
+static bool devmap_parse_dev (devmap_lexer_t* lx, mem_mapped_dev_t* dev) {
+  bool has_reg = false;
+  while (strcmp (lx->tok, "}") != 0) {
+    char name[DEVMAP_MAX_TOKEN];
+    uint64_t cells[DEVMAP_MAX_CELLS];
+    int n;
+    strcpy (name, lx->tok);
+    if (!devmap_word_char (name[0])) return devmap_error (lx, "expected a property");
+    devmap_next (lx);
+    if (!devmap_prop (lx, cells, &n)) return false;
+    if (strcmp (name, "reg") == 0) {
+      if (n != 2) return devmap_error (lx, "reg needs a base address and a range");
+      dev->base_addr = cells[0];
+      dev->range = cells[1];
+      has_reg = true;
+    } else if (strcmp (name, "memory") == 0 && n == 0) dev->is_memory = true;
+    else if (strcmp (name, "timeout-ms") == 0 && n == 1) dev->timeout_ms = cells[0];
+    else if (strcmp (name, "cache-ttl-ms") == 0 && n == 1) {
+      if (cells[0] == 0) return devmap_error (lx, "cache-ttl-ms must not be 0");
+      dev->cache_ttl_ms = cells[0];
+      if (dev->cache_policy == DEV_CACHE_NONE) dev->cache_policy = DEV_CACHE_READ;
+    } else if (strcmp (name, "prefetchable") == 0 && n == 0)
+      dev->cache_policy = DEV_CACHE_PREFETCH;
+    else if (strcmp (name, "poll-reg") == 0 && (n == 1 || n == 2)) {
+      dev->has_poll_reg = true;
+      dev->poll_offset = cells[0];
+      dev->poll_mask = (n == 2) ? cells[1] : 0xffffffff;
+    } else if (strcmp (name, "stream") == 0 && (n == 4 || n == 5)) {
+      dev->stream = (dev_stream_regs_t) { .enabled = true
+                                        , .data_offset = cells[0]
+                                        , .status_offset = cells[1]
+                                        , .rx_ready = cells[2]
+                                        , .tx_ready = cells[3]
+                                        , .tx_fifo = (n == 5) ? cells[4] : 1 };
+      if (dev->stream.tx_fifo < 1 || dev->stream.tx_fifo > DEV_STREAM_MAX_FIFO)
+        return devmap_error (lx, "invalid stream TX FIFO depth");
+    } else return devmap_error (lx, "unknown device property");
+  }
+  if (!has_reg) return devmap_error (lx, "device without reg property");
+  if (   dev->has_poll_reg
+      && (dev->range < 4 || dev->poll_offset > dev->range - 4) )
+    return devmap_error (lx, "poll-reg outside of the device range");
+  if (   dev->stream.enabled
+      && (   dev->range < 4 || dev->stream.data_offset >= dev->range
+          || dev->stream.status_offset > dev->range - 4) )
+    return devmap_error (lx, "stream registers outside of the device range");
+  devmap_next (lx);
+  return devmap_expect (lx, ";");
+}
+
+// whether the [base, base + range) byte ranges of two devices intersect
+static bool devmap_overlap (const mem_mapped_dev_t* a, const mem_mapped_dev_t* b) {
+  return a->base_addr >= b->base_addr ? a->base_addr - b->base_addr < b->range
+                                      : b->base_addr - a->base_addr < a->range;
+}
+
+// reject the last device of a port if it overlaps one of the others, as the
+// accesses to their common bytes would be ambiguous
+static bool devmap_check_overlap (devmap_lexer_t* lx, const devmap_port_t* port) {
+  const mem_mapped_dev_t* dev = &port->devs[port->n_devs - 1];
+  for (int i = 0; i < port->n_devs - 1; i++)
+    if (devmap_overlap (dev, &port->devs[i])) {
+      fprintf ( stderr, "%s:%d: port %s: device %s [0x%" PRIx64 ", 0x%" PRIx64 ")"
+                        " overlaps device %s [0x%" PRIx64 ", 0x%" PRIx64 ")\n"
+              , lx->path, lx->line, port->name
+              , dev->name, dev->base_addr, dev->base_addr + dev->range
+              , port->devs[i].name, port->devs[i].base_addr
+              , port->devs[i].base_addr + port->devs[i].range );
+      return false;
+    }
+  return true;
+}
+
+// whether a word names a file or a folder of its own, and not "." nor a path
+// up the tree (words never hold a '/')
+static bool devmap_valid_name (const char* name) {
+  return devmap_word_char (name[0]) && strcmp (name, ".") != 0
+      && strstr (name, "..") == NULL;
+}
+
+// whether a device name is taken by another entry of the devfs
+static bool devmap_reserved_name (const char* name) {
+  size_t len = strlen (name);
+  size_t suffix = strlen (UART_STREAM_SUFFIX);
+  return strcmp (name, F2H_MEM_ENTRY + 1) == 0
+      || strcmp (name, STATS_DIR + 1) == 0
+      || (len >= suffix && strcmp (name + len - suffix, UART_STREAM_SUFFIX) == 0);
+}
+
+static bool devmap_parse_port (devmap_lexer_t* lx, devmap_t* map) {
+  char port_name[DEVMAP_MAX_TOKEN];
+  // the port's fifos folder, in the simulator ports folder
+  if (!devmap_valid_name (lx->tok)) return devmap_error (lx, "invalid port name");
+  for (int i = 0; i < map->n_ports; i++)
+    if (strcmp (map->ports[i].name, lx->tok) == 0)
+      return devmap_error (lx, "duplicate port name");
+  strcpy (port_name, lx->tok);
+  devmap_next (lx);
+  if (!devmap_expect (lx, "{")) return false;
+  int widths[3] = { -1, -1, -1 }; // id, addr, data
+  devmap_port_t* port = devmap_add_port (map, port_name, NULL);
+  while (strcmp (lx->tok, "}") != 0) {
+    char name[DEVMAP_MAX_TOKEN];
+    strcpy (name, lx->tok);
+    if (!devmap_word_char (name[0])) return devmap_error (lx, "expected a property or a device");
+    devmap_next (lx);
+    if (strcmp (lx->tok, "{") == 0) {
+      if (!devmap_valid_name (name) || devmap_reserved_name (name)) {
+        char msg[DEVMAP_MAX_TOKEN + 32];
+        sprintf (msg, "invalid device name \"%s\"", name);
+        return devmap_error (lx, msg);
+      }
+      devmap_next (lx);
+      if (!devmap_parse_dev (lx, devmap_add_dev (port, name))) return false;
+      if (!devmap_check_overlap (lx, port)) return false;
+      continue;
+    }
+    uint64_t cells[DEVMAP_MAX_CELLS];
+    int n;
+    if (!devmap_prop (lx, cells, &n)) return false;
+    if (strcmp (name, "timeout-ms") == 0 && n == 1) {
+      port->timeout_ms = cells[0];
+      continue;
+    }
+    int w = strcmp (name, "id-width") == 0 ? 0
+          : strcmp (name, "addr-width") == 0 ? 1
+          : strcmp (name, "data-width") == 0 ? 2 : -1;
+    if (w < 0 || n != 1) return devmap_error (lx, "unknown port property");
+    widths[w] = cells[0];
+  }
+  devmap_next (lx);
+  if (!devmap_expect (lx, ";")) return false;
+  port->fns = axi_port_impl_find (widths[0], widths[1], widths[2]);
+  if (!port->fns) {
+    fprintf ( stderr, "%s: port %s: unsupported id-width %d, addr-width %d,"
+                      " data-width %d, the supported ones are:\n"
+            , lx->path, port->name, widths[0], widths[1], widths[2] );
+    axi_port_impls_print (stderr);
+    return false;
+  }
+  return true;
+}
+
+// load a device map from a description file, or return NULL
+static devmap_t* devmap_load (const char* path) {
+  FILE* f = fopen (path, "r");
+  if (!f) {
+    fprintf (stderr, "Failed fopen(\"%s\", \"r\"): ", path);
+    perror (NULL);
+    return NULL;
+  }
+  fseek (f, 0, SEEK_END);
+  long size = ftell (f);
+  rewind (f);
+  char* text = malloc (size + 1);
+  size_t n = fread (text, 1, size, f);
+  text[n] = '\0';
+  fclose (f);
+  devmap_t* map = calloc (1, sizeof (devmap_t));
+  devmap_lexer_t lx = { .path = path, .pos = text, .line = 1 };
+  devmap_next (&lx);
+  bool ok = true;
+  while (ok && lx.tok[0]) ok = devmap_parse_port (&lx, map);
+  free (text);
+  if (!ok) {
+    devmap_destroy (map);
+    return NULL;
+  }
+  return map;
+}
+
+#endif
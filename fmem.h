@@ -0,0 +1,125 @@
+#ifndef FMEM_H
+#define FMEM_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// ioctl interface of the device files, shared with client tools
+////////////////////////////////////////////////////////////////////////////////
+
+// a single access of 1 to 4 bytes at any offset in the device
+struct fmem_request {
+  uint32_t offset;
+  uint32_t data;
+  uint32_t access_width;
+};
+
+#define FMEM_READ  _IOWR('X', 1, struct fmem_request)
+#define FMEM_WRITE _IOWR('X', 2, struct fmem_request)
+
+// the widest single access, a full beat of a 512-bit port
+#define FMEM_MAX_ACCESS_WIDTH 64
+
+// A single access of 1 to 64 bytes at any offset in the device, or of 0 for a
+// full beat of the device's port (set to the port's data width on return).
+// Accesses within a beat take a single beat, and the others the fewest beats
+// covering them. The data is in little endian byte order.
+struct fmem_request_v2 {
+  uint64_t offset;
+  uint32_t access_width;
+  uint32_t reserved;     // 0
+  uint8_t data[FMEM_MAX_ACCESS_WIDTH];
+};
+
+#define FMEM_READ_V2  _IOWR('X', 4, struct fmem_request_v2)
+#define FMEM_WRITE_V2 _IOWR('X', 5, struct fmem_request_v2)
+
+// one access of a batch
+struct fmem_op {
+  uint32_t offset;
+  uint32_t data;         // data to write, or data read
+  uint32_t expect;       // expected data read, with FMEM_OP_COMPARE
+  uint32_t mask;         // bits of the data read compared with expect
+  uint8_t access_width;
+  uint8_t cmd;           // FMEM_OP_READ or FMEM_OP_WRITE
+  uint8_t flags;
+  int8_t status;         // FMEM_OP_OK, FMEM_OP_MISMATCH, FMEM_OP_SKIPPED or
+                         // a negative errno
+};
+
+#define FMEM_OP_READ  0
+#define FMEM_OP_WRITE 1
+
+// wait for all the previous accesses of the batch to complete first
+#define FMEM_OP_FENCE    0x1
+// read the written data back once the write completed, into data
+#define FMEM_OP_READBACK 0x2
+// compare the data read with expect under mask, and skip the rest of the
+// batch on a mismatch (the following accesses wait for the comparison)
+#define FMEM_OP_COMPARE  0x4
+
+#define FMEM_OP_OK       0
+#define FMEM_OP_MISMATCH 1
+#define FMEM_OP_SKIPPED  2
+
+// A batch of accesses to a device, performed as pipelined transactions in a
+// single ioctl. Accesses not separated by a fence may complete in any order.
+#define FMEM_BATCH_MAX 64
+struct fmem_batch {
+  uint32_t count;        // number of accesses in ops
+  uint32_t completed;    // number of accesses performed
+  struct fmem_op ops[FMEM_BATCH_MAX];
+};
+
+#define FMEM_BATCH _IOWR('X', 3, struct fmem_batch)
+
+// Drop the host side copies of a byte range of the device (the whole device
+// from the offset when the length is 0), so that the next reads reach it.
+// Pages of cached memory devices are written back first.
+struct fmem_invalidate {
+  uint64_t offset;
+  uint64_t length;
+};
+
+#define FMEM_INVALIDATE _IOW('X', 6, struct fmem_invalidate)
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+
+// HDR-style latency histograms
+////////////////////////////////////////////////////////////////////////////////
+// Latencies are recorded in nanoseconds into log-linear buckets: each power of
+// two range is split into LAT_HIST_SUB equal buckets, which bounds the relative
+// error of a bucket to 1 / LAT_HIST_SUB over the full 64-bit range. Recording
+// is lock-free and may race with a reset, which only costs a few samples.
+
+#define LAT_HIST_SUB_BITS 3
+#define LAT_HIST_SUB (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS ((64 - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB)
+
+typedef struct {
+  atomic_ulong count;
+  atomic_ulong sum;
+  atomic_ulong max;
+  atomic_ulong buckets[LAT_HIST_BUCKETS];
+} lat_hist_t;
+
+// monotonic time in nanoseconds
+static uint64_t lat_now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int lat_hist_index (uint64_t ns) {
+  if (ns < LAT_HIST_SUB) return ns;
+  int e = 63 - __builtin_clzll (ns);
+  return (e - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB
+       + ((ns >> (e - LAT_HIST_SUB_BITS)) & (LAT_HIST_SUB - 1));
+}
+
+// lowest and highest values recorded in a bucket
+static uint64_t lat_hist_low (int i) {
+  if (i < LAT_HIST_SUB) return i;
+  int shift = i / LAT_HIST_SUB - 1;
+  return (uint64_t) (LAT_HIST_SUB + i % LAT_HIST_SUB) << shift;
+}
+
+static uint64_t lat_hist_high (int i) {
+  return (i + 1 < LAT_HIST_BUCKETS) ? lat_hist_low (i + 1) - 1 : UINT64_MAX;
+}
+
+static void lat_hist_record (lat_hist_t* h, uint64_t ns) {
+  atomic_fetch_add_explicit ( &h->buckets[lat_hist_index (ns)], 1
+                            , memory_order_relaxed );
+  atomic_fetch_add_explicit (&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&h->sum, ns, memory_order_relaxed);
+  unsigned long max = atomic_load_explicit (&h->max, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak (&h->max, &max, ns));
+}
+
+// the highest value of the bucket holding the given quantile (0 if empty)
+static uint64_t lat_hist_quantile (const lat_hist_t* h, double q) {
+  unsigned long count = atomic_load (&h->count);
+  if (count == 0) return 0;
+  unsigned long rank = (unsigned long) (q * count);
+  if (rank >= count) rank = count - 1;
+  unsigned long seen = 0;
+  for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+    seen += atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+    if (seen > rank) return lat_hist_high (i);
+  }
+  return atomic_load (&h->max);
+}
+
+static void lat_hist_reset (lat_hist_t* h) {
+  for (int i = 0; i < LAT_HIST_BUCKETS; i++) atomic_store (&h->buckets[i], 0);
+  atomic_store (&h->count, 0);
+  atomic_store (&h->sum, 0);
+  atomic_store (&h->max, 0);
+}
+
+#endif
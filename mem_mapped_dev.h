@@ -42,23 +42,51 @@
 */
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <BlueUnixBridges.h>
 #include <BlueAXI4UnixBridges.h>
 
-// A memory mapped device with a name, a base address and an address range
+// How the reads of a device's registers may be served from the host. Devices
+// with side-effecting or volatile registers must stay uncached.
+typedef enum {
+  DEV_CACHE_NONE     // every read reaches the device
+, DEV_CACHE_READ     // reads served from host copies for up to a TTL
+, DEV_CACHE_PREFETCH // likewise, and a miss also reads the following lines
+} dev_cache_policy_t;
+
+// The registers of a UART-like device with a stream view
+#define DEV_STREAM_MAX_FIFO 64
+typedef struct {
+  bool enabled;
+  uint64_t data_offset;   // byte register, read to receive and written to send
+  uint64_t status_offset; // 4-byte register
+  uint32_t rx_ready;      // status bits set while a received byte is there
+  uint32_t tx_ready;      // status bits set while tx_fifo bytes can be sent
+  uint32_t tx_fifo;
+} dev_stream_regs_t;
+
+// A memory mapped device with a name, a base address and an address range.
+// Memory devices (as opposed to devices with side-effecting registers) can be
+// cached on the host and mapped in memory.
 typedef struct mem_mapped_dev {
   const char* name;
-  const uint64_t base_addr;
-  const uint64_t range;
+  uint64_t base_addr;
+  uint64_t range;
+  bool is_memory;
+  uint32_t timeout_ms; // transaction timeout, or 0 for the port's
+  dev_cache_policy_t cache_policy;
+  uint32_t cache_ttl_ms; // of the read cache lines, or 0 until invalidated
+  bool has_poll_reg;     // the device is ready for poll while its 4-byte
+  uint64_t poll_offset;  // status register at poll_offset has any of the
+  uint32_t poll_mask;    // poll_mask bits set
+  dev_stream_regs_t stream;
 } mem_mapped_dev_t;
 
-// lookup a device in a device array based on its name
-static const mem_mapped_dev_t* devs_find ( const char* path
-                                         , const mem_mapped_dev_t devs[]
-                                         , int ndevs) {
+// whether any device in a device array is memory
+static bool devs_have_memory (const mem_mapped_dev_t devs[], int ndevs) {
   for (int i = 0; i < ndevs; i++)
-    if (strcmp (path+1, devs[i].name) == 0) return &devs[i];
-  return NULL;
+    if (devs[i].is_memory) return true;
+  return false;
 }
 
 // print all devices in a device array
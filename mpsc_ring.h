@@ -0,0 +1,110 @@
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free multi-producer single-consumer ring of pointers.
+// Each cell carries a sequence number telling whether it is free for the
+// producer claiming position pos (seq == pos), or holds the element pushed at
+// position pos for the consumer (seq == pos + 1).
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef MPSC_RING_SIZE
+#define MPSC_RING_SIZE 256 // must be a power of 2
+#endif
+
+typedef struct {
+  atomic_size_t seq;
+  void* data;
+} mpsc_cell_t;
+
+typedef struct {
+  mpsc_cell_t cells[MPSC_RING_SIZE];
+  // producers and consumer positions live on separate cache lines
+  _Alignas(64) atomic_size_t push_pos;
+  _Alignas(64) size_t pop_pos;
+} mpsc_ring_t;
+
+static void mpsc_ring_init (mpsc_ring_t* ring) {
+  for (size_t i = 0; i < MPSC_RING_SIZE; i++)
+    atomic_init (&ring->cells[i].seq, i);
+  atomic_init (&ring->push_pos, 0);
+  ring->pop_pos = 0;
+}
+
+// push an element, returning false if the ring is full (any thread)
+static bool mpsc_ring_push (mpsc_ring_t* ring, void* data) {
+  size_t pos = atomic_load_explicit (&ring->push_pos, memory_order_relaxed);
+  mpsc_cell_t* cell;
+  for (;;) {
+    cell = &ring->cells[pos & (MPSC_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit ( &ring->push_pos, &pos, pos + 1
+                                                , memory_order_relaxed
+                                                , memory_order_relaxed ))
+        break;
+    } else if (diff < 0) return false;
+    else pos = atomic_load_explicit (&ring->push_pos, memory_order_relaxed);
+  }
+  cell->data = data;
+  atomic_store_explicit (&cell->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+// pop an element, returning NULL if the ring is empty (consumer thread only)
+static void* mpsc_ring_pop (mpsc_ring_t* ring) {
+  size_t pos = ring->pop_pos;
+  mpsc_cell_t* cell = &ring->cells[pos & (MPSC_RING_SIZE - 1)];
+  size_t seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+  if ((intptr_t) seq - (intptr_t) (pos + 1) < 0) return NULL;
+  void* data = cell->data;
+  atomic_store_explicit (&cell->seq, pos + MPSC_RING_SIZE, memory_order_release);
+  ring->pop_pos = pos + 1;
+  return data;
+}
+
+#endif
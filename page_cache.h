@@ -0,0 +1,439 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_burst.h>
+#include <axi_engine.h>
+
+// Host side cache of the pages of memory devices
+////////////////////////////////////////////////////////////////////////////////
+// Pages are filled with burst reads on a miss. Written bytes are tracked in a
+// per-page byte mask, so a write never needs to read the page first, and dirty
+// pages are written back with strobed bursts covering only the written bytes.
+// All pages are preallocated when the cache is created.
+//
+// The cache lock is not held across the accesses to the simulator: a page
+// being filled or written back is busy meanwhile, and the other accesses to
+// the page wait for it to be idle again (looking it up again, as it may have
+// been dropped). A busy page is never evicted, and a thread waiting for a
+// busy page only keeps pages at lower addresses busy, so waits never cycle.
+
+#define PAGE_CACHE_PAGE_SIZE AXI4_BOUNDARY
+
+typedef enum {
+  CACHE_UNCACHED
+, CACHE_WRITETHROUGH
+, CACHE_WRITEBACK
+} cache_mode_t;
+
+typedef struct cache_page {
+  uint64_t addr; // page aligned
+  bool valid;    // bytes not in dirty_mask were read from the simulator
+  bool dirty;
+  bool busy;     // accessed in the simulator, without the cache lock
+  uint8_t dirty_mask[PAGE_CACHE_PAGE_SIZE / 8];
+  struct cache_page* hnext; // hash bucket chain
+  struct cache_page* prev;  // LRU list (most recently used first)
+  struct cache_page* next;
+  uint8_t data[PAGE_CACHE_PAGE_SIZE];
+} cache_page_t;
+
+typedef struct page_cache {
+  axi_sim_port_t* simport;
+  cache_mode_t mode;
+  int n_pages;
+  cache_page_t* pages;     // page arena
+  cache_page_t* free;      // unused pages, chained through hnext
+  cache_page_t** buckets;
+  uint64_t bucket_mask;
+  cache_page_t lru;        // LRU list sentinel
+  pthread_mutex_t lock;
+  pthread_cond_t idle;     // signaled when pages stop being busy
+  int writing;             // write-through writes in flight
+  unsigned long written;   // write-through writes started
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long writebacks;
+} page_cache_t;
+
+static cache_page_t** page_cache_bucket (page_cache_t* cache, uint64_t addr) {
+  uint64_t pn = addr / PAGE_CACHE_PAGE_SIZE;
+  return &cache->buckets[(pn * 0x9e3779b97f4a7c15ULL >> 32) & cache->bucket_mask];
+}
+
+static void page_cache_lru_unlink (cache_page_t* page) {
+  page->prev->next = page->next;
+  page->next->prev = page->prev;
+}
+
+static void page_cache_lru_push (page_cache_t* cache, cache_page_t* page) {
+  page->next = cache->lru.next;
+  page->prev = &cache->lru;
+  cache->lru.next->prev = page;
+  cache->lru.next = page;
+}
+
+static cache_page_t* page_cache_find (page_cache_t* cache, uint64_t addr) {
+  for (cache_page_t* p = *page_cache_bucket (cache, addr); p; p = p->hnext)
+    if (p->addr == addr) return p;
+  return NULL;
+}
+
+// the page for an address once it is idle, or NULL if not present
+static cache_page_t* page_cache_find_idle (page_cache_t* cache, uint64_t addr) {
+  cache_page_t* p;
+  while ((p = page_cache_find (cache, addr)) && p->busy)
+    pthread_cond_wait (&cache->idle, &cache->lock);
+  return p;
+}
+
+// Mark an idle page busy while accessing the simulator without the lock, and
+// idle again once done. Nothing changes a busy page's data or dirty bytes.
+static void page_cache_acquire (page_cache_t* cache, cache_page_t* page) {
+  page->busy = true;
+}
+
+static void page_cache_release (page_cache_t* cache, cache_page_t* page) {
+  page->busy = false;
+  pthread_cond_broadcast (&cache->idle);
+}
+
+// write the dirty bytes of an idle page back to the simulator
+static int page_cache_clean (page_cache_t* cache, cache_page_t* page) {
+  if (!page->dirty) return 0;
+  bool full = true;
+  for (size_t i = 0; i < sizeof (page->dirty_mask) && full; i++)
+    full = page->dirty_mask[i] == 0xff;
+  page_cache_acquire (cache, page);
+  pthread_mutex_unlock (&cache->lock);
+  int ret = full ? axi_write ( cache->simport, page->addr
+                             , page->data, PAGE_CACHE_PAGE_SIZE )
+                 : axi_write_masked ( cache->simport, page->addr, page->data
+                                    , page->dirty_mask, PAGE_CACHE_PAGE_SIZE );
+  pthread_mutex_lock (&cache->lock);
+  if (ret == 0) {
+    memset (page->dirty_mask, 0, sizeof (page->dirty_mask));
+    page->dirty = false;
+    cache->writebacks++;
+  }
+  page_cache_release (cache, page);
+  return ret < 0 ? ret : 0;
+}
+
+// remove a (clean and idle) page from the cache
+static void page_cache_drop (page_cache_t* cache, cache_page_t* page) {
+  cache_page_t** pp = page_cache_bucket (cache, page->addr);
+  while (*pp != page) pp = &(*pp)->hnext;
+  *pp = page->hnext;
+  page_cache_lru_unlink (page);
+  page->hnext = cache->free;
+  cache->free = page;
+}
+
+// Get the idle page for an address, allocating it (not valid) if not present.
+// Evicting the least recently used idle page may write it back first, which
+// releases the lock, so the page is looked up again then.
+static int page_cache_get ( page_cache_t* cache
+                          , uint64_t addr
+                          , cache_page_t** page ) {
+  cache_page_t* p;
+  while (!(p = page_cache_find_idle (cache, addr)) && !cache->free) {
+    cache_page_t* victim = cache->lru.prev;
+    while (victim != &cache->lru && victim->busy) victim = victim->prev;
+    if (victim == &cache->lru) pthread_cond_wait (&cache->idle, &cache->lock);
+    else if (victim->dirty) {
+      int ret = page_cache_clean (cache, victim);
+      if (ret < 0) return ret;
+    } else page_cache_drop (cache, victim);
+  }
+  if (p) {
+    page_cache_lru_unlink (p);
+    page_cache_lru_push (cache, p);
+    *page = p;
+    return 0;
+  }
+  p = cache->free;
+  cache->free = p->hnext;
+  p->addr = addr;
+  p->valid = false;
+  p->dirty = false;
+  p->busy = false;
+  memset (p->dirty_mask, 0, sizeof (p->dirty_mask));
+  cache_page_t** bucket = page_cache_bucket (cache, addr);
+  p->hnext = *bucket;
+  *bucket = p;
+  page_cache_lru_push (cache, p);
+  *page = p;
+  return 0;
+}
+
+// Read an idle page from the simulator, keeping the bytes written since its
+// allocation. A fill which a write-through write may have overtaken still
+// gets the page's data, but leaves it not valid.
+static int page_cache_fill (page_cache_t* cache, cache_page_t* page) {
+  unsigned long written = cache->written;
+  bool overtaken = cache->writing > 0;
+  uint8_t fill[PAGE_CACHE_PAGE_SIZE];
+  page_cache_acquire (cache, page);
+  pthread_mutex_unlock (&cache->lock);
+  int ret = axi_read (cache->simport, page->addr, fill, PAGE_CACHE_PAGE_SIZE);
+  pthread_mutex_lock (&cache->lock);
+  if (ret == 0) {
+    for (int i = 0; i < PAGE_CACHE_PAGE_SIZE; i++)
+      if (!((page->dirty_mask[i / 8] >> (i % 8)) & 1))
+        page->data[i] = fill[i];
+    page->valid =
+      !overtaken && cache->writing == 0 && cache->written == written;
+  }
+  page_cache_release (cache, page);
+  return ret < 0 ? ret : 0;
+}
+
+// Cache interface
+////////////////////////////////////////////////////////////////////////////////
+
+static page_cache_t* page_cache_create ( axi_sim_port_t* simport
+                                       , cache_mode_t mode
+                                       , int n_pages ) {
+  page_cache_t* cache = malloc (sizeof (page_cache_t));
+  cache->simport = simport;
+  cache->mode = mode;
+  cache->n_pages = n_pages > 0 ? n_pages : 1;
+  cache->pages = calloc (cache->n_pages, sizeof (cache_page_t));
+  int n_buckets = 1;
+  while (n_buckets < cache->n_pages) n_buckets <<= 1;
+  cache->buckets = calloc (n_buckets, sizeof (cache_page_t*));
+  cache->bucket_mask = n_buckets - 1;
+  if (!cache->pages || !cache->buckets) {
+    fprintf (stderr, "Failed to allocate a %d pages cache\n", cache->n_pages);
+    exit (EXIT_FAILURE);
+  }
+  cache->free = NULL;
+  for (int i = cache->n_pages - 1; i >= 0; i--) {
+    cache->pages[i].hnext = cache->free;
+    cache->free = &cache->pages[i];
+  }
+  cache->lru.prev = cache->lru.next = &cache->lru;
+  pthread_mutex_init (&cache->lock, NULL);
+  pthread_cond_init (&cache->idle, NULL);
+  cache->writing = 0;
+  cache->written = 0;
+  cache->hits = cache->misses = cache->writebacks = 0;
+  return cache;
+}
+
+// read a byte range through the cache
+static int page_cache_read ( page_cache_t* cache
+                           , uint64_t addr
+                           , uint8_t* dst
+                           , size_t len ) {
+  int ret = 0;
+  pthread_mutex_lock (&cache->lock);
+  while (len > 0 && ret == 0) {
+    uint64_t page_addr = addr & ~((uint64_t) PAGE_CACHE_PAGE_SIZE - 1);
+    size_t offset = addr - page_addr;
+    size_t chunk = PAGE_CACHE_PAGE_SIZE - offset;
+    if (chunk > len) chunk = len;
+    cache_page_t* page = NULL;
+    if ((ret = page_cache_get (cache, page_addr, &page)) < 0) break;
+    if (page->valid) cache->hits++;
+    else {
+      cache->misses++;
+      if ((ret = page_cache_fill (cache, page)) < 0) break;
+    }
+    memcpy (dst, &page->data[offset], chunk);
+    addr += chunk;
+    dst += chunk;
+    len -= chunk;
+  }
+  pthread_mutex_unlock (&cache->lock);
+  return ret;
+}
+
+// Write a byte range straight to the simulator, then into the pages already
+// present, which stay busy meanwhile so that they see the writes in the order
+// the simulator does
+static int page_cache_write_through ( page_cache_t* cache
+                                    , uint64_t addr
+                                    , const uint8_t* src
+                                    , size_t len ) {
+  uint64_t first = addr & ~((uint64_t) PAGE_CACHE_PAGE_SIZE - 1);
+  int n = (addr + len - first + PAGE_CACHE_PAGE_SIZE - 1) / PAGE_CACHE_PAGE_SIZE;
+  cache_page_t* pages[n];
+  pthread_mutex_lock (&cache->lock);
+  cache->writing++;
+  cache->written++;
+  for (int i = 0; i < n; i++)
+    if ((pages[i] = page_cache_find_idle (cache, first + i * PAGE_CACHE_PAGE_SIZE)))
+      page_cache_acquire (cache, pages[i]);
+  pthread_mutex_unlock (&cache->lock);
+  int ret = axi_write (cache->simport, addr, src, len);
+  pthread_mutex_lock (&cache->lock);
+  for (int i = 0; i < n; i++) {
+    if (!pages[i]) continue;
+    uint64_t start = (i == 0) ? addr : pages[i]->addr;
+    uint64_t end = pages[i]->addr + PAGE_CACHE_PAGE_SIZE;
+    if (end > addr + len) end = addr + len;
+    if (ret == 0 && pages[i]->valid)
+      memcpy ( &pages[i]->data[start - pages[i]->addr], src + (start - addr)
+             , end - start );
+    page_cache_release (cache, pages[i]);
+  }
+  cache->writing--;
+  pthread_mutex_unlock (&cache->lock);
+  return ret;
+}
+
+// write a byte range through the cache, straight to the simulator in
+// write-through mode, or into dirty pages in write-back mode
+static int page_cache_write ( page_cache_t* cache
+                            , uint64_t addr
+                            , const uint8_t* src
+                            , size_t len ) {
+  if (cache->mode == CACHE_WRITETHROUGH)
+    return page_cache_write_through (cache, addr, src, len);
+  int ret = 0;
+  pthread_mutex_lock (&cache->lock);
+  while (len > 0) {
+    uint64_t page_addr = addr & ~((uint64_t) PAGE_CACHE_PAGE_SIZE - 1);
+    size_t offset = addr - page_addr;
+    size_t chunk = PAGE_CACHE_PAGE_SIZE - offset;
+    if (chunk > len) chunk = len;
+    cache_page_t* page = NULL;
+    if ((ret = page_cache_get (cache, page_addr, &page)) < 0) break;
+    memcpy (&page->data[offset], src, chunk);
+    for (size_t i = offset; i < offset + chunk; i++)
+      page->dirty_mask[i / 8] |= 1 << (i % 8);
+    page->dirty = true;
+    addr += chunk;
+    src += chunk;
+    len -= chunk;
+  }
+  pthread_mutex_unlock (&cache->lock);
+  return ret;
+}
+
+// write all the dirty pages back to the simulator, waiting for the busy ones
+static int page_cache_writeback (page_cache_t* cache) {
+  int ret = 0;
+  pthread_mutex_lock (&cache->lock);
+  cache_page_t* p = cache->lru.next;
+  while (p != &cache->lru) {
+    if (!p->dirty) p = p->next;
+    else if (p->busy) {
+      pthread_cond_wait (&cache->idle, &cache->lock);
+      p = cache->lru.next;
+    } else {
+      // a page stays in the list while written back
+      int status = page_cache_clean (cache, p);
+      if (ret == 0) ret = status;
+      p = p->next;
+    }
+  }
+  pthread_mutex_unlock (&cache->lock);
+  return ret;
+}
+
+// write back and drop an idle page, unless its write-back fails
+static int page_cache_remove (page_cache_t* cache, cache_page_t* page) {
+  int ret = page_cache_clean (cache, page);
+  if (ret == 0) page_cache_drop (cache, page);
+  return ret;
+}
+
+// Write back and drop the pages overlapping a byte range, so that accesses
+// bypassing the cache observe (and are observed by) later cached accesses.
+// The pages of the range are looked up when there are at most as many of them
+// as pages in the cache, or else the cache's pages are walked.
+static int page_cache_invalidate ( page_cache_t* cache
+                                 , uint64_t addr
+                                 , size_t len ) {
+  int ret = 0;
+  uint64_t first = addr & ~((uint64_t) PAGE_CACHE_PAGE_SIZE - 1);
+  pthread_mutex_lock (&cache->lock);
+  if ((addr + len - first) / PAGE_CACHE_PAGE_SIZE < (uint64_t) cache->n_pages) {
+    for (uint64_t a = first; a < addr + len; a += PAGE_CACHE_PAGE_SIZE) {
+      cache_page_t* page = page_cache_find_idle (cache, a);
+      int status = page ? page_cache_remove (cache, page) : 0;
+      if (ret == 0) ret = status;
+    }
+  } else {
+    cache_page_t* p = cache->lru.next;
+    while (p != &cache->lru) {
+      cache_page_t* next = p->next;
+      if (p->addr < first || p->addr >= addr + len) p = next;
+      else if (p->busy) {
+        pthread_cond_wait (&cache->idle, &cache->lock);
+        p = cache->lru.next;
+      } else {
+        int status = page_cache_clean (cache, p);
+        next = p->next;
+        if (status == 0) page_cache_drop (cache, p);
+        else if (ret == 0) ret = status;
+        p = next;
+      }
+    }
+  }
+  pthread_mutex_unlock (&cache->lock);
+  return ret;
+}
+
+static void page_cache_destroy (page_cache_t* cache) {
+  if (page_cache_writeback (cache) < 0)
+    fprintf (stderr, "page cache -- failed to write back dirty pages\n");
+  printf ( "page cache -- %lu hits, %lu misses, %lu write-backs\n"
+         , cache->hits, cache->misses, cache->writebacks );
+  pthread_cond_destroy (&cache->idle);
+  pthread_mutex_destroy (&cache->lock);
+  free (cache->buckets);
+  free (cache->pages);
+  free (cache);
+}
+
+#endif
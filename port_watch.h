@@ -0,0 +1,342 @@
+#ifndef PORT_WATCH_H
+#define PORT_WATCH_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_ports.h>
+#include <axi_poller.h>
+#include <shm_ring.h>
+#include <F2H.h>
+
+// Simulator ports connection management
+////////////////////////////////////////////////////////////////////////////////
+// A watcher thread follows the simulator ports folders with inotify, so that a
+// simulator can be restarted without remounting the devfs. A connected port
+// is disconnected when its folder or the file it is served through (its
+// shared memory rings, or one of its channel pipes) is removed or renamed, or
+// when a poller sees its simulator hang up. A disconnected port is reconnected
+// when its folder or one of these files is created again, or when one of its
+// channel pipes is opened, and a port served through shared memory is also
+// reconnected when new rings replace its rings. All the pending events are
+// read before the ports the pollers reported are disconnected, so that the
+// opens of a port's own connection are never mistaken for its simulator
+// coming back. Reconnections run on the watcher thread. The F2H port of each
+// node follows its folder and its channel pipes the same way.
+//
+// The watcher thread also runs the watchdog of every port (see axi_watchdog)
+// periodically, every second or every half of the shortest transaction
+// timeout, even when inotify is not available.
+
+#define PORT_WATCH_BUF 4096
+
+// bounds of the watchdog period
+#define PORT_WATCH_PERIOD_MS 1000
+#define PORT_WATCH_MIN_PERIOD_MS 10
+
+#define PORT_WATCH_NODE_MASK \
+  (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+#define PORT_WATCH_PORT_MASK \
+  ( IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_OPEN \
+  | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR )
+
+// the channel pipes of a port's folder, as laid out by BlueAXI4UnixBridges
+static const char* const port_watch_pipes[] =
+{ "aw", "w", AXI_POLLER_B_CHAN, "ar", AXI_POLLER_R_CHAN };
+
+// a watched folder, of a port or of the ports of a node
+typedef struct {
+  int wd;                   // inotify watch descriptor, or -1 while missing
+  const sim_node_t* node;
+  axi_sim_port_t* simport;  // or NULL for the node's ports folder
+  f2h_port_t* f2h;          // or NULL for the other folders
+} port_watch_dir_t;
+
+typedef struct port_watch {
+  int fd;                   // inotify descriptor, or -1 without inotify
+  int wakefd;               // eventfd, written by the pollers and to stop
+  int period_ms;            // of the watchdog
+  atomic_bool stop;
+  pthread_t thread;
+  sim_ports_t* simports;
+  int n_dirs;
+  port_watch_dir_t* dirs;   // the nodes' folders, then the ports' folders,
+                            // then the F2H ports' folders
+} port_watch_t;
+
+static bool port_watch_is_pipe (const char* name) {
+  for (size_t i = 0; i < sizeof (port_watch_pipes) / sizeof (char*); i++)
+    if (strcmp (name, port_watch_pipes[i]) == 0) return true;
+  return false;
+}
+
+static bool port_watch_is_port (const port_watch_dir_t* dir) {
+  return dir->simport || dir->f2h;
+}
+
+static const char* port_watch_dir_path (const port_watch_dir_t* dir) {
+  return dir->f2h ? dir->f2h->path : dir->simport->path;
+}
+
+// the name of a port's folder in its node's ports folder
+static const char* port_watch_dir_name (const port_watch_dir_t* dir) {
+  return strrchr (port_watch_dir_path (dir), '/') + 1;
+}
+
+// watch a port's folder, if it exists
+static void port_watch_add (port_watch_t* watch, port_watch_dir_t* dir) {
+  dir->wd =
+    inotify_add_watch (watch->fd, port_watch_dir_path (dir), PORT_WATCH_PORT_MASK);
+}
+
+// connect or disconnect the port of a folder
+static void port_watch_reconnect (port_watch_dir_t* dir) {
+  if (dir->f2h) f2h_connect (dir->f2h);
+  else axi_sim_port_reconnect (dir->simport);
+}
+
+static void port_watch_disconnect ( port_watch_dir_t* dir, axi_via_t via
+                                  , const char* why ) {
+  if (dir->f2h) f2h_disconnect (dir->f2h, why);
+  else axi_sim_port_disconnect (dir->simport, via, why);
+}
+
+static void port_watch_drop (port_watch_t* watch, port_watch_dir_t* dir) {
+  if (dir->wd >= 0) inotify_rm_watch (watch->fd, dir->wd);
+  dir->wd = -1;
+}
+
+static port_watch_dir_t* port_watch_find (port_watch_t* watch, int wd) {
+  for (int i = 0; i < watch->n_dirs; i++)
+    if (watch->dirs[i].wd == wd) return &watch->dirs[i];
+  return NULL;
+}
+
+// a port folder created in, or removed from, the ports folder of a node
+static void port_watch_node_event ( port_watch_t* watch
+                                  , const port_watch_dir_t* node_dir
+                                  , const struct inotify_event* ev ) {
+  if (!(ev->mask & IN_ISDIR) || ev->len == 0) return;
+  for (int i = 0; i < watch->n_dirs; i++) {
+    port_watch_dir_t* dir = &watch->dirs[i];
+    if (   !port_watch_is_port (dir) || dir->node != node_dir->node
+        || strcmp (ev->name, port_watch_dir_name (dir)) != 0 ) continue;
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+      port_watch_drop (watch, dir);
+      port_watch_add (watch, dir);
+      port_watch_reconnect (dir);
+    } else {
+      port_watch_drop (watch, dir);
+      port_watch_disconnect (dir, AXI_VIA_ANY, "folder removed");
+    }
+  }
+}
+
+// a change in the folder of a port (the F2H ports have no shared memory rings)
+static void port_watch_port_event ( port_watch_t* watch
+                                  , port_watch_dir_t* dir
+                                  , const struct inotify_event* ev ) {
+  if (ev->mask & IN_IGNORED) {
+    dir->wd = -1;
+    return;
+  }
+  if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    // a moved folder would still be watched at its new place
+    port_watch_drop (watch, dir);
+    port_watch_disconnect (dir, AXI_VIA_ANY, "folder removed");
+    return;
+  }
+  if (ev->len == 0) return;
+  bool shm = !dir->f2h && strcmp (ev->name, SHM_RING_FILE) == 0;
+  if (!shm && !port_watch_is_pipe (ev->name)) return;
+  axi_via_t via = shm ? AXI_VIA_SHM : AXI_VIA_FIFO;
+  if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+    port_watch_disconnect (dir, via, shm ? "rings removed" : "pipe removed");
+  else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+    // new rings come from a restarted simulator
+    if (shm) port_watch_disconnect (dir, via, "simulator restarted");
+    port_watch_reconnect (dir);
+  } else if ((ev->mask & IN_OPEN) && !shm) port_watch_reconnect (dir);
+}
+
+// handle all the pending inotify events
+static void port_watch_read (port_watch_t* watch) {
+  char buf[PORT_WATCH_BUF]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t len;
+  while ((len = read (watch->fd, buf, sizeof (buf))) > 0) {
+    for (char* p = buf; p < buf + len;) {
+      const struct inotify_event* ev = (const struct inotify_event*) p;
+      port_watch_dir_t* dir = port_watch_find (watch, ev->wd);
+      if (dir && port_watch_is_port (dir)) port_watch_port_event (watch, dir, ev);
+      else if (dir) port_watch_node_event (watch, dir, ev);
+      p += sizeof (struct inotify_event) + ev->len;
+    }
+  }
+}
+
+// half the shortest transaction timeout, within the watchdog period bounds
+static int port_watch_period_ms (const sim_ports_t* simports) {
+  uint64_t shortest = 2ull * PORT_WATCH_PERIOD_MS * 1000000;
+  for (int i = 0; i < simports->n_ports; i++)
+    if (simports->ports[i]->timeout_ns && simports->ports[i]->timeout_ns < shortest)
+      shortest = simports->ports[i]->timeout_ns;
+  for (int i = 0; i < simports->devs->n_entries; i++) {
+    uint64_t timeout = simports->devs->entries[i].timeout_ns;
+    if (timeout && timeout < shortest) shortest = timeout;
+  }
+  int period = shortest / 2000000;
+  return (period < PORT_WATCH_MIN_PERIOD_MS) ? PORT_WATCH_MIN_PERIOD_MS : period;
+}
+
+static void* port_watch_thread (void* arg) {
+  port_watch_t* watch = (port_watch_t*) arg;
+  sim_ports_t* simports = watch->simports;
+  struct pollfd fds[2] = { { .fd = watch->fd, .events = POLLIN }
+                         , { .fd = watch->wakefd, .events = POLLIN } };
+  uint64_t last = lat_now ();
+  while (!atomic_load (&watch->stop)) {
+    if (poll (fds, 2, watch->period_ms) < 0) {
+      if (errno == EINTR) continue;
+      perror ("port watch poll");
+      break;
+    }
+    port_watch_read (watch);
+    uint64_t n;
+    if (read (watch->wakefd, &n, sizeof (n)) < 0 && errno != EAGAIN)
+      perror ("port watch wakeup");
+    for (int i = 0; i < simports->n_ports; i++)
+      if (atomic_exchange (&simports->ports[i]->lost, false))
+        axi_sim_port_disconnect ( simports->ports[i], AXI_VIA_ANY
+                                , "simulator hung up" );
+    uint64_t now = lat_now ();
+    if (now - last >= watch->period_ms * 1000000ull) {
+      last = now;
+      for (int i = 0; i < simports->n_ports; i++)
+        axi_watchdog (simports->ports[i]);
+    }
+  }
+  return NULL;
+}
+
+// Watcher setup
+////////////////////////////////////////////////////////////////////////////////
+
+// Watch the ports folders of all the nodes, and start the watcher thread once
+// the pollers and the F2H ports are set up. If inotify is not available, the ports stay
+// connected once connected, and the thread only runs the watchdog.
+static port_watch_t* port_watch_create (sim_ports_t* simports) {
+  int wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakefd < 0) {
+    perror ("port watch setup");
+    return NULL;
+  }
+  int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) perror ("port watch inotify");
+  port_watch_t* watch = malloc (sizeof (port_watch_t));
+  watch->fd = fd;
+  watch->wakefd = wakefd;
+  watch->period_ms = port_watch_period_ms (simports);
+  atomic_init (&watch->stop, false);
+  watch->simports = simports;
+  watch->n_dirs = 2 * simports->n_nodes + simports->n_ports;
+  watch->dirs = malloc (watch->n_dirs * sizeof (port_watch_dir_t));
+  int ports_per_node = simports->n_ports / simports->n_nodes;
+  for (int k = 0; k < simports->n_nodes; k++) {
+    const sim_node_t* node = &simports->nodes[k];
+    watch->dirs[k] = (port_watch_dir_t)
+      { .wd = (fd < 0) ? -1 : inotify_add_watch (fd, node->path, PORT_WATCH_NODE_MASK)
+      , .node = node, .simport = NULL, .f2h = NULL };
+    if (fd >= 0 && watch->dirs[k].wd < 0)
+      fprintf (stderr, "%s -- cannot watch the ports folder\n", node->path);
+  }
+  for (int i = 0; i < simports->n_ports; i++) {
+    port_watch_dir_t* dir = &watch->dirs[simports->n_nodes + i];
+    dir->node = &simports->nodes[i / ports_per_node];
+    dir->simport = simports->ports[i];
+    dir->f2h = NULL;
+    dir->wd = -1;
+    if (fd >= 0) port_watch_add (watch, dir);
+  }
+  for (int k = 0; k < simports->n_nodes; k++) {
+    port_watch_dir_t* dir = &watch->dirs[simports->n_nodes + simports->n_ports + k];
+    *dir = (port_watch_dir_t)
+      { .wd = -1, .node = &simports->nodes[k], .simport = NULL
+      , .f2h = simports->nodes[k].f2h };
+    if (fd >= 0) port_watch_add (watch, dir);
+  }
+  for (int j = 0; j < simports->n_pollers; j++)
+    simports->pollers[j]->lostfd = wakefd;
+  pthread_create (&watch->thread, NULL, port_watch_thread, watch);
+  return watch;
+}
+
+// stop the watcher, before the ports and the pollers are destroyed
+static void port_watch_destroy (port_watch_t* watch) {
+  sim_ports_t* simports = watch->simports;
+  for (int j = 0; j < simports->n_pollers; j++) {
+    pthread_mutex_lock (&simports->pollers[j]->lock);
+    simports->pollers[j]->lostfd = -1;
+    pthread_mutex_unlock (&simports->pollers[j]->lock);
+  }
+  atomic_store (&watch->stop, true);
+  uint64_t one = 1;
+  if (write (watch->wakefd, &one, sizeof (one)) < 0) perror ("port watch stop");
+  pthread_join (watch->thread, NULL);
+  close (watch->wakefd);
+  if (watch->fd >= 0) close (watch->fd);
+  free (watch->dirs);
+  free (watch);
+}
+
+#endif
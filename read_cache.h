@@ -0,0 +1,204 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <mem_mapped_dev.h>
+#include <axi_engine.h>
+
+// Host side cache of the reads of read-mostly device registers
+////////////////////////////////////////////////////////////////////////////////
+// Unlike the page cache of memory devices, which owns the devices' contents,
+// this cache only keeps copies of the registers of a device whose cache policy
+// allows it, for as long as its TTL, and never holds writes. A miss reads the
+// whole line around it with a burst (and the following lines too for
+// prefetchable devices), clamped to the device range, so the lines at the
+// edges of the range only hold the bytes within it. Lines are dropped when
+// written through the devfs, on an explicit invalidation, and when the port
+// reconnects to a restarted simulator.
+
+#define READ_CACHE_LINE_SIZE 256
+#define READ_CACHE_LINES 64 // per device, direct mapped
+#define READ_CACHE_AHEAD 3  // lines read after a miss of a prefetchable device
+
+typedef struct {
+  uint64_t addr;         // line aligned
+  bool valid;
+  uint16_t lo;           // the bytes [lo, hi) of the line were read
+  uint16_t hi;
+  unsigned connection;   // of the port, when the line was read
+  uint64_t t_fill;       // when its read was issued
+  uint8_t data[READ_CACHE_LINE_SIZE];
+} read_cache_line_t;
+
+typedef struct read_cache {
+  axi_sim_port_t* simport;
+  const mem_mapped_dev_t* dev;
+  dev_stats_t* stats;
+  uint64_t ttl_ns;       // or 0 for lines kept until invalidated
+  int ahead;
+  pthread_mutex_t lock;
+  read_cache_line_t lines[READ_CACHE_LINES];
+} read_cache_t;
+
+static read_cache_line_t* read_cache_line (read_cache_t* cache, uint64_t addr) {
+  return &cache->lines[(addr / READ_CACHE_LINE_SIZE) % READ_CACHE_LINES];
+}
+
+// whether a line holds a fresh copy of a byte range of the line at an address
+static bool read_cache_fresh ( const read_cache_t* cache
+                             , const read_cache_line_t* line
+                             , uint64_t addr
+                             , size_t offset
+                             , size_t len
+                             , uint64_t now ) {
+  return line->valid && line->addr == addr
+      && offset >= line->lo && offset + len <= line->hi
+      && line->connection == atomic_load (&cache->simport->connections)
+      && (!cache->ttl_ns || now - line->t_fill < cache->ttl_ns);
+}
+
+// read the line at an address, and the lines ahead of it, once the posted
+// writes before them landed
+static int read_cache_fill (read_cache_t* cache, uint64_t addr) {
+  const mem_mapped_dev_t* dev = cache->dev;
+  uint8_t buf[(1 + READ_CACHE_AHEAD) * READ_CACHE_LINE_SIZE];
+  uint64_t first = addr < dev->base_addr ? dev->base_addr : addr;
+  uint64_t end = addr + (1 + cache->ahead) * READ_CACHE_LINE_SIZE;
+  if (end > dev->base_addr + dev->range) end = dev->base_addr + dev->range;
+  uint64_t t_fill = lat_now ();
+  unsigned connection = atomic_load (&cache->simport->connections);
+  axi_drain_posted (cache->simport);
+  int ret = axi_read (cache->simport, first, buf + (first - addr), end - first);
+  if (ret < 0) return ret;
+  for (uint64_t a = addr; a < end; a += READ_CACHE_LINE_SIZE) {
+    read_cache_line_t* line = read_cache_line (cache, a);
+    line->addr = a;
+    line->valid = true;
+    line->lo = (first > a) ? first - a : 0;
+    line->hi = (end < a + READ_CACHE_LINE_SIZE) ? end - a : READ_CACHE_LINE_SIZE;
+    line->connection = connection;
+    line->t_fill = t_fill;
+    memcpy ( line->data + line->lo, buf + (a - addr) + line->lo
+           , line->hi - line->lo );
+  }
+  return 0;
+}
+
+// Cache interface
+////////////////////////////////////////////////////////////////////////////////
+
+static read_cache_t* read_cache_create ( axi_sim_port_t* simport
+                                       , const mem_mapped_dev_t* dev
+                                       , dev_stats_t* stats ) {
+  read_cache_t* cache = calloc (1, sizeof (read_cache_t));
+  if (!cache) {
+    fprintf (stderr, "Failed to allocate the read cache of %s\n", dev->name);
+    exit (EXIT_FAILURE);
+  }
+  cache->simport = simport;
+  cache->dev = dev;
+  cache->stats = stats;
+  cache->ttl_ns = dev->cache_ttl_ms * 1000000ull;
+  cache->ahead = (dev->cache_policy == DEV_CACHE_PREFETCH) ? READ_CACHE_AHEAD : 0;
+  pthread_mutex_init (&cache->lock, NULL);
+  return cache;
+}
+
+// read a byte range of the device through the cache
+static int read_cache_read ( read_cache_t* cache
+                           , uint64_t addr
+                           , uint8_t* dst
+                           , size_t len ) {
+  int ret = 0;
+  pthread_mutex_lock (&cache->lock);
+  while (len > 0) {
+    uint64_t line_addr = addr & ~((uint64_t) READ_CACHE_LINE_SIZE - 1);
+    size_t offset = addr - line_addr;
+    size_t chunk = READ_CACHE_LINE_SIZE - offset;
+    if (chunk > len) chunk = len;
+    read_cache_line_t* line = read_cache_line (cache, line_addr);
+    if (read_cache_fresh (cache, line, line_addr, offset, chunk, lat_now ()))
+      atomic_fetch_add (&cache->stats->cache_hits, 1);
+    else {
+      atomic_fetch_add (&cache->stats->cache_misses, 1);
+      if ((ret = read_cache_fill (cache, line_addr)) < 0) break;
+    }
+    memcpy (dst, &line->data[offset], chunk);
+    addr += chunk;
+    dst += chunk;
+    len -= chunk;
+  }
+  pthread_mutex_unlock (&cache->lock);
+  return ret;
+}
+
+// drop the lines overlapping a byte range, once it was written (a read filling
+// them concurrently completes first)
+static void read_cache_invalidate ( read_cache_t* cache
+                                  , uint64_t addr
+                                  , size_t len ) {
+  pthread_mutex_lock (&cache->lock);
+  if (len >= READ_CACHE_LINES * READ_CACHE_LINE_SIZE)
+    for (int i = 0; i < READ_CACHE_LINES; i++) cache->lines[i].valid = false;
+  else {
+    uint64_t line_addr = addr & ~((uint64_t) READ_CACHE_LINE_SIZE - 1);
+    for (; line_addr < addr + len; line_addr += READ_CACHE_LINE_SIZE) {
+      read_cache_line_t* line = read_cache_line (cache, line_addr);
+      if (line->addr == line_addr) line->valid = false;
+    }
+  }
+  pthread_mutex_unlock (&cache->lock);
+}
+
+static void read_cache_destroy (read_cache_t* cache) {
+  pthread_mutex_destroy (&cache->lock);
+  free (cache);
+}
+
+#endif
@@ -0,0 +1,469 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+
+// Shared memory ring transport
+////////////////////////////////////////////////////////////////////////////////
+// A simulator supporting it creates a "shm" file in the folder of a port,
+// holding one single-producer / single-consumer ring of fixed-layout flits per
+// AXI4 channel, and serves the port through it instead of through its fifos.
+// Flits are written in place in the rings, so a busy port moves flits without
+// any system call. A side that finds a ring empty (or full) spins briefly and
+// then sleeps on a futex doorbell of the ring, which the other side only rings
+// when it sees a sleeper. The file is created under a temporary name and
+// renamed once initialized, so that its presence means it is ready.
+
+#define SHM_RING_FILE "shm"
+#define SHM_RING_MAGIC 0x314d485353414742ull // "BGASSHM1"
+#define SHM_RING_VERSION 1
+#define SHM_RING_ENTRIES 1024 // per channel, a power of two
+#define SHM_RING_SPIN 256     // polls of an empty or full ring before sleeping
+#define SHM_RING_ABORT_NS 10000000 // checks of a producer's abort word
+#define SHM_MAX_DATA_BYTES 128
+
+enum { SHM_AW, SHM_W, SHM_B, SHM_AR, SHM_R, SHM_CHANS };
+
+// the control words of a ring, each side writing to its own cache line
+typedef struct {
+  alignas (64) atomic_uint tail; // next entry to produce
+  atomic_uint prod_waiting;      // the producer sleeps on space_bell
+  alignas (64) atomic_uint head; // next entry to consume
+  atomic_uint cons_waiting;      // the consumer sleeps on data_bell
+  alignas (64) atomic_uint data_bell;
+  atomic_uint space_bell;
+} shm_ring_t;
+
+// AW and AR flits
+typedef struct {
+  uint64_t addr;
+  uint32_t id;
+  uint8_t len, size, burst, lock, cache, prot, qos, region;
+  uint8_t user;
+} shm_ax_t;
+
+typedef struct {
+  uint8_t data[SHM_MAX_DATA_BYTES];
+  uint8_t strb[SHM_MAX_DATA_BYTES / 8];
+  uint8_t last;
+  uint8_t user;
+} shm_w_t;
+
+typedef struct {
+  uint32_t id;
+  uint8_t resp;
+  uint8_t user;
+} shm_b_t;
+
+typedef struct {
+  uint8_t data[SHM_MAX_DATA_BYTES];
+  uint32_t id;
+  uint8_t resp;
+  uint8_t last;
+  uint8_t user;
+} shm_r_t;
+
+// layout of the shared file
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t entries;
+  uint32_t id_width;
+  uint32_t addr_width;
+  uint32_t data_width_bytes;
+  atomic_uint attached; // set by the devfs once it serves the port
+  shm_ring_t rings[SHM_CHANS];
+  shm_ax_t aw[SHM_RING_ENTRIES];
+  shm_w_t w[SHM_RING_ENTRIES];
+  shm_b_t b[SHM_RING_ENTRIES];
+  shm_ax_t ar[SHM_RING_ENTRIES];
+  shm_r_t r[SHM_RING_ENTRIES];
+} shm_layout_t;
+
+// a side's mapping of the shared file
+typedef struct shm_port {
+  shm_layout_t* map;
+  atomic_bool closing; // wakes this side's sleepers up for good
+  const atomic_int* abort; // gives this side's waiting sends up while
+                           // non-zero, or NULL
+} shm_port_t;
+
+static void shm_futex_wait ( atomic_uint* word, unsigned int val
+                           , const struct timespec* timeout ) {
+  syscall (SYS_futex, (unsigned int*) word, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void shm_futex_wake (atomic_uint* word) {
+  syscall (SYS_futex, (unsigned int*) word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Rings
+////////////////////////////////////////////////////////////////////////////////
+
+static void* shm_ring_entry (shm_layout_t* map, int chan, unsigned int idx) {
+  idx &= SHM_RING_ENTRIES - 1;
+  switch (chan) {
+    case SHM_AW: return &map->aw[idx];
+    case SHM_W:  return &map->w[idx];
+    case SHM_B:  return &map->b[idx];
+    case SHM_AR: return &map->ar[idx];
+    default:     return &map->r[idx];
+  }
+}
+
+// whether the entry idx of a ring can be produced, or consumed
+static bool shm_ring_ready (shm_ring_t* ring, bool producer, unsigned int idx) {
+  return producer ? idx - atomic_load (&ring->head) < SHM_RING_ENTRIES
+                  : atomic_load (&ring->tail) != idx;
+}
+
+// Wait on a ring's doorbell until the entry idx is ready. The doorbell is
+// sampled before announcing the sleeper and checking again, so a ring between
+// the two makes the futex wait return straight away. Returns false once
+// closing, or for a producer, once its abort word is set (which it checks
+// every SHM_RING_ABORT_NS while sleeping).
+static bool shm_ring_wait ( shm_port_t* port, shm_ring_t* ring
+                          , bool producer, unsigned int idx ) {
+  atomic_uint* waiting = producer ? &ring->prod_waiting : &ring->cons_waiting;
+  atomic_uint* bell = producer ? &ring->space_bell : &ring->data_bell;
+  const atomic_int* abort = producer ? port->abort : NULL;
+  const struct timespec slice = { .tv_sec = 0, .tv_nsec = SHM_RING_ABORT_NS };
+  for (int i = 0; i < SHM_RING_SPIN; i++)
+    if (shm_ring_ready (ring, producer, idx)) return true;
+  while (!shm_ring_ready (ring, producer, idx)) {
+    if (atomic_load (&port->closing)) return false;
+    if (abort && atomic_load (abort)) return false;
+    unsigned int seen = atomic_load (bell);
+    atomic_store (waiting, 1);
+    if (!shm_ring_ready (ring, producer, idx) && !atomic_load (&port->closing))
+      shm_futex_wait (bell, seen, abort ? &slice : NULL);
+    atomic_store (waiting, 0);
+  }
+  return true;
+}
+
+// ring the doorbell of a ring if the other side sleeps on it
+static void shm_ring_bell (atomic_uint* waiting, atomic_uint* bell) {
+  if (atomic_load (waiting)) {
+    atomic_fetch_add (bell, 1);
+    shm_futex_wake (bell);
+  }
+}
+
+// the next free entry of a ring, waiting for one if need be, or NULL once
+// closing
+static void* shm_ring_reserve (shm_port_t* port, int chan) {
+  shm_ring_t* ring = &port->map->rings[chan];
+  unsigned int tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  if (!shm_ring_wait (port, ring, true, tail)) return NULL;
+  return shm_ring_entry (port->map, chan, tail);
+}
+
+// publish the entry returned by shm_ring_reserve
+static void shm_ring_commit (shm_port_t* port, int chan) {
+  shm_ring_t* ring = &port->map->rings[chan];
+  atomic_fetch_add (&ring->tail, 1);
+  shm_ring_bell (&ring->cons_waiting, &ring->data_bell);
+}
+
+// the oldest entry of a ring, waiting for one if need be, or NULL once closing
+static void* shm_ring_peek (shm_port_t* port, int chan) {
+  shm_ring_t* ring = &port->map->rings[chan];
+  unsigned int head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  if (!shm_ring_wait (port, ring, false, head)) return NULL;
+  return shm_ring_entry (port->map, chan, head);
+}
+
+// free the entry returned by shm_ring_peek
+static void shm_ring_release (shm_port_t* port, int chan) {
+  shm_ring_t* ring = &port->map->rings[chan];
+  atomic_fetch_add (&ring->head, 1);
+  shm_ring_bell (&ring->prod_waiting, &ring->space_bell);
+}
+
+// Flits conversion
+////////////////////////////////////////////////////////////////////////////////
+// Only the low byte of IDs and user fields is carried, as by the engine.
+
+static void shm_put_addr (uint64_t* dst, const axi_port_fns_t* fns, const uint8_t* src) {
+  *dst = 0;
+  for (int i = 0; i < AXI_ADDR_BYTES (fns); i++) *dst |= (uint64_t) src[i] << (8 * i);
+}
+
+static void shm_get_addr (uint8_t* dst, const axi_port_fns_t* fns, uint64_t src) {
+  for (int i = 0; i < AXI_ADDR_BYTES (fns); i++) dst[i] = src >> (8 * i);
+}
+
+#define SHM_PUT_AX(e, fns, f, x) do { \
+  (e)->id = (f)->x##id[0]; \
+  shm_put_addr (&(e)->addr, fns, (f)->x##addr); \
+  (e)->len = (f)->x##len;     (e)->size = (f)->x##size; \
+  (e)->burst = (f)->x##burst; (e)->lock = (f)->x##lock; \
+  (e)->cache = (f)->x##cache; (e)->prot = (f)->x##prot; \
+  (e)->qos = (f)->x##qos;     (e)->region = (f)->x##region; \
+  (e)->user = (f)->x##user[0]; \
+} while (0)
+
+#define SHM_GET_AX(f, fns, e, x) do { \
+  (f)->x##id[0] = (e)->id; \
+  shm_get_addr ((f)->x##addr, fns, (e)->addr); \
+  (f)->x##len = (e)->len;     (f)->x##size = (e)->size; \
+  (f)->x##burst = (e)->burst; (f)->x##lock = (e)->lock; \
+  (f)->x##cache = (e)->cache; (f)->x##prot = (e)->prot; \
+  (f)->x##qos = (e)->qos;     (f)->x##region = (e)->region; \
+  (f)->x##user[0] = (e)->user; \
+} while (0)
+
+// Channels
+////////////////////////////////////////////////////////////////////////////////
+// The sends and receives of the five channels, for both sides of a port.
+// Each returns false once the port is closing, or a send once aborted.
+
+static bool shm_send_aw (shm_port_t* port, const axi_port_fns_t* fns, const t_axi4_awflit* f) {
+  shm_ax_t* e = shm_ring_reserve (port, SHM_AW);
+  if (!e) return false;
+  SHM_PUT_AX (e, fns, f, aw);
+  shm_ring_commit (port, SHM_AW);
+  return true;
+}
+
+static bool shm_send_ar (shm_port_t* port, const axi_port_fns_t* fns, const t_axi4_arflit* f) {
+  shm_ax_t* e = shm_ring_reserve (port, SHM_AR);
+  if (!e) return false;
+  SHM_PUT_AX (e, fns, f, ar);
+  shm_ring_commit (port, SHM_AR);
+  return true;
+}
+
+static bool shm_send_w (shm_port_t* port, const axi_port_fns_t* fns, const t_axi4_wflit* f) {
+  int dwb = fns->data_width_bytes;
+  shm_w_t* e = shm_ring_reserve (port, SHM_W);
+  if (!e) return false;
+  memcpy (e->data, f->wdata, dwb);
+  memcpy (e->strb, f->wstrb, (dwb + 7) / 8);
+  e->last = f->wlast;
+  e->user = f->wuser[0];
+  shm_ring_commit (port, SHM_W);
+  return true;
+}
+
+static bool shm_send_b (shm_port_t* port, const axi_port_fns_t* fns, const t_axi4_bflit* f) {
+  shm_b_t* e = shm_ring_reserve (port, SHM_B);
+  if (!e) return false;
+  e->id = f->bid[0];
+  e->resp = f->bresp;
+  e->user = f->buser[0];
+  shm_ring_commit (port, SHM_B);
+  return true;
+}
+
+static bool shm_send_r (shm_port_t* port, const axi_port_fns_t* fns, const t_axi4_rflit* f) {
+  shm_r_t* e = shm_ring_reserve (port, SHM_R);
+  if (!e) return false;
+  memcpy (e->data, f->rdata, fns->data_width_bytes);
+  e->id = f->rid[0];
+  e->resp = f->rresp;
+  e->last = f->rlast;
+  e->user = f->ruser[0];
+  shm_ring_commit (port, SHM_R);
+  return true;
+}
+
+static bool shm_recv_aw (shm_port_t* port, const axi_port_fns_t* fns, t_axi4_awflit* f) {
+  const shm_ax_t* e = shm_ring_peek (port, SHM_AW);
+  if (!e) return false;
+  SHM_GET_AX (f, fns, e, aw);
+  shm_ring_release (port, SHM_AW);
+  return true;
+}
+
+static bool shm_recv_ar (shm_port_t* port, const axi_port_fns_t* fns, t_axi4_arflit* f) {
+  const shm_ax_t* e = shm_ring_peek (port, SHM_AR);
+  if (!e) return false;
+  SHM_GET_AX (f, fns, e, ar);
+  shm_ring_release (port, SHM_AR);
+  return true;
+}
+
+static bool shm_recv_w (shm_port_t* port, const axi_port_fns_t* fns, t_axi4_wflit* f) {
+  int dwb = fns->data_width_bytes;
+  const shm_w_t* e = shm_ring_peek (port, SHM_W);
+  if (!e) return false;
+  memcpy (f->wdata, e->data, dwb);
+  memcpy (f->wstrb, e->strb, (dwb + 7) / 8);
+  f->wlast = e->last;
+  f->wuser[0] = e->user;
+  shm_ring_release (port, SHM_W);
+  return true;
+}
+
+static bool shm_recv_b (shm_port_t* port, const axi_port_fns_t* fns, t_axi4_bflit* f) {
+  const shm_b_t* e = shm_ring_peek (port, SHM_B);
+  if (!e) return false;
+  f->bid[0] = e->id;
+  f->bresp = e->resp;
+  f->buser[0] = e->user;
+  shm_ring_release (port, SHM_B);
+  return true;
+}
+
+static bool shm_recv_r (shm_port_t* port, const axi_port_fns_t* fns, t_axi4_rflit* f) {
+  const shm_r_t* e = shm_ring_peek (port, SHM_R);
+  if (!e) return false;
+  memcpy (f->rdata, e->data, fns->data_width_bytes);
+  f->rid[0] = e->id;
+  f->rresp = e->resp;
+  f->rlast = e->last;
+  f->ruser[0] = e->user;
+  shm_ring_release (port, SHM_R);
+  return true;
+}
+
+// Setup
+////////////////////////////////////////////////////////////////////////////////
+
+static shm_port_t* shm_port_map (int fd) {
+  shm_layout_t* map = mmap ( NULL, sizeof (shm_layout_t), PROT_READ | PROT_WRITE
+                           , MAP_SHARED, fd, 0 );
+  close (fd);
+  if (map == MAP_FAILED) return NULL;
+  shm_port_t* port = malloc (sizeof (shm_port_t));
+  port->map = map;
+  atomic_init (&port->closing, false);
+  port->abort = NULL;
+  return port;
+}
+
+// Attach to the rings of a port's folder, or return NULL if the simulator
+// does not provide them for this port configuration
+static shm_port_t* shm_port_open (const char* port_path, const axi_port_fns_t* fns) {
+  char path[strlen (port_path) + sizeof (SHM_RING_FILE) + 1];
+  sprintf (path, "%s/%s", port_path, SHM_RING_FILE);
+  int fd = open (path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (shm_layout_t)) {
+    close (fd);
+    return NULL;
+  }
+  shm_port_t* port = shm_port_map (fd);
+  if (!port) return NULL;
+  shm_layout_t* map = port->map;
+  if (   map->magic != SHM_RING_MAGIC
+      || map->version != SHM_RING_VERSION
+      || map->entries != SHM_RING_ENTRIES
+      || map->id_width != (uint32_t) fns->id_width
+      || map->addr_width != (uint32_t) fns->addr_width
+      || map->data_width_bytes != (uint32_t) fns->data_width_bytes ) {
+    fprintf (stderr, "%s -- incompatible shared memory rings, ignored\n", path);
+    munmap (map, sizeof (shm_layout_t));
+    free (port);
+    return NULL;
+  }
+  atomic_store (&map->attached, 1);
+  return port;
+}
+
+// Create the rings of a port in its folder, as a simulator does
+static shm_port_t* shm_port_create (const char* port_path, const axi_port_fns_t* fns) {
+  if (fns->data_width_bytes > SHM_MAX_DATA_BYTES) return NULL;
+  char path[strlen (port_path) + sizeof (SHM_RING_FILE) + 1];
+  char tmp[sizeof (path) + 4];
+  sprintf (path, "%s/%s", port_path, SHM_RING_FILE);
+  sprintf (tmp, "%s.tmp", path);
+  unlink (tmp);
+  int fd = open (tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0 || ftruncate (fd, sizeof (shm_layout_t)) < 0) {
+    if (fd >= 0) close (fd);
+    return NULL;
+  }
+  shm_port_t* port = shm_port_map (fd);
+  if (!port) return NULL;
+  shm_layout_t* map = port->map;
+  map->version = SHM_RING_VERSION;
+  map->entries = SHM_RING_ENTRIES;
+  map->id_width = fns->id_width;
+  map->addr_width = fns->addr_width;
+  map->data_width_bytes = fns->data_width_bytes;
+  atomic_store (&map->attached, 0);
+  map->magic = SHM_RING_MAGIC;
+  if (rename (tmp, path) < 0) {
+    munmap (map, sizeof (shm_layout_t));
+    free (port);
+    return NULL;
+  }
+  return port;
+}
+
+// wake this side's sleepers up, making all their sends and receives fail
+static void shm_port_stop (shm_port_t* port) {
+  atomic_store (&port->closing, true);
+  for (int i = 0; i < SHM_CHANS; i++) {
+    shm_ring_t* ring = &port->map->rings[i];
+    atomic_fetch_add (&ring->data_bell, 1);
+    shm_futex_wake (&ring->data_bell);
+    atomic_fetch_add (&ring->space_bell, 1);
+    shm_futex_wake (&ring->space_bell);
+  }
+}
+
+static void shm_port_close (shm_port_t* port) {
+  munmap (port->map, sizeof (shm_layout_t));
+  free (port);
+}
+
+#endif
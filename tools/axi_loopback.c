@@ -0,0 +1,389 @@
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+// Loopback stand-in for the simulator: serves the H2F ports of a device map
+// from RAM, so that the devfs can be run and measured without a simulator.
+//
+// axi_loopback PORTS_DIR [-m devmap] [-l latency_ns] [-o outstanding] [-s]
+//
+// -m devmap       the device map of the ports to serve (the built-in CHERI-BGAS
+//                 map by default), each port serving a RAM covering its devices
+// -l latency_ns   delay between a request and its response (0 by default)
+// -o outstanding  number of read and write requests accepted in flight per
+//                 port before back-pressuring the request channels (16 by
+//                 default)
+// -s              serve the ports through shared memory rings instead of
+//                 through their fifos
+//
+// Requests are answered in order. Accesses beyond the RAM get a DECERR
+// response. The loopback runs until interrupted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_burst.h>
+#include <devmap.h>
+#include <shm_ring.h>
+
+static uint64_t latency_ns = 0;
+static int max_outstanding = 16;
+static bool use_shm = false;
+
+// A request waiting for its response
+typedef struct {
+  uint8_t id;
+  uint64_t addr;
+  uint8_t len;
+  uint8_t size;
+  uint8_t burst;
+  uint8_t resp;   // writes are performed on arrival, only their B is delayed
+  uint64_t due;   // monotonic time of the response
+} lb_req_t;
+
+// A bounded queue of requests, in arrival order
+typedef struct {
+  lb_req_t* reqs;
+  int head;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} lb_queue_t;
+
+typedef struct {
+  const char* name;
+  char* path;
+  const axi_port_fns_t* fns;
+  baub_port_fifo_desc_t* fifo;
+  shm_port_t* shm; // or NULL when served through the fifos
+  uint8_t* mem;
+  uint64_t size;
+  lb_queue_t rd;
+  lb_queue_t wr;
+  t_axi4_arflit* ar;
+  t_axi4_rflit* r;
+  t_axi4_awflit* aw;
+  t_axi4_wflit* w;
+  t_axi4_bflit* b;
+  atomic_ulong n_reads;
+  atomic_ulong n_writes;
+} lb_port_t;
+
+static uint64_t now_ns () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until (uint64_t t) {
+  struct timespec ts = { .tv_sec = t / 1000000000ull
+                       , .tv_nsec = t % 1000000000ull };
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void lb_queue_init (lb_queue_t* q) {
+  q->reqs = malloc (max_outstanding * sizeof (lb_req_t));
+  q->head = q->count = 0;
+  pthread_mutex_init (&q->lock, NULL);
+  pthread_cond_init (&q->not_empty, NULL);
+  pthread_cond_init (&q->not_full, NULL);
+}
+
+static void lb_queue_push (lb_queue_t* q, const lb_req_t* req) {
+  pthread_mutex_lock (&q->lock);
+  while (q->count == max_outstanding) pthread_cond_wait (&q->not_full, &q->lock);
+  q->reqs[(q->head + q->count++) % max_outstanding] = *req;
+  pthread_cond_signal (&q->not_empty);
+  pthread_mutex_unlock (&q->lock);
+}
+
+// the oldest request, which stays in flight until dropped once answered
+static void lb_queue_peek (lb_queue_t* q, lb_req_t* req) {
+  pthread_mutex_lock (&q->lock);
+  while (q->count == 0) pthread_cond_wait (&q->not_empty, &q->lock);
+  *req = q->reqs[q->head];
+  pthread_mutex_unlock (&q->lock);
+}
+
+static void lb_queue_drop (lb_queue_t* q) {
+  pthread_mutex_lock (&q->lock);
+  q->head = (q->head + 1) % max_outstanding;
+  q->count--;
+  pthread_cond_signal (&q->not_full);
+  pthread_mutex_unlock (&q->lock);
+}
+
+static uint64_t lb_flit_addr (const lb_port_t* port, const uint8_t* axaddr) {
+  uint64_t addr = 0;
+  for (int i = 0; i < AXI_ADDR_BYTES (port->fns); i++)
+    addr |= (uint64_t) axaddr[i] << (8 * i);
+  return addr;
+}
+
+// Transport, fifos or shared memory rings
+////////////////////////////////////////////////////////////////////////////////
+
+static void lb_recv_ar (lb_port_t* port) {
+  if (port->shm) shm_recv_ar (port->shm, port->fns, port->ar);
+  else bub_fifo_ConsumeElement (port->fifo->ar, (void*) port->ar);
+}
+
+static void lb_recv_aw (lb_port_t* port) {
+  if (port->shm) shm_recv_aw (port->shm, port->fns, port->aw);
+  else bub_fifo_ConsumeElement (port->fifo->aw, (void*) port->aw);
+}
+
+static void lb_recv_w (lb_port_t* port) {
+  if (port->shm) shm_recv_w (port->shm, port->fns, port->w);
+  else bub_fifo_ConsumeElement (port->fifo->w, (void*) port->w);
+}
+
+static void lb_send_r (lb_port_t* port) {
+  if (port->shm) shm_send_r (port->shm, port->fns, port->r);
+  else bub_fifo_ProduceElement (port->fifo->r, (void*) port->r);
+}
+
+static void lb_send_b (lb_port_t* port) {
+  if (port->shm) shm_send_b (port->shm, port->fns, port->b);
+  else bub_fifo_ProduceElement (port->fifo->b, (void*) port->b);
+}
+
+// Request threads
+////////////////////////////////////////////////////////////////////////////////
+
+static void* lb_ar_thread (void* arg) {
+  lb_port_t* port = (lb_port_t*) arg;
+  for (;;) {
+    lb_recv_ar (port);
+    lb_req_t req = { .id = port->ar->arid[0]
+                   , .addr = lb_flit_addr (port, port->ar->araddr)
+                   , .len = port->ar->arlen
+                   , .size = port->ar->arsize
+                   , .burst = port->ar->arburst
+                   , .due = now_ns () + latency_ns };
+    lb_queue_push (&port->rd, &req);
+  }
+  return NULL;
+}
+
+static void* lb_aw_thread (void* arg) {
+  lb_port_t* port = (lb_port_t*) arg;
+  int dwb = port->fns->data_width_bytes;
+  for (;;) {
+    lb_recv_aw (port);
+    lb_req_t req = { .id = port->aw->awid[0]
+                   , .addr = lb_flit_addr (port, port->aw->awaddr)
+                   , .len = port->aw->awlen
+                   , .size = port->aw->awsize
+                   , .burst = port->aw->awburst
+                   , .resp = AXI4_RESP_OKAY };
+    for (int beat = 0; beat <= req.len; beat++) {
+      lb_recv_w (port);
+      uint64_t start =
+        axi_beat_addr (req.addr, req.size, req.len, req.burst, beat);
+      uint64_t lanes = start & ~((uint64_t) dwb - 1);
+      for (int i = 0; i < dwb; i++) {
+        if (!((port->w->wstrb[i / 8] >> (i % 8)) & 1)) continue;
+        if (lanes + i < port->size) port->mem[lanes + i] = port->w->wdata[i];
+        else req.resp = AXI4_RESP_DECERR;
+      }
+    }
+    req.due = now_ns () + latency_ns;
+    lb_queue_push (&port->wr, &req);
+  }
+  return NULL;
+}
+
+// Response threads
+////////////////////////////////////////////////////////////////////////////////
+
+static void* lb_r_thread (void* arg) {
+  lb_port_t* port = (lb_port_t*) arg;
+  int dwb = port->fns->data_width_bytes;
+  lb_req_t req;
+  for (;;) {
+    lb_queue_peek (&port->rd, &req);
+    sleep_until (req.due);
+    uint64_t size = 1 << req.size;
+    for (int beat = 0; beat <= req.len; beat++) {
+      uint64_t start =
+        axi_beat_addr (req.addr, req.size, req.len, req.burst, beat);
+      uint64_t end = (start & ~(size - 1)) + size;
+      memset (port->r->rdata, 0, dwb);
+      if (end <= port->size) {
+        for (uint64_t a = start; a < end; a++)
+          port->r->rdata[a % dwb] = port->mem[a];
+        port->r->rresp = AXI4_RESP_OKAY;
+      } else port->r->rresp = AXI4_RESP_DECERR;
+      port->r->rid[0] = req.id;
+      port->r->rlast = (beat == req.len) ? 1 : 0;
+      port->r->ruser[0] = 0;
+      lb_send_r (port);
+    }
+    lb_queue_drop (&port->rd);
+    atomic_fetch_add_explicit (&port->n_reads, 1, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+static void* lb_b_thread (void* arg) {
+  lb_port_t* port = (lb_port_t*) arg;
+  lb_req_t req;
+  for (;;) {
+    lb_queue_peek (&port->wr, &req);
+    sleep_until (req.due);
+    port->b->bid[0] = req.id;
+    port->b->bresp = req.resp;
+    port->b->buser[0] = 0;
+    lb_send_b (port);
+    lb_queue_drop (&port->wr);
+    atomic_fetch_add_explicit (&port->n_writes, 1, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+// Setup
+////////////////////////////////////////////////////////////////////////////////
+
+// open a port's fifos (or create its rings) the way the simulator does, and
+// start serving it
+static void lb_port_start ( lb_port_t* port
+                          , const devmap_port_t* desc
+                          , const char* ports_dir ) {
+  port->name = desc->name;
+  port->fns = desc->fns;
+  // a RAM covering all the devices of the port, only backed once touched
+  port->size = 0;
+  for (int i = 0; i < desc->n_devs; i++) {
+    uint64_t end = desc->devs[i].base_addr + desc->devs[i].range;
+    if (end > port->size) port->size = end;
+  }
+  port->mem = mmap ( NULL, port->size, PROT_READ | PROT_WRITE
+                   , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+  if (port->mem == MAP_FAILED) {
+    perror ("axi_loopback mmap");
+    exit (EXIT_FAILURE);
+  }
+  char* path = port->path = malloc (strlen (ports_dir) + strlen (port->name) + 2);
+  sprintf (path, "%s/%s", ports_dir, port->name);
+  mkdir (path, 0755);
+  port->fifo = NULL;
+  port->shm = NULL;
+  if (use_shm && !(port->shm = shm_port_create (path, port->fns))) {
+    fprintf (stderr, "axi_loopback -- failed to create the rings of %s\n", path);
+    exit (EXIT_FAILURE);
+  }
+  if (!port->shm) port->fifo = port->fns->fifo_OpenAsMaster (path);
+  lb_queue_init (&port->rd);
+  lb_queue_init (&port->wr);
+  port->ar = port->fns->ar_create_flit (NULL);
+  port->r  = port->fns->r_create_flit (NULL);
+  port->aw = port->fns->aw_create_flit (NULL);
+  port->w  = port->fns->w_create_flit (NULL);
+  port->b  = port->fns->b_create_flit (NULL);
+  atomic_init (&port->n_reads, 0);
+  atomic_init (&port->n_writes, 0);
+  pthread_t t;
+  pthread_create (&t, NULL, lb_ar_thread, port);
+  pthread_create (&t, NULL, lb_aw_thread, port);
+  pthread_create (&t, NULL, lb_r_thread, port);
+  pthread_create (&t, NULL, lb_b_thread, port);
+  printf ( "serving %s (%d-bit data) with 0x%" PRIx64 " bytes of RAM%s\n"
+         , port->name, port->fns->data_width_bytes * 8, port->size
+         , port->shm ? " through shared memory rings" : "" );
+}
+
+int main (int argc, char** argv) {
+  const char* devmap_path = NULL;
+  int opt;
+  while ((opt = getopt (argc, argv, "m:l:o:s")) != -1) {
+    switch (opt) {
+      case 'm': devmap_path = optarg; break;
+      case 'l': latency_ns = strtoull (optarg, NULL, 0); break;
+      case 'o': max_outstanding = atoi (optarg); break;
+      case 's': use_shm = true; break;
+      default: goto usage;
+    }
+  }
+  if (argc - optind != 1 || max_outstanding < 1) goto usage;
+  const char* ports_dir = argv[optind];
+  mkdir (ports_dir, 0755);
+
+  devmap_t* map = devmap_path ? devmap_load (devmap_path) : devmap_builtin ();
+  if (!map) return -1;
+
+  // serve the ports until interrupted
+  sigset_t sigs;
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGINT);
+  sigaddset (&sigs, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+  lb_port_t* ports = calloc (map->n_ports, sizeof (lb_port_t));
+  for (int i = 0; i < map->n_ports; i++)
+    lb_port_start (&ports[i], &map->ports[i], ports_dir);
+  fflush (stdout);
+  int sig;
+  sigwait (&sigs, &sig);
+  for (int i = 0; i < map->n_ports; i++) {
+    printf ( "%s -- %lu reads, %lu writes served\n", ports[i].name
+           , atomic_load (&ports[i].n_reads), atomic_load (&ports[i].n_writes) );
+    // leave no stale rings for the next devfs to attach to
+    if (ports[i].shm) {
+      char rings[strlen (ports[i].path) + sizeof (SHM_RING_FILE) + 1];
+      sprintf (rings, "%s/%s", ports[i].path, SHM_RING_FILE);
+      unlink (rings);
+    }
+  }
+  return 0;
+
+usage:
+  fprintf ( stderr, "%s PORTS_DIR [-m devmap] [-l latency_ns] [-o outstanding] [-s]\n"
+          , argv[0] );
+  return -1;
+}
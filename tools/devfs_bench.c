@@ -0,0 +1,281 @@
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+// Benchmark of a mounted devfs: runs each access pattern for a fixed duration
+// from 1 up to N client threads, and prints one CSV line per pattern and
+// number of threads.
+//
+// devfs_bench MOUNT_DIR [-t max_threads] [-d seconds] [-s block_size]
+//                       [-r reg_device] [-m mem_device] [-p patterns]
+//
+// Patterns (all by default, or a comma separated subset with -p):
+//   ioctl  alternating 4-byte FMEM_WRITE and FMEM_READ ioctls on reg_device
+//   rw     alternating block_size pwrite and pread calls on mem_device
+//   batch  FMEM_BATCH ioctls of FMEM_BATCH_MAX 4-byte writes then reads on
+//          reg_device (one operation per access)
+//   mmap   block_size memcpy into a shared mapping of mem_device, each
+//          followed by an msync (needs a cached coherence mode)
+//
+// Each thread accesses its own region of the device. The output columns are
+// pattern, threads, seconds, ops, ops_per_s and mb_per_s.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <fmem.h>
+
+#define N_PATTERNS 4
+static const char* pattern_names[N_PATTERNS] = { "ioctl", "rw", "batch", "mmap" };
+
+static const char* mount_dir;
+static const char* reg_dev = "virtual_device";
+static const char* mem_dev = "dma_window";
+static size_t block_size = 4096;
+static atomic_bool stop;
+static atomic_bool failed;
+
+typedef struct {
+  int pattern;
+  int index;
+  unsigned long ops;
+  unsigned long bytes;
+} worker_t;
+
+static double now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_dev (const char* name) {
+  char path[4096];
+  snprintf (path, sizeof (path), "%s/%s", mount_dir, name);
+  int fd = open (path, O_RDWR);
+  if (fd < 0) perror (path);
+  return fd;
+}
+
+static bool running () {
+  return !atomic_load_explicit (&stop, memory_order_relaxed);
+}
+
+static void fail (const char* what) {
+  perror (what);
+  atomic_store (&failed, true);
+  atomic_store (&stop, true);
+}
+
+static void run_ioctl (worker_t* w, int fd) {
+  struct fmem_request req = { .offset = 4 * w->index, .access_width = 4 };
+  while (running ()) {
+    req.data = w->ops;
+    bool write = (w->ops & 1) == 0;
+    if (ioctl (fd, write ? FMEM_WRITE : FMEM_READ, &req) < 0) {
+      fail ("fmem ioctl");
+      return;
+    }
+    w->ops++;
+    w->bytes += 4;
+  }
+}
+
+static void run_rw (worker_t* w, int fd) {
+  char* buf = calloc (1, block_size);
+  off_t offset = (off_t) w->index * block_size;
+  while (running ()) {
+    bool write = (w->ops & 1) == 0;
+    ssize_t n = write ? pwrite (fd, buf, block_size, offset)
+                      : pread (fd, buf, block_size, offset);
+    if (n < 0 || (size_t) n != block_size) {
+      fail (write ? "pwrite" : "pread");
+      break;
+    }
+    w->ops++;
+    w->bytes += block_size;
+  }
+  free (buf);
+}
+
+static void run_batch (worker_t* w, int fd) {
+  struct fmem_batch* batch = calloc (1, sizeof (struct fmem_batch));
+  while (running ()) {
+    bool write = ((w->ops / FMEM_BATCH_MAX) & 1) == 0;
+    batch->count = FMEM_BATCH_MAX;
+    for (int i = 0; i < FMEM_BATCH_MAX; i++)
+      batch->ops[i] = (struct fmem_op) {
+        .offset = 4 * (w->index * FMEM_BATCH_MAX + i), .data = i
+      , .access_width = 4, .cmd = write ? FMEM_OP_WRITE : FMEM_OP_READ };
+    if (ioctl (fd, FMEM_BATCH, batch) < 0) {
+      fail ("fmem batch ioctl");
+      break;
+    }
+    w->ops += FMEM_BATCH_MAX;
+    w->bytes += 4 * FMEM_BATCH_MAX;
+  }
+  free (batch);
+}
+
+static void run_mmap (worker_t* w, int fd) {
+  size_t page = sysconf (_SC_PAGESIZE);
+  size_t len = (block_size + page - 1) / page * page;
+  off_t offset = (off_t) w->index * len;
+  uint8_t* map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+  if (map == MAP_FAILED) {
+    fail ("mmap");
+    return;
+  }
+  char* buf = calloc (1, block_size);
+  while (running ()) {
+    buf[0] = w->ops;
+    memcpy (map, buf, block_size);
+    if (msync (map, len, MS_SYNC) < 0) {
+      fail ("msync");
+      break;
+    }
+    w->ops++;
+    w->bytes += block_size;
+  }
+  free (buf);
+  munmap (map, len);
+}
+
+static void* worker (void* arg) {
+  worker_t* w = (worker_t*) arg;
+  bool mem = w->pattern == 1 || w->pattern == 3;
+  int fd = open_dev (mem ? mem_dev : reg_dev);
+  if (fd < 0) {
+    atomic_store (&failed, true);
+    atomic_store (&stop, true);
+    return NULL;
+  }
+  switch (w->pattern) {
+    case 0: run_ioctl (w, fd); break;
+    case 1: run_rw (w, fd); break;
+    case 2: run_batch (w, fd); break;
+    case 3: run_mmap (w, fd); break;
+  }
+  close (fd);
+  return NULL;
+}
+
+// run a pattern with a number of threads, and print its results
+static bool run (int pattern, int n_threads, int duration) {
+  pthread_t* threads = malloc (n_threads * sizeof (pthread_t));
+  worker_t* workers = calloc (n_threads, sizeof (worker_t));
+  atomic_store (&stop, false);
+  atomic_store (&failed, false);
+  double start = now ();
+  for (int i = 0; i < n_threads; i++) {
+    workers[i] = (worker_t) { .pattern = pattern, .index = i };
+    pthread_create (&threads[i], NULL, worker, &workers[i]);
+  }
+  sleep (duration);
+  atomic_store (&stop, true);
+  unsigned long ops = 0;
+  unsigned long bytes = 0;
+  for (int i = 0; i < n_threads; i++) {
+    pthread_join (threads[i], NULL);
+    ops += workers[i].ops;
+    bytes += workers[i].bytes;
+  }
+  double secs = now () - start;
+  bool ok = !atomic_load (&failed);
+  if (ok)
+    printf ( "%s,%d,%.3f,%lu,%.1f,%.3f\n", pattern_names[pattern], n_threads
+           , secs, ops, ops / secs, bytes / secs / 1e6 );
+  else
+    fprintf ( stderr, "pattern %s failed with %d threads, skipped\n"
+            , pattern_names[pattern], n_threads );
+  fflush (stdout);
+  free (workers);
+  free (threads);
+  return ok;
+}
+
+int main (int argc, char** argv) {
+  int max_threads = 4;
+  int duration = 2;
+  char* patterns = NULL;
+  int opt;
+  while ((opt = getopt (argc, argv, "t:d:s:r:m:p:")) != -1) {
+    switch (opt) {
+      case 't': max_threads = atoi (optarg); break;
+      case 'd': duration = atoi (optarg); break;
+      case 's': block_size = strtoul (optarg, NULL, 0); break;
+      case 'r': reg_dev = optarg; break;
+      case 'm': mem_dev = optarg; break;
+      case 'p': patterns = optarg; break;
+      default: goto usage;
+    }
+  }
+  if (argc - optind != 1 || max_threads < 1 || block_size == 0) goto usage;
+  mount_dir = argv[optind];
+
+  printf ("pattern,threads,seconds,ops,ops_per_s,mb_per_s\n");
+  for (int p = 0; p < N_PATTERNS; p++) {
+    if (patterns) {
+      // match the pattern name against the comma separated list
+      bool selected = false;
+      char* list = strdup (patterns);
+      for (char* tok = strtok (list, ","); tok; tok = strtok (NULL, ","))
+        selected |= strcmp (tok, pattern_names[p]) == 0;
+      free (list);
+      if (!selected) continue;
+    }
+    // a failing pattern is not retried with more threads
+    for (int t = 1; t <= max_threads; t++)
+      if (!run (p, t, duration)) break;
+  }
+  return 0;
+
+usage:
+  fprintf ( stderr, "%s MOUNT_DIR [-t max_threads] [-d seconds] [-s block_size]"
+                    " [-r reg_device] [-m mem_device] [-p patterns]\n"
+          , argv[0] );
+  return -1;
+}
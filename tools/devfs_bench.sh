@@ -0,0 +1,72 @@
+#!/bin/sh
+# Benchmark the devfs against the loopback simulator stand-in: starts
+# tools/axi_loopback, mounts the devfs on its ports, runs tools/devfs_bench on
+# the mount, and tears everything down. Run from the repository root after
+# `make all tools`.
+#
+# tools/devfs_bench.sh [-l latency_ns] [-o outstanding] [-c coherence] [-s]
+#                      [-- devfs_bench options]
+#
+# -s serves the ports through shared memory rings instead of fifos.
+#
+# The CSV results of tools/devfs_bench are printed on stdout, and the logs of
+# the loopback and the devfs are left in the temporary work directory on
+# failure.
+
+latency=0
+outstanding=16
+coherence=writeback
+shm=
+while getopts "l:o:c:s" opt; do
+  case $opt in
+    l) latency=$OPTARG ;;
+    o) outstanding=$OPTARG ;;
+    c) coherence=$OPTARG ;;
+    s) shm=-s ;;
+    *) echo "usage: $0 [-l latency_ns] [-o outstanding] [-c coherence] [-s]" \
+            "[-- devfs_bench options]" >&2
+       exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+work=$(mktemp -d)
+mkdir "$work/ports" "$work/mnt"
+
+tools/axi_loopback "$work/ports" -l "$latency" -o "$outstanding" $shm \
+  > "$work/loopback.log" 2>&1 &
+loopback=$!
+
+# the rings must exist before the devfs looks for them, whereas opening the
+# fifos waits for both sides
+if [ -n "$shm" ]; then
+  until [ -s "$work/loopback.log" ]; do sleep 0.1; done
+fi
+
+# the devfs is run in the foreground of a background job, so that unmounting
+# it stops it
+(cd "$work" && exec "$OLDPWD/cheri-bgas-fuse-devfs" ports mnt -f \
+   -o log=off -o coherence="$coherence") > "$work/devfs.log" 2>&1 &
+devfs=$!
+
+# wait for the mount
+tries=0
+until [ -e "$work/mnt/.stats/counters" ]; do
+  tries=$((tries + 1))
+  if [ $tries -gt 100 ] || ! kill -0 $devfs 2> /dev/null; then
+    echo "devfs failed to mount, see $work" >&2
+    kill $loopback $devfs 2> /dev/null
+    exit 1
+  fi
+  sleep 0.1
+done
+
+tools/devfs_bench "$@" "$work/mnt"
+status=$?
+
+fusermount3 -u "$work/mnt"
+wait $devfs
+kill $loopback
+wait $loopback
+if [ $status -eq 0 ]; then rm -rf "$work"; else echo "see $work" >&2; fi
+exit $status
@@ -0,0 +1,182 @@
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+// Soak benchmark for a mounted devfs: hammers a device file with fmem ioctls
+// (or read calls) from several threads, and samples every second the devfs
+// daemon resident set size and the heap allocations of its transaction
+// engines, to check that they stay flat in steady state.
+//
+// fmem_soak DEVICE_FILE DAEMON_PID PATH_TO_DEVFS [-t threads] [-d seconds]
+//           [-r read_size]
+//
+// Prints one CSV line per second: elapsed seconds, total operations,
+// operations per second over the last second, daemon VmRSS in kB, and engine
+// allocations. Fails if the engines allocated after the first second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+
+#include <fmem.h>
+
+static const char* dev_path;
+static size_t read_size = 0;
+static atomic_ulong n_ops;
+static atomic_bool stop;
+
+static void* worker (void* arg) {
+  int fd = open (dev_path, O_RDWR);
+  if (fd < 0) {
+    perror (dev_path);
+    exit (EXIT_FAILURE);
+  }
+  char* buf = read_size ? malloc (read_size) : NULL;
+  struct fmem_request req = { .offset = 0, .data = 0, .access_width = 4 };
+  while (!atomic_load_explicit (&stop, memory_order_relaxed)) {
+    int ret = read_size ? pread (fd, buf, read_size, 0)
+                        : ioctl (fd, FMEM_READ, &req);
+    if (ret < 0) {
+      perror ("fmem_soak access");
+      exit (EXIT_FAILURE);
+    }
+    atomic_fetch_add_explicit (&n_ops, 1, memory_order_relaxed);
+  }
+  free (buf);
+  close (fd);
+  return NULL;
+}
+
+// total allocations of the transaction engines, from the allocs field of
+// the port lines of a devfs watchdog file, or -1
+static long engine_allocs (const char* watchdog) {
+  char line[512];
+  long total = -1;
+  FILE* f = fopen (watchdog, "r");
+  if (!f) return -1;
+  while (fgets (line, sizeof (line), f)) {
+    const char* field = strstr (line, " allocs ");
+    long n;
+    if (strncmp (line, "port ", 5) == 0 && field
+        && sscanf (field, " allocs %ld", &n) == 1)
+      total = (total < 0 ? 0 : total) + n;
+  }
+  fclose (f);
+  return total;
+}
+
+// resident set size of a process in kB, or -1
+static long vm_rss (int pid) {
+  char path[64];
+  char line[256];
+  long rss = -1;
+  snprintf (path, sizeof (path), "/proc/%d/status", pid);
+  FILE* f = fopen (path, "r");
+  if (!f) return -1;
+  while (fgets (line, sizeof (line), f))
+    if (sscanf (line, "VmRSS: %ld kB", &rss) == 1) break;
+  fclose (f);
+  return rss;
+}
+
+int main (int argc, char** argv) {
+  int n_threads = 4;
+  int duration = 60;
+  int opt;
+  while ((opt = getopt (argc, argv, "t:d:r:")) != -1) {
+    switch (opt) {
+      case 't': n_threads = atoi (optarg); break;
+      case 'd': duration = atoi (optarg); break;
+      case 'r': read_size = strtoul (optarg, NULL, 0); break;
+      default: goto usage;
+    }
+  }
+  if (argc - optind != 3) goto usage;
+  dev_path = argv[optind];
+  int pid = atoi (argv[optind + 1]);
+  char watchdog[4096];
+  snprintf (watchdog, sizeof (watchdog), "%s/.stats/watchdog", argv[optind + 2]);
+  if (engine_allocs (watchdog) < 0) {
+    fprintf (stderr, "no engine allocation counts in %s\n", watchdog);
+    return -1;
+  }
+
+  pthread_t* threads = malloc (n_threads * sizeof (pthread_t));
+  for (int i = 0; i < n_threads; i++)
+    pthread_create (&threads[i], NULL, worker, NULL);
+  printf ("seconds,ops,ops_per_s,rss_kb,allocs\n");
+  unsigned long last = 0;
+  long first_rss = -1;
+  long rss = -1;
+  long first_allocs = -1;
+  long allocs = -1;
+  for (int t = 1; t <= duration; t++) {
+    sleep (1);
+    unsigned long ops = atomic_load (&n_ops);
+    rss = vm_rss (pid);
+    allocs = engine_allocs (watchdog);
+    // steady state is measured from the end of the first second
+    if (first_rss < 0) first_rss = rss;
+    if (first_allocs < 0) first_allocs = allocs;
+    printf ("%d,%lu,%lu,%ld,%ld\n", t, ops, ops - last, rss, allocs);
+    fflush (stdout);
+    last = ops;
+  }
+  atomic_store (&stop, true);
+  for (int i = 0; i < n_threads; i++) pthread_join (threads[i], NULL);
+  free (threads);
+  fprintf ( stderr, "%lu operations, steady state rss growth %ld kB,"
+                    " %ld engine allocations\n"
+          , atomic_load (&n_ops), rss - first_rss, allocs - first_allocs );
+  if (allocs != first_allocs) {
+    fprintf (stderr, "engine allocations are not flat in steady state\n");
+    return 1;
+  }
+  return 0;
+
+usage:
+  fprintf ( stderr, "%s DEVICE_FILE DAEMON_PID PATH_TO_DEVFS [-t threads]"
+                    " [-d seconds] [-r read_size]\n", argv[0] );
+  return -1;
+}
@@ -0,0 +1,186 @@
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+// Offline decoder for the devfs binary traces: prints the traced flits in the
+// same text format as the per-port text logs of the DEVFS_LOG_TEXT log level.
+//
+// trace_decode TRACE_FILE [-p port] [-t]
+//
+// -p port  only print the flits of the named port (e.g. h2f_lw), producing
+//          the same output as the port's text log
+// -t       prefix each flit with its timestamp in nanoseconds
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <axi_ports.h>
+#include <trace.h>
+
+typedef struct {
+  char name[TRACE_MAX_NAME + 1];
+  int dwb;
+  const axi_port_fns_t* fns;
+  t_axi4_awflit* aw;
+  t_axi4_wflit*  w;
+  t_axi4_bflit*  b;
+  t_axi4_arflit* ar;
+  t_axi4_rflit*  r;
+} decoded_port_t;
+
+static decoded_port_t ports[TRACE_MAX_PORTS];
+
+static void declare_port (const trace_rec_t* rec, const uint8_t* payload) {
+  decoded_port_t* port = &ports[rec->id];
+  memcpy (port->name, payload, rec->size);
+  port->name[rec->size] = '\0';
+  port->dwb = rec->len;
+  // the AXI4 helpers of the port's configuration
+  port->fns = axi_port_impl_find (rec->burst, rec->addr, rec->len * 8);
+  if (!port->fns) {
+    fprintf ( stderr, "unsupported port \"%s\" configuration, its flits are"
+                      " skipped\n", port->name );
+    return;
+  }
+  port->aw = port->fns->aw_create_flit (NULL);
+  port->w  = port->fns->w_create_flit (NULL);
+  port->b  = port->fns->b_create_flit (NULL);
+  port->ar = port->fns->ar_create_flit (NULL);
+  port->r  = port->fns->r_create_flit (NULL);
+}
+
+static void print_flit ( const decoded_port_t* port
+                       , const trace_rec_t* rec
+                       , const uint8_t* payload ) {
+  int dwb = port->dwb;
+  switch (rec->chan) {
+    case TRACE_AW:
+      port->aw->awid[0] = rec->id;
+      for (int i = 0; i < AXI_ADDR_BYTES (port->fns); i++)
+        port->aw->awaddr[i] = rec->addr >> (8 * i);
+      port->aw->awlen = rec->len;
+      port->aw->awsize = rec->size;
+      port->aw->awburst = rec->burst;
+      port->fns->aw_fprint_flit (stdout, port->aw);
+      break;
+    case TRACE_W:
+      memcpy (port->w->wdata, payload, dwb);
+      memcpy (port->w->wstrb, payload + dwb, (dwb + 7) / 8);
+      port->w->wlast = rec->last;
+      port->fns->w_fprint_flit (stdout, port->w);
+      break;
+    case TRACE_B:
+      port->b->bid[0] = rec->id;
+      port->b->bresp = rec->resp;
+      port->fns->b_fprint_flit (stdout, port->b);
+      break;
+    case TRACE_AR:
+      port->ar->arid[0] = rec->id;
+      for (int i = 0; i < AXI_ADDR_BYTES (port->fns); i++)
+        port->ar->araddr[i] = rec->addr >> (8 * i);
+      port->ar->arlen = rec->len;
+      port->ar->arsize = rec->size;
+      port->ar->arburst = rec->burst;
+      port->fns->ar_fprint_flit (stdout, port->ar);
+      break;
+    case TRACE_R:
+      port->r->rid[0] = rec->id;
+      memcpy (port->r->rdata, payload, dwb);
+      port->r->rresp = rec->resp;
+      port->r->rlast = rec->last;
+      port->fns->r_fprint_flit (stdout, port->r);
+      break;
+  }
+  printf ("\n");
+}
+
+int main (int argc, char** argv) {
+  const char* only_port = NULL;
+  int timestamps = 0;
+  int opt;
+  while ((opt = getopt (argc, argv, "p:t")) != -1) {
+    switch (opt) {
+      case 'p': only_port = optarg; break;
+      case 't': timestamps = 1; break;
+      default: goto usage;
+    }
+  }
+  if (argc - optind != 1) goto usage;
+
+  FILE* f = fopen (argv[optind], "r");
+  if (!f) {
+    perror (argv[optind]);
+    return -1;
+  }
+  char magic[TRACE_MAGIC_LEN];
+  if (   fread (magic, TRACE_MAGIC_LEN, 1, f) != 1
+      || memcmp (magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+    fprintf (stderr, "%s is not a devfs trace\n", argv[optind]);
+    return -1;
+  }
+
+  trace_rec_t rec;
+  uint8_t payload[TRACE_MAX_PAYLOAD];
+  while (fread (&rec, sizeof (rec), 1, f) == 1) {
+    int dwb = (rec.chan == TRACE_PORT) ? 0 : ports[rec.port].dwb;
+    size_t n = trace_payload_bytes (&rec, dwb);
+    if (n > TRACE_MAX_PAYLOAD || (n && fread (payload, n, 1, f) != 1)) {
+      fprintf (stderr, "truncated trace\n");
+      return -1;
+    }
+    if (rec.chan == TRACE_PORT) {
+      declare_port (&rec, payload);
+      continue;
+    }
+    const decoded_port_t* port = &ports[rec.port];
+    if (!port->fns) continue;
+    if (only_port && strcmp (only_port, port->name) != 0) continue;
+    if (timestamps) printf ("%" PRIu64 " ", rec.timestamp);
+    if (!only_port) printf ("%s: ", port->name);
+    print_flit (port, &rec, payload);
+  }
+  fclose (f);
+  return 0;
+
+usage:
+  fprintf (stderr, "%s TRACE_FILE [-p port] [-t]\n", argv[0]);
+  return -1;
+}
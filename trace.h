@@ -0,0 +1,382 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <BlueUnixBridges.h>
+#include <BlueAXI4UnixBridges.h>
+
+// Logging verbosity
+////////////////////////////////////////////////////////////////////////////////
+
+typedef enum {
+  DEVFS_LOG_OFF   = 0, // no logging at all
+  DEVFS_LOG_TRACE = 1, // flits recorded in a binary trace
+  DEVFS_LOG_TEXT  = 2  // flits printed in per-port text logs, chatty stdout
+} devfs_log_level_t;
+
+static devfs_log_level_t devfs_log_level = DEVFS_LOG_TRACE;
+
+#define DEVFS_DEBUG(...) do { \
+  if (devfs_log_level >= DEVFS_LOG_TEXT) printf (__VA_ARGS__); \
+} while (0)
+
+// Binary trace format
+////////////////////////////////////////////////////////////////////////////////
+// A trace file is the TRACE_MAGIC string followed by a sequence of records.
+// Each record is a trace_rec_t header followed by a payload of
+// trace_payload_bytes () bytes:
+// - TRACE_PORT records declare a port: id is the port index used by the
+//   following records, len its data width in bytes, burst its ID width, addr
+//   its address width, and the payload its name
+// - W records carry the beat's data bytes followed by its strobe bytes
+// - R records carry the beat's data bytes
+// - AW, AR and B records have no payload
+
+#define TRACE_MAGIC "CHERIBGASTRACE02"
+#define TRACE_MAGIC_LEN 16
+
+enum {
+  TRACE_AW = 0,
+  TRACE_W,
+  TRACE_B,
+  TRACE_AR,
+  TRACE_R,
+  TRACE_PORT
+};
+
+typedef struct {
+  uint64_t timestamp; // CLOCK_MONOTONIC nanoseconds
+  uint8_t port;
+  uint8_t chan;
+  uint8_t id;
+  uint8_t len;
+  uint8_t size;
+  uint8_t burst;
+  uint8_t resp;
+  uint8_t last;
+  uint64_t addr;
+} trace_rec_t;
+
+#define TRACE_MAX_PORTS 256
+#define TRACE_MAX_NAME 32
+#define TRACE_MAX_DATA 64
+#define TRACE_MAX_PAYLOAD (TRACE_MAX_DATA + TRACE_MAX_DATA / 8)
+
+static size_t trace_payload_bytes (const trace_rec_t* rec, int dwb) {
+  switch (rec->chan) {
+    case TRACE_W: return dwb + (dwb + 7) / 8;
+    case TRACE_R: return dwb;
+    case TRACE_PORT: return rec->size;
+    default: return 0;
+  }
+}
+
+// Trace recording
+////////////////////////////////////////////////////////////////////////////////
+// The engine threads push records into a lock-free multi-producer ring of
+// fixed size slots (see mpsc_ring.h for the sequence number scheme), and a
+// writer thread drains it into the trace file in batches. Records are dropped
+// rather than stalling the engine when the ring is full.
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 4096 // must be a power of 2
+#endif
+
+typedef struct {
+  atomic_size_t seq;
+  trace_rec_t rec;
+  uint8_t payload[TRACE_MAX_PAYLOAD];
+} trace_slot_t;
+
+typedef struct {
+  trace_slot_t slots[TRACE_RING_SIZE];
+  _Alignas(64) atomic_size_t push_pos;
+  _Alignas(64) size_t pop_pos;
+  FILE* file;
+  pthread_t writer;
+  sem_t wakeup;
+  atomic_bool sleeping;
+  atomic_bool stop;
+  atomic_ulong n_dropped;
+  atomic_int n_ports;
+  int port_dwb[TRACE_MAX_PORTS];
+  int port_addr_bytes[TRACE_MAX_PORTS];
+} trace_t;
+
+static trace_t* trace = NULL;
+
+static uint64_t trace_now (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// claim a slot, or return NULL if the ring is full
+static trace_slot_t* trace_claim (size_t* pos_out) {
+  size_t pos = atomic_load_explicit (&trace->push_pos, memory_order_relaxed);
+  for (;;) {
+    trace_slot_t* slot = &trace->slots[pos & (TRACE_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit ( &trace->push_pos, &pos, pos + 1
+                                                , memory_order_relaxed
+                                                , memory_order_relaxed )) {
+        *pos_out = pos;
+        return slot;
+      }
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit (&trace->n_dropped, 1, memory_order_relaxed);
+      return NULL;
+    } else pos = atomic_load_explicit (&trace->push_pos, memory_order_relaxed);
+  }
+}
+
+// publish a filled slot, and wake the writer up if it went to sleep. The
+// fence orders the publication before the check of the sleeping flag, paired
+// with the writer's fence between raising the flag and checking the ring
+// again, so that either the writer sees the record or we see it sleeping.
+static void trace_publish (trace_slot_t* slot, size_t pos) {
+  atomic_store_explicit (&slot->seq, pos + 1, memory_order_release);
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_load_explicit (&trace->sleeping, memory_order_relaxed)
+      && atomic_exchange (&trace->sleeping, false))
+    sem_post (&trace->wakeup);
+}
+
+// claim a slot for a record of a traced port, with its header started, or
+// return NULL if tracing is off, the port is not traced or the ring is full
+static trace_slot_t* trace_record (int port, int chan, size_t* pos) {
+  if (!trace || port < 0) return NULL;
+  trace_slot_t* slot = trace_claim (pos);
+  if (!slot) return NULL;
+  slot->rec = (trace_rec_t) { .timestamp = trace_now ()
+                            , .port = port
+                            , .chan = chan };
+  return slot;
+}
+
+static uint64_t trace_addr (int port, const uint8_t* addr) {
+  uint64_t res = 0;
+  for (int i = 0; i < trace->port_addr_bytes[port]; i++)
+    res |= (uint64_t) addr[i] << (8 * i);
+  return res;
+}
+
+static void trace_aw (int port, const t_axi4_awflit* flit) {
+  size_t pos;
+  trace_slot_t* slot = trace_record (port, TRACE_AW, &pos);
+  if (!slot) return;
+  slot->rec.id = flit->awid[0];
+  slot->rec.addr = trace_addr (port, flit->awaddr);
+  slot->rec.len = flit->awlen;
+  slot->rec.size = flit->awsize;
+  slot->rec.burst = flit->awburst;
+  trace_publish (slot, pos);
+}
+
+static void trace_w (int port, const t_axi4_wflit* flit) {
+  size_t pos;
+  trace_slot_t* slot = trace_record (port, TRACE_W, &pos);
+  if (!slot) return;
+  int dwb = trace->port_dwb[port];
+  slot->rec.last = flit->wlast;
+  memcpy (slot->payload, flit->wdata, dwb);
+  memcpy (slot->payload + dwb, flit->wstrb, (dwb + 7) / 8);
+  trace_publish (slot, pos);
+}
+
+static void trace_b (int port, const t_axi4_bflit* flit) {
+  size_t pos;
+  trace_slot_t* slot = trace_record (port, TRACE_B, &pos);
+  if (!slot) return;
+  slot->rec.id = flit->bid[0];
+  slot->rec.resp = flit->bresp;
+  trace_publish (slot, pos);
+}
+
+static void trace_ar (int port, const t_axi4_arflit* flit) {
+  size_t pos;
+  trace_slot_t* slot = trace_record (port, TRACE_AR, &pos);
+  if (!slot) return;
+  slot->rec.id = flit->arid[0];
+  slot->rec.addr = trace_addr (port, flit->araddr);
+  slot->rec.len = flit->arlen;
+  slot->rec.size = flit->arsize;
+  slot->rec.burst = flit->arburst;
+  trace_publish (slot, pos);
+}
+
+static void trace_r (int port, const t_axi4_rflit* flit) {
+  size_t pos;
+  trace_slot_t* slot = trace_record (port, TRACE_R, &pos);
+  if (!slot) return;
+  slot->rec.id = flit->rid[0];
+  slot->rec.resp = flit->rresp;
+  slot->rec.last = flit->rlast;
+  memcpy (slot->payload, flit->rdata, trace->port_dwb[port]);
+  trace_publish (slot, pos);
+}
+
+// declare a port in the trace, and return its index for the flit records, or
+// -1 if it is not traced
+static int trace_port ( const char* name
+                       , int id_width
+                       , int addr_width
+                       , int dwb ) {
+  if (!trace) return -1;
+  int port = atomic_fetch_add (&trace->n_ports, 1);
+  if (port >= TRACE_MAX_PORTS) {
+    fprintf (stderr, "trace: too many ports, %s not traced\n", name);
+    return -1;
+  }
+  trace->port_dwb[port] = dwb;
+  trace->port_addr_bytes[port] = (addr_width + 7) / 8;
+  size_t pos;
+  trace_slot_t* slot;
+  // port declarations must not be dropped
+  while (!(slot = trace_claim (&pos))) sched_yield ();
+  size_t len = strnlen (name, TRACE_MAX_NAME);
+  slot->rec = (trace_rec_t) { .timestamp = trace_now ()
+                            , .chan = TRACE_PORT
+                            , .id = port
+                            , .len = dwb
+                            , .size = len
+                            , .burst = id_width
+                            , .addr = addr_width };
+  memcpy (slot->payload, name, len);
+  trace_publish (slot, pos);
+  return port;
+}
+
+// Trace writer
+////////////////////////////////////////////////////////////////////////////////
+
+// write all the currently published records, return how many were written
+static size_t trace_drain (void) {
+  size_t n = 0;
+  for (;;) {
+    size_t pos = trace->pop_pos;
+    trace_slot_t* slot = &trace->slots[pos & (TRACE_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+    if ((intptr_t) seq - (intptr_t) (pos + 1) < 0) break;
+    int dwb = (slot->rec.chan == TRACE_PORT) ? 0
+                                            : trace->port_dwb[slot->rec.port];
+    fwrite (&slot->rec, sizeof (trace_rec_t), 1, trace->file);
+    fwrite ( slot->payload, trace_payload_bytes (&slot->rec, dwb), 1
+           , trace->file );
+    atomic_store_explicit ( &slot->seq, pos + TRACE_RING_SIZE
+                          , memory_order_release );
+    trace->pop_pos = pos + 1;
+    n++;
+  }
+  return n;
+}
+
+static void* trace_writer (void* arg) {
+  while (!atomic_load (&trace->stop)) {
+    if (trace_drain () > 0) continue;
+    // nothing to write, flush and sleep until a producer rings, once the
+    // sleeping flag is raised and the ring checked again for the records
+    // published meanwhile (see trace_publish)
+    fflush (trace->file);
+    atomic_store (&trace->sleeping, true);
+    atomic_thread_fence (memory_order_seq_cst);
+    if (trace_drain () > 0) {
+      atomic_store (&trace->sleeping, false);
+      continue;
+    }
+    sem_wait (&trace->wakeup);
+    atomic_store (&trace->sleeping, false);
+  }
+  trace_drain ();
+  fflush (trace->file);
+  return NULL;
+}
+
+static int trace_open (const char* path) {
+  trace_t* t = (trace_t*) calloc (1, sizeof (trace_t));
+  if (!t) return -1;
+  if ((t->file = fopen (path, "w")) == NULL) {
+    fprintf (stderr, "Failed fopen(\"%s\", \"w\"): ", path);
+    perror (NULL);
+    free (t);
+    return -1;
+  }
+  setvbuf (t->file, NULL, _IOFBF, 1 << 20);
+  fwrite (TRACE_MAGIC, TRACE_MAGIC_LEN, 1, t->file);
+  for (size_t i = 0; i < TRACE_RING_SIZE; i++) atomic_init (&t->slots[i].seq, i);
+  atomic_init (&t->push_pos, 0);
+  t->pop_pos = 0;
+  sem_init (&t->wakeup, 0, 0);
+  atomic_init (&t->sleeping, false);
+  atomic_init (&t->stop, false);
+  atomic_init (&t->n_dropped, 0);
+  atomic_init (&t->n_ports, 0);
+  trace = t;
+  pthread_create (&t->writer, NULL, trace_writer, NULL);
+  return 0;
+}
+
+static void trace_close (void) {
+  if (!trace) return;
+  atomic_store (&trace->stop, true);
+  sem_post (&trace->wakeup);
+  pthread_join (trace->writer, NULL);
+  if (atomic_load (&trace->n_dropped))
+    fprintf ( stderr, "trace: %lu records dropped\n"
+            , atomic_load (&trace->n_dropped) );
+  fclose (trace->file);
+  sem_destroy (&trace->wakeup);
+  free (trace);
+  trace = NULL;
+}
+
+#endif
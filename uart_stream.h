@@ -0,0 +1,390 @@
+#ifndef UART_STREAM_H
+#define UART_STREAM_H
+
+/*-
+* SPDX-License-Identifier: BSD-2-Clause
+*
+* Copyright (c) 2023 Alexandre Joannou <aj443@cam.ac.uk>
+*
+* This material is based upon work supported by the DoD Information Analysis
+* Center Program Management Office (DoD IAC PMO), sponsored by the Defense
+* Technical Information Center (DTIC) under Contract No. FA807518D0004.  Any
+* opinions, findings and conclusions or recommendations expressed in this
+* material are those of the author(s) and do not necessarily reflect the views
+* of the Air Force Installation Contracting Agency (AFICA).
+*
+* This work was supported by Innovate UK project 105694, "Digital Security
+* by Design (DSbD) Technology Platform Prototype".
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* $FreeBSD$
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <fuse.h>
+
+#include <CHERI_BGAS_fuse_devfs.h>
+#include <mem_mapped_dev.h>
+#include <dev_registry.h>
+#include <axi_engine.h>
+#include <dev_poll.h>
+
+// Stream views of UART-like devices
+////////////////////////////////////////////////////////////////////////////////
+// A device with stream registers (see devmap.h) also gets a DEVICE.stream file,
+// whose reads and writes go through host side ring buffers rather than the
+// device's registers, like a tty. While the file is open, a thread per stream
+// moves the bytes between the rings and the device, in rounds of pipelined
+// register accesses: when the last status read shows so, a round reads a
+// received byte and writes as many bytes as the TX FIFO takes, and then reads
+// the status again (together with the received byte, when not sending). The
+// accesses are ordered on a single AXI4 ID, and a data register is only read
+// once a status read told it holds a byte, so no byte is ever lost. A stream
+// with nothing to move checks its device's status every poll period. Once its
+// file is closed, a stream sends the bytes it still holds, and then leaves the
+// device alone.
+
+#define UART_STREAM_RING 4096 // bytes buffered in each direction
+
+typedef struct {
+  uint8_t buf[UART_STREAM_RING];
+  size_t head;
+  size_t len;
+} uart_ring_t;
+
+typedef struct uart_stream {
+  dev_entry_t* entry;
+  char* name;           // the stream's path in the devfs, without the leading '/'
+  uint64_t data_addr;
+  uint64_t status_addr;
+  uint64_t idle_ns;     // between the status reads of an idle stream
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  // signaled on any change of the rings or opens
+  uart_ring_t rx;
+  uart_ring_t tx;
+  int n_open;
+  bool stop;
+  poll_waiters_t waiters;
+  pthread_t thread;
+} uart_stream_t;
+
+// copy bytes into a ring, as many as fit
+static size_t uart_ring_put (uart_ring_t* r, const uint8_t* src, size_t n) {
+  if (n > UART_STREAM_RING - r->len) n = UART_STREAM_RING - r->len;
+  for (size_t i = 0; i < n; i++)
+    r->buf[(r->head + r->len + i) % UART_STREAM_RING] = src[i];
+  r->len += n;
+  return n;
+}
+
+// copy the oldest bytes of a ring, as many as it holds
+static size_t uart_ring_peek (const uart_ring_t* r, uint8_t* dst, size_t n) {
+  if (n > r->len) n = r->len;
+  for (size_t i = 0; i < n; i++)
+    dst[i] = r->buf[(r->head + i) % UART_STREAM_RING];
+  return n;
+}
+
+static void uart_ring_drop (uart_ring_t* r, size_t n) {
+  r->head = (r->head + n) % UART_STREAM_RING;
+  r->len -= n;
+}
+
+// wait for a change of a stream (with the stream locked), for at most ns
+static void uart_stream_sleep (uart_stream_t* s, uint64_t ns) {
+  struct timespec deadline;
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  ns += deadline.tv_nsec;
+  deadline.tv_sec += ns / 1000000000;
+  deadline.tv_nsec = ns % 1000000000;
+  pthread_cond_timedwait (&s->cond, &s->lock, &deadline);
+}
+
+// prepare an ordered single access to a register of a stream's device
+static void uart_stream_txn ( uart_stream_t* s
+                            , axi_txn_t* txn
+                            , axi_txn_kind_t kind
+                            , uint64_t addr
+                            , size_t len
+                            , uint8_t* buf ) {
+  axi_txn_burst ( txn, kind, s->entry->simport->fns->data_width_bytes
+                , addr, len );
+  txn->ordered = true;
+  if (kind == AXI_TXN_READ) txn->rdst = buf;
+  else txn->wsrc = buf;
+}
+
+// One round of register accesses, as told by the last status read, which is
+// then updated. Returns the number of bytes moved, or a negative errno.
+static int uart_stream_round (uart_stream_t* s, uint32_t* status) {
+  axi_sim_port_t* simport = s->entry->simport;
+  const dev_stream_regs_t* regs = &s->entry->dev->stream;
+  axi_txn_t txns[2 + DEV_STREAM_MAX_FIFO];
+  uint8_t rx_byte = 0;
+  uint8_t tx_bytes[DEV_STREAM_MAX_FIFO];
+  uint32_t next = 0;
+  pthread_mutex_lock (&s->lock);
+  bool rx = (*status & regs->rx_ready) && s->n_open > 0
+         && s->rx.len < UART_STREAM_RING;
+  int n_tx = (*status & regs->tx_ready)
+           ? uart_ring_peek (&s->tx, tx_bytes, regs->tx_fifo) : 0;
+  pthread_mutex_unlock (&s->lock);
+  int n = 0;
+  if (rx) uart_stream_txn (s, &txns[n++], AXI_TXN_READ, s->data_addr, 1, &rx_byte);
+  for (int i = 0; i < n_tx; i++)
+    uart_stream_txn (s, &txns[n++], AXI_TXN_WRITE, s->data_addr, 1, &tx_bytes[i]);
+  // the status must be read once the written bytes are in the TX FIFO
+  if (n_tx == 0)
+    uart_stream_txn (s, &txns[n++], AXI_TXN_READ, s->status_addr, 4, (uint8_t*) &next);
+  for (int i = 0; i < n; i++) axi_submit (simport, &txns[i]);
+  // a received byte is kept even if the rest of the round fails, and the
+  // bytes to send are sent again if any of their writes fails
+  int k = 0;
+  int rx_ret = rx ? axi_wait (simport, &txns[k++]) : 0;
+  int tx_ret = 0;
+  for (int i = 0; i < n_tx; i++) {
+    int ret = axi_wait (simport, &txns[k++]);
+    if (tx_ret == 0) tx_ret = ret;
+  }
+  int status_ret = (n_tx == 0) ? axi_wait (simport, &txns[k++])
+                 : (tx_ret == 0) ? axi_read (simport, s->status_addr, (uint8_t*) &next, 4)
+                 : tx_ret;
+  rx = rx && rx_ret == 0;
+  if (tx_ret < 0) n_tx = 0;
+  pthread_mutex_lock (&s->lock);
+  if (rx) uart_ring_put (&s->rx, &rx_byte, 1);
+  uart_ring_drop (&s->tx, n_tx);
+  if (rx || n_tx) {
+    pthread_cond_broadcast (&s->cond);
+    poll_waiters_wake (&s->waiters);
+  }
+  pthread_mutex_unlock (&s->lock);
+  if (rx) atomic_fetch_add (&s->entry->stats.stream_rx, 1);
+  atomic_fetch_add (&s->entry->stats.stream_tx, n_tx);
+  if (rx_ret < 0) return rx_ret;
+  if (status_ret < 0) return status_ret;
+  *status = next;
+  return rx + n_tx;
+}
+
+// whether a status read tells a stream has bytes to move (with the stream
+// locked), only receiving while its file is open
+static bool uart_stream_busy (const uart_stream_t* s, uint32_t status) {
+  const dev_stream_regs_t* regs = &s->entry->dev->stream;
+  return (   (status & regs->rx_ready) && s->n_open > 0
+          && s->rx.len < UART_STREAM_RING )
+      || ((status & regs->tx_ready) && s->tx.len > 0);
+}
+
+static void* uart_stream_thread (void* arg) {
+  uart_stream_t* s = (uart_stream_t*) arg;
+  uint32_t status = 0;
+  bool known = false; // whether status is the device's current one
+  pthread_mutex_lock (&s->lock);
+  while (!s->stop) {
+    if (s->n_open == 0 && s->tx.len == 0) {
+      pthread_cond_wait (&s->cond, &s->lock);
+      known = false;
+      continue;
+    }
+    if (known && !uart_stream_busy (s, status)) {
+      // the clients signal their reads and writes
+      uart_stream_sleep (s, s->idle_ns);
+      known = false;
+      continue;
+    }
+    pthread_mutex_unlock (&s->lock);
+    int ret = known ? uart_stream_round (s, &status)
+                    : axi_read ( s->entry->simport, s->status_addr
+                               , (uint8_t*) &status, 4 );
+    pthread_mutex_lock (&s->lock);
+    known = ret >= 0;
+    // a device which cannot be reached is retried every poll period
+    if (ret < 0 && !s->stop) uart_stream_sleep (s, s->idle_ns);
+  }
+  pthread_mutex_unlock (&s->lock);
+  return NULL;
+}
+
+// Streams interface
+////////////////////////////////////////////////////////////////////////////////
+// The reads of a stream return as soon as it received any byte, and its
+// writes as soon as all their bytes are buffered, both waiting for as long as
+// it takes unless their file is non-blocking or their request interrupted.
+
+// create the streams of the registered devices which have stream registers,
+// checking idle streams every idle_ms milliseconds
+static uart_stream_t* uart_streams_create ( dev_registry_t* devs
+                                          , int idle_ms
+                                          , int* n_streams ) {
+  int n = 0;
+  for (int i = 0; i < devs->n_entries; i++)
+    if (devs->entries[i].dev->stream.enabled) n++;
+  *n_streams = n;
+  if (n == 0) return NULL;
+  uart_stream_t* streams = calloc (n, sizeof (uart_stream_t));
+  if (!streams) {
+    fprintf (stderr, "Failed to allocate the device streams\n");
+    exit (EXIT_FAILURE);
+  }
+  for (int i = 0, j = 0; i < devs->n_entries; i++) {
+    dev_entry_t* e = &devs->entries[i];
+    if (!e->dev->stream.enabled) continue;
+    uart_stream_t* s = &streams[j++];
+    s->entry = e;
+    s->name = malloc (strlen (e->name) + strlen (UART_STREAM_SUFFIX) + 1);
+    sprintf (s->name, "%s" UART_STREAM_SUFFIX, e->name);
+    s->data_addr = e->dev->base_addr + e->dev->stream.data_offset;
+    s->status_addr = e->dev->base_addr + e->dev->stream.status_offset;
+    s->idle_ns = (idle_ms > 0 ? idle_ms : 1) * 1000000ull;
+    pthread_mutex_init (&s->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&s->cond, &attr);
+    pthread_condattr_destroy (&attr);
+    pthread_create (&s->thread, NULL, uart_stream_thread, s);
+  }
+  return streams;
+}
+
+// lookup a stream from its path in the devfs
+static uart_stream_t* uart_stream_find ( uart_stream_t* streams
+                                       , int n_streams
+                                       , const char* path ) {
+  for (int i = 0; i < n_streams; i++)
+    if (strcmp (streams[i].name, path + 1) == 0) return &streams[i];
+  return NULL;
+}
+
+static void uart_stream_open (uart_stream_t* s) {
+  pthread_mutex_lock (&s->lock);
+  s->n_open++;
+  pthread_cond_broadcast (&s->cond);
+  pthread_mutex_unlock (&s->lock);
+}
+
+static void uart_stream_release (uart_stream_t* s) {
+  pthread_mutex_lock (&s->lock);
+  s->n_open--;
+  pthread_mutex_unlock (&s->lock);
+}
+
+// wait for a change of a stream, for a request which is not interrupted
+static int uart_stream_wait (uart_stream_t* s) {
+  if (axi_interrupted && axi_interrupted ()) return -EINTR;
+  uart_stream_sleep (s, AXI_WAIT_SLICE_NS);
+  return 0;
+}
+
+static int uart_stream_read ( uart_stream_t* s
+                            , uint8_t* buf
+                            , size_t size
+                            , bool nonblock ) {
+  int ret = 0;
+  pthread_mutex_lock (&s->lock);
+  while (size > 0 && s->rx.len == 0 && ret == 0)
+    ret = nonblock ? -EAGAIN : uart_stream_wait (s);
+  if (ret == 0) {
+    ret = uart_ring_peek (&s->rx, buf, size);
+    uart_ring_drop (&s->rx, ret);
+    pthread_cond_broadcast (&s->cond);
+  }
+  pthread_mutex_unlock (&s->lock);
+  return ret;
+}
+
+static int uart_stream_write ( uart_stream_t* s
+                             , const uint8_t* buf
+                             , size_t size
+                             , bool nonblock ) {
+  size_t done = 0;
+  int ret = 0;
+  pthread_mutex_lock (&s->lock);
+  while (done < size && ret == 0) {
+    size_t n = uart_ring_put (&s->tx, buf + done, size - done);
+    if (n > 0) {
+      done += n;
+      pthread_cond_broadcast (&s->cond);
+    } else ret = nonblock ? -EAGAIN : uart_stream_wait (s);
+  }
+  pthread_mutex_unlock (&s->lock);
+  return done > 0 ? (int) done : ret;
+}
+
+// wait for all the buffered bytes to be sent
+static int uart_stream_sync (uart_stream_t* s) {
+  int ret = 0;
+  pthread_mutex_lock (&s->lock);
+  while (s->tx.len > 0 && ret == 0) ret = uart_stream_wait (s);
+  pthread_mutex_unlock (&s->lock);
+  return ret;
+}
+
+// readable with received bytes, and writable with room to buffer more, the
+// poll handle, if any, being kept until a requested event happens
+static int uart_stream_poll ( uart_stream_t* s
+                            , unsigned events
+                            , struct fuse_pollhandle* ph
+                            , unsigned* reventsp ) {
+  pthread_mutex_lock (&s->lock);
+  *reventsp = 0;
+  if (s->rx.len > 0) *reventsp |= POLLIN | POLLRDNORM;
+  if (s->tx.len < UART_STREAM_RING) *reventsp |= POLLOUT | POLLWRNORM;
+  if (ph) {
+    if (*reventsp & (events ? events : POLLIN)) fuse_pollhandle_destroy (ph);
+    else poll_waiters_add (&s->waiters, ph);
+  }
+  pthread_mutex_unlock (&s->lock);
+  return 0;
+}
+
+static void uart_streams_destroy (uart_stream_t* streams, int n_streams) {
+  for (int i = 0; i < n_streams; i++) {
+    uart_stream_t* s = &streams[i];
+    pthread_mutex_lock (&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast (&s->cond);
+    pthread_mutex_unlock (&s->lock);
+    pthread_join (s->thread, NULL);
+    printf ( "%s -- %lu bytes received, %lu bytes sent\n", s->name
+           , atomic_load (&s->entry->stats.stream_rx)
+           , atomic_load (&s->entry->stats.stream_tx) );
+    poll_waiters_drop (&s->waiters);
+    pthread_cond_destroy (&s->cond);
+    pthread_mutex_destroy (&s->lock);
+    free (s->name);
+  }
+  free (streams);
+}
+
+#endif